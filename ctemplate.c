@@ -15,7 +15,7 @@
  *
  * <TMPL_Tag_Var name = "varname" default = "value" fmt = "fmtname">
  * <TMPL_Tag_Include name = "filename">
- * <TMPL_Tag_Loop name = "loopname">
+ * <TMPL_Tag_Loop name = "loopname" offset = N limit = N step = N>
  * <TMPL_Tag_Break level = N>
  * <TMPL_Tag_Continue level = N>
  * </TMPL_Tag_Loop>
@@ -25,7 +25,8 @@
  * </TMPL_Tag_If>
  *
  * The "name =" attribute is required, and the "value =", "fmt =",
- * "default =", and "level ="  attributes are optional.
+ * "default =", "offset =", "limit =", "step =" and "level ="
+ * attributes are optional.
  *
  * A comment is any text enclosed by <* and *>
  *
@@ -40,6 +41,8 @@
  * to link the tagnodes into a parse tree.
  */
 
+#define _GNU_SOURCE
+
 #include <string.h>
 #include <ctype.h>
 #include <stdlib.h>
@@ -47,12 +50,75 @@
 #include <stdio.h>
 #include <sys/stat.h>
 #include <stdarg.h>
+#include <limits.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <fcntl.h>
+#include <time.h>
+#include <ucontext.h>
+#include <stdint.h>
+#include <math.h>
+#ifndef TMPL_NO_ZLIB
+#include <zlib.h>
+#endif
 #include <ctemplate.h>
 
 /* To prevent infinite TMPL_Tag_Include cycles, we limit the depth */
 
 #define MAX_INCLUDE_DEPTH 30
 
+/* PREFETCH() hints that we will soon read the memory at "p" */
+
+#ifdef __GNUC__
+#define PREFETCH(p) __builtin_prefetch(p)
+#else
+#define PREFETCH(p) ((void) 0)
+#endif
+
+/* a render with a deadline checks the clock every DEADLINE_STEPS steps */
+
+#define DEADLINE_STEPS 64
+
+/* stack size of the coroutine that runs a resumable render */
+
+#define RESUME_STACK (256 * 1024)
+
+/*
+ * A gathered render collects up to GATHER_IOVS pieces of output and
+ * copies up to GATHER_SCRATCH bytes of output that are not stable
+ * before writing them with writev().
+ */
+
+#if IOV_MAX < 1024
+#define GATHER_IOVS IOV_MAX
+#else
+#define GATHER_IOVS 1024
+#endif
+#define GATHER_SCRATCH (16 * 1024)
+
+/* where the output of a render goes */
+
+#define SINK_FILE   0     /* a file pointer */
+#define SINK_CHUNK  1     /* the buffer of a resumable render */
+#define SINK_GATHER 2     /* a file descriptor written with writev() */
+#define SINK_BUFFER 3     /* a buffer in the render context */
+#define SINK_GZIP   4     /* a file pointer, deflated as we go */
+#define SINK_NONE   5     /* nowhere (we only hash the output) */
+
+/*
+ * A gzip render deflates its output into a GZIP_BUF byte buffer.  It
+ * deflates each text sequence of GZIP_SPLICE bytes or more only once
+ * and copies the deflated bytes in later renders.
+ */
+
+#define GZIP_BUF    (16 * 1024)
+#define GZIP_SPLICE 1024
+
+/* number of hash buckets in a fragment cache */
+
+#define CACHE_BUCKETS 256
+
 
 /* template tag kinds (used in bitmaps) */
 
@@ -99,7 +165,62 @@ static char* TMPL_Operator_Names[] = {
 
 
 typedef struct tagnode tagnode;
-typedef struct template template;
+typedef struct TMPL_template template;
+typedef struct heap heap;
+typedef struct section section;
+typedef struct window window;
+typedef struct cacheentry cacheentry;
+typedef struct cache cache;
+typedef struct resumable resumable;
+typedef struct gather gather;
+typedef struct loopstate loopstate;
+typedef struct gzsink gzsink;
+typedef struct deflated deflated;
+
+/*
+ * A variable value as the walker sees it.  A typed value stays a
+ * number until we output it.  A VAL_FUNC variable has a callback that
+ * computes its value, so the walker sees a VAL_STRING.  A VAL_STREAM
+ * variable has a callback that writes its value to the output.
+ */
+
+enum { VAL_STRING, VAL_INT, VAL_DOUBLE, VAL_BOOL, VAL_FUNC, VAL_STREAM };
+
+typedef struct {
+    int type;             /* VAL_STRING etc. */
+    int prec;             /* decimal places of a VAL_DOUBLE, or -1 */
+    const char *str;      /* value of a VAL_STRING */
+    long long i;          /* value of a VAL_INT or VAL_BOOL */
+    double d;             /* value of a VAL_DOUBLE */
+    TMPL_streamfunc
+        stream;           /* callback of a VAL_STREAM */
+    void *arg;            /* its argument */
+} varvalue;
+
+/*
+ * A heap is an allocator and its counters.  Every block we allocate
+ * starts with a header that points to the heap it came from, so that
+ * we can free any block without knowing where it was allocated.  The
+ * header keeps a copy of the allocator too, so that a block is
+ * resized and freed by the allocator that allocated it even if the
+ * heap has been given another allocator since.
+ */
+
+struct heap {
+    TMPL_allocator alloc;
+    TMPL_alloc_stats stats;
+};
+
+typedef union {
+    struct {
+        heap *heap;       /* heap the block came from */
+        size_t size;      /* size requested by the caller */
+        TMPL_allocator alloc;  /* allocator the block came from */
+    }
+    h;
+    long double align;    /* keeps the caller's memory aligned */
+}
+blockhdr;
 
 /* The parse tree consists of tagnodes */
 
@@ -113,6 +234,7 @@ struct tagnode {
         struct {
             const char *start;
             int len;
+            deflated *deflated;  /* for gzip renders (if long enough) */
         }
         text;
 
@@ -120,7 +242,9 @@ struct tagnode {
 
         struct {
             const char *varname, *dfltval;
+            const char *fmtname;     /* non-null if fmtfunc is */
             TMPL_fmtfunc fmtfunc;
+            int slot;                /* see findslots(), or -1 */
         }
         var;
 
@@ -128,7 +252,9 @@ struct tagnode {
 
         struct {
             const char *varname, *operator, *testval;
+            varvalue testnum;    /* "testval" if a number */
             tagnode *tbranch, *fbranch;
+            int slot;            /* see findslots(), or -1 */
         }
         ifelse;
 
@@ -137,6 +263,10 @@ struct tagnode {
         struct {
             const char *loopname;
             tagnode *body;
+            section *section;    /* non-null if output is cached */
+            window *window;      /* non-null if not all rows output */
+            int slot;            /* see findslots(), or -1 */
+            int nslots;          /* slots of the body's lookup cache */
         }
         loop;
 
@@ -152,18 +282,208 @@ struct tagnode {
         struct {
             const char *filename;
             template *tmpl;
+            section *section;    /* non-null if output is cached */
+            int raw;             /* true if output without parsing */
         }
         include;
     }
     tag;
 };
 
+/*
+ * A TMPL_Tag_Loop or TMPL_Tag_Include tag with a "cache =" attribute
+ * is a cached section.  Its output depends only on the variables and
+ * loop variables named in "deps", so we can save its output in a
+ * fragment cache using a hash of their values as the key.  The
+ * names point into the section's parse tree.
+ */
+
+struct section {
+    unsigned long id;     /* identifies the section in a cache */
+    int ttl;              /* seconds to keep output, 0 for default */
+    int complete;         /* false if "deps" misses unparsed includes */
+    int ndeps;            /* number of names in "deps" */
+    int maxdeps;          /* size of "deps" */
+    const char **deps;    /* names the section depends on */
+};
+
+/*
+ * A TMPL_Tag_Loop tag with "offset =", "limit =" or "step =" attributes
+ * outputs only some rows of its loop variable.  Each attribute is a
+ * number or the name of a variable whose value is the number.
+ */
+
+typedef struct {
+    long num;             /* the number if "var" is null */
+    const char *var;      /* variable that holds the number */
+} windowattr;
+
+struct window {
+    windowattr offset;    /* index of the first row, 0 by default */
+    windowattr limit;     /* number of rows, -1 (all) by default */
+    windowattr step;      /* output every step'th row, backward if < 0 */
+};
+
+/* A fragment cache entry holds the output of a cached section */
+
+struct cacheentry {
+    cacheentry *next;     /* next entry in the same hash bucket */
+    cacheentry *newer;    /* next more recently used entry */
+    cacheentry *older;    /* next less recently used entry */
+    unsigned long id;     /* section id */
+    unsigned long long
+        key;              /* hash of the section's dependencies */
+    unsigned long long
+        expires;          /* expiration time, zero for never */
+    size_t len;           /* length of output */
+    char data[1];         /* output */
+};
+
+/*
+ * A fragment cache belongs to a render context.  When the output
+ * saved exceeds "maxbytes" we discard the least recently used entries.
+ */
+
+struct cache {
+    size_t maxbytes;      /* most output bytes that we save */
+    size_t bytes;         /* output bytes saved */
+    int ttl;              /* default seconds to keep output */
+    cacheentry *newest;   /* most recently used entry */
+    cacheentry *oldest;   /* least recently used entry */
+    cacheentry *bucket[CACHE_BUCKETS];
+};
+
+/* buffer is a growable array of characters */
+
+typedef struct {
+    char *data;
+    size_t len;           /* number of characters used */
+    size_t size;          /* number of characters allocated */
+}
+buffer;
+
+/*
+ * A resumable render runs the walker as a coroutine on its own stack.
+ * The walker copies output to the caller's buffer and switches back
+ * to the caller when the buffer is full.
+ */
+
+struct resumable {
+    ucontext_t caller;    /* where TMPL_render_next() was called */
+    ucontext_t walker;    /* where the walker is suspended */
+    char *stack;          /* the walker's stack */
+    template *tmpl;       /* template being output */
+    const TMPL_varlist
+        *varlist;         /* its variables */
+    char *buf;            /* the caller's buffer */
+    size_t cap;           /* size of "buf" */
+    size_t len;           /* number of bytes in "buf" */
+    int active;           /* true from start until the walker is done */
+    int done;             /* true when the walker is done */
+    unsigned long long
+        start;            /* time the render started */
+};
+
+/*
+ * A gathered render writes to a file descriptor.  Most output is
+ * text from the template or variable values, which stay put until
+ * the render is done, so we just point at them.  We copy other output
+ * to "scratch".
+ */
+
+struct gather {
+    int fd;               /* output file descriptor */
+    int niov;             /* number of pieces in "iov" */
+    size_t used;          /* number of bytes used in "scratch" */
+    struct iovec iov[GATHER_IOVS];
+    char scratch[GATHER_SCRATCH];
+};
+
+/*
+ * A gzip render deflates its output with "zs" as raw deflate data and
+ * writes it to ctx->out in a gzip header and trailer.  If the library
+ * is compiled with TMPL_NO_ZLIB, then it does not need zlib and there
+ * are no gzip renders.
+ */
+
+#ifndef TMPL_NO_ZLIB
+
+struct gzsink {
+    z_stream zs;          /* deflate stream */
+    int ready;            /* true if "zs" is initialized */
+    int level;            /* compression level of "zs" */
+    uLong crc;            /* CRC-32 of the output so far */
+    uLong size;           /* length of the output so far (mod 2^32) */
+    unsigned char out[GZIP_BUF];
+};
+
+/*
+ * A long text sequence is deflated on its own for gzip renders and
+ * kept in its tagnode.  The deflated data ends on a byte boundary and
+ * refers to nothing before it, so we can copy it into the output of
+ * any render at the same level after a Z_SYNC_FLUSH.  We also keep
+ * the end of the text, which the deflate stream needs as its
+ * dictionary afterward.
+ */
+
+struct deflated {
+    int level;            /* compression level */
+    uLong crc;            /* CRC-32 of the text as output */
+    uLong len;            /* length of the text as output */
+    size_t zlen;          /* length of the deflated data */
+    size_t dictlen;       /* length of the end of the text */
+    unsigned char *dict;  /* end of the text (follows the data) */
+    unsigned char data[1];/* deflated data */
+};
+
+#endif
+
+/*
+ * Each loop statement being output keeps its place in a loopstate on
+ * the walker's stack, from which we compute the loop metadata
+ * variables (__counter__ etc.) only when a tag asks for them.
+ *
+ * It also has a lookup cache with a slot for each name in the loop
+ * body (see findslots()), which is in ctx->slots so that a loop can
+ * nest to any depth.  A slot holds what the name is in the variable
+ * lists that enclose the loop variable, which stay the same for
+ * every row.
+ *
+ * A loop variable may come from the base of a variable list, whose
+ * rows then enclose only the base.  "resume" is then the variable
+ * list we looked the loop variable up in, where a lookup that fails
+ * in a row and the lists that enclose it carries on (see
+ * outervalue()).
+ */
+
+struct loopstate {
+    loopstate *outer;     /* enclosing loop statement (if any) */
+    const TMPL_varlist
+        *resume;          /* where lookups carry on after a row (if any) */
+    size_t first;         /* index of the first row to output */
+    long step;            /* distance to the next row to output */
+    size_t count;         /* number of rows to output */
+    size_t index;         /* number of rows output so far */
+    size_t slotbase;      /* index of the first slot in ctx->slots */
+    int nslots;           /* number of slots */
+};
+
+enum { SLOT_EMPTY, SLOT_FOUND, SLOT_MISSING };
+
+typedef struct {
+    int vstate;           /* SLOT_EMPTY etc. for the variable */
+    int lstate;           /* SLOT_EMPTY etc. for the loop variable */
+    varvalue v;           /* the variable's value if found */
+    TMPL_loop *loop;      /* the loop variable if found */
+} slot;
+
 /* template information */
 
-struct template {
+struct TMPL_template {
+    heap *heap;            /* where we allocate memory */
     const char *filename;  /* name of template file */
     const char *tmplstr;   /* contents of template file */
-    FILE *out;             /* template output file pointer */
+    int ownstr;            /* true if we must free tmplstr */
     FILE *errout;          /* error output file pointer */
     tagnode *roottag;      /* root of parse tree */
     const TMPL_fmtlist
@@ -176,12 +496,102 @@ struct template {
     tagnode *curtag;      /* current tagnode being parsed */
     int linenum;          /* current template line number */
     int tagline;          /* line number of current tag's name */
-    int error;            /* error indicator */
+    int error;            /* syntax error indicator */
+    int nomem;            /* true if we ran out of memory */
     int include_depth;    /* avoids TMPL_Tag_Include cycles */
     int loop_depth;       /* current loop nesting depth */
+    int trimleft;         /* true if the tag scanned began with {{- */
+    int trimright;        /* true if the tag scanned ended with -}} */
+    int trimnext;         /* true if the next text follows a -}} */
+    int minify;           /* true if we minify text (see minify()) */
+    int rawelem;          /* element whose text we keep as is, or -1 */
+    tagnode reusable;     /* reusable storage for simple tags */
+};
+
+/*
+ * A render context holds the state of one render of a template
+ * (including the templates that it includes) along with options and
+ * statistics that persist from one render to the next.  A context
+ * must not be used by more than one thread at a time, so we never
+ * need to lock it.
+ */
+
+struct TMPL_context {
+    heap heap;            /* allocator for templates compiled with me */
+    int sink;             /* where output goes (SINK_FILE etc.) */
+    FILE *out;            /* template output file pointer */
+    FILE *errout;         /* error output file pointer */
+    FILE *fmtout;         /* output file pointer for format functions */
+    FILE *cookie;         /* stream that sends its output to emit() */
+    int error;            /* error indicator (TMPL_ERROR or TMPL_ENOMEM) */
     int break_level;      /* for processing a TMPL_Tag_Break tag */
     int cont_level;       /* for processing a TMPL_Tag_Continue tag */
-    tagnode reusable;     /* reusable storage for simple tags */
+    int stats_enabled;    /* true if we collect statistics */
+    int minify;           /* true if templates compiled are minified */
+    int hashing;          /* true if we hash the output of renders */
+    int mapping;          /* true if we record an output map */
+    unsigned long long
+        hash;             /* hash of the output of the current render */
+    unsigned long long
+        nbytes;           /* bytes output by the current render */
+    TMPL_stats stats;     /* statistics */
+    cache *cache;         /* fragment cache (if any) */
+    buffer capture;       /* output of cached sections being output */
+    int capdepth;         /* number of cached sections being output */
+    int capfailed;        /* true if "capture" ran out of memory */
+    resumable *resume;    /* resumable render (if any) */
+    gather *gather;       /* gathered render (if any) */
+    gzsink *gz;           /* gzip render (if any) */
+    unsigned long long
+        maxbytes;         /* most bytes a render may output, 0 for any */
+    unsigned long
+        maxiters;         /* most loop iterations in a render, 0 for any */
+    unsigned long
+        maxincludes;      /* most files a render may include, 0 for any */
+    unsigned long maxms;  /* most milliseconds a render may take, 0 for any */
+    unsigned long iters;  /* loop iterations in the current render */
+    unsigned long
+        includes;         /* files included by the current render */
+    unsigned long long
+        deadline;         /* time the current render must end, or 0 */
+    int steps;            /* steps until we check "deadline" */
+    buffer outbuf;        /* output for SINK_BUFFER */
+    buffer pending;       /* format output that did not fit in "buf" */
+    int infmt;            /* true while a format function runs */
+    loopstate *loop;      /* innermost loop statement being output */
+    buffer slots;         /* lookup caches of loops (slot array) */
+    char numbuf[64];      /* a number formatted for output */
+    buffer scratch;       /* a char array column value with a null */
+    buffer memos;         /* VAL_FUNC values of this render (memo array) */
+    buffer memovals;      /* the strings of "memos" */
+    const TMPL_fmtlist
+        *genfmts;         /* format functions for generated code */
+    unsigned long long
+        genstart;         /* start time of a render by generated code */
+};
+
+/*
+ * An output map records where the output of each tag at the top level
+ * of a template went in a render, and the names that the output
+ * depends on, so that TMPL_rerender() can copy the output of tags
+ * whose names have not changed.  Text and tags whose output never
+ * changes (raw included files, BREAK and CONTINUE) are not recorded.
+ */
+
+typedef struct {
+    const tagnode *tag;   /* tag at the top level of the template */
+    size_t start;         /* offset of its output */
+    size_t len;           /* length of its output */
+    section deps;         /* names it depends on (see adddeps()) */
+} mapentry;
+
+struct TMPL_map {
+    template *tmpl;       /* template rendered */
+    int complete;         /* false if the render stopped early */
+    size_t len;           /* length of the output */
+    int nentries;         /* number of entries used */
+    int maxentries;       /* number of entries allocated */
+    mapentry *entries;    /* top level tags in template order */
 };
 
 /*
@@ -208,48 +618,268 @@ typedef struct TMPL_var TMPL_var;
 struct TMPL_var {
     TMPL_var *next;     /* next simple variable on list */
     const char *name;
+    int type;           /* VAL_STRING or the type of "num" */
+    int prec;           /* decimal places of a VAL_DOUBLE, or -1 */
+    union {
+        long long i;    /* value of a VAL_INT or VAL_BOOL */
+        double d;       /* value of a VAL_DOUBLE */
+        struct {
+            TMPL_valfunc func;
+            void *arg;
+        } func;         /* callback of a VAL_FUNC */
+        struct {
+            TMPL_streamfunc func;
+            void *arg;
+        } stream;       /* callback of a VAL_STREAM */
+    } num;
+    size_t size;        /* room for the value, which the name follows */
     char value[1];      /* value and name stored here */
 };
 
 /*
  * TMPL_varlist is a variable list of simple variables and/or
- * loop variables
+ * loop variables.  A variable list may have a base, a shared variable
+ * list that we search after it (see TMPL_set_base()).  A base is
+ * freed when its owner and every variable list based on it have freed
+ * it, so "refs" counts the variable lists based on it.
  */
 
 struct TMPL_varlist {
-    TMPL_varlist *next;  /* next variable list on a list */
     TMPL_var   *var;     /* list of my simple variables */
     TMPL_loop  *loop;    /* list of my loop variables */
     TMPL_loop  *parent;  /* my parent loop variable (if any) */
+    TMPL_varlist *base;  /* my base (if any) */
+    long        refs;    /* number of variable lists based on me */
 };
 
-/* TMPL_loop is a loop variable, which is a list of variable lists */
+/*
+ * A memo is the value that the callback of a VAL_FUNC variable
+ * returned in the current render, so that we call it at most once.
+ */
+
+#define MEMO_NONE ((size_t) -1)
+
+typedef struct {
+    const TMPL_var *var;  /* the variable */
+    size_t off;           /* its value in ctx->memovals, or MEMO_NONE */
+} memo;
+
+/*
+ * TMPL_loop is a loop variable, which is an array of variable lists
+ * (rows), so that we know its length and can find any row at once.
+ *
+ * A bound loop variable has no variable lists.  Its rows are C data
+ * that we read in place, described by an array of columns.  Column
+ * "i" of row "r" is at cols[i].base + r * cols[i].stride.
+ */
+
+typedef struct {
+    const char *name;      /* variable name */
+    TMPL_coltype type;     /* type of the data */
+    size_t size;           /* size of the data */
+    const char *base;      /* the column in row 0 */
+    size_t stride;         /* distance from one row to the next */
+} boundcol;
 
 struct TMPL_loop {
     TMPL_loop *next;       /* next loop variable on a list */
     const char *name;      /* my name */
-    TMPL_varlist *varlist; /* list of my variable lists */
-    TMPL_varlist *tail;    /* tail of "varlist" */
+    TMPL_varlist **rows;   /* my variable lists in order */
+    size_t nrows;          /* number of rows */
+    size_t maxrows;        /* number of rows allocated */
+    size_t nkept;          /* rows kept for reuse (see TMPL_reset_loop()) */
     TMPL_varlist *parent;  /* my parent variable list */
+    boundcol *cols;        /* columns if I am bound, else null */
+    int ncols;             /* number of columns */
 };
 
-/* mymalloc() is a malloc wrapper that exits on failure */
+/*
+ * The walker outputs a row of a bound loop variable with a cursor,
+ * which is a variable list with no variables that knows its row.
+ */
+
+typedef struct {
+    TMPL_varlist varlist;  /* must be first */
+    size_t row;            /* index of the row */
+} cursor;
+
+/*
+ * MEMORY ALLOCATION FUNCTIONS
+ *
+ * The default allocator uses malloc(), realloc() and free().
+ */
+
+static void *
+std_malloc(void *arg, size_t size) {
+    return malloc(size);
+}
+
+static void *
+std_realloc(void *arg, void *ptr, size_t size) {
+    return realloc(ptr, size);
+}
+
+static void
+std_free(void *arg, void *ptr) {
+    free(ptr);
+}
+
+/*
+ * variable lists, format function lists, render contexts and
+ * templates compiled without a context come from the global heap
+ */
+
+static heap global_heap = { { std_malloc, std_realloc, std_free, 0 } };
+
+/*
+ * count() adjusts the byte counters of heap "h" by "delta".  Heaps
+ * may be shared by threads so we update the counters atomically.
+ */
+
+static void
+count(heap *h, long delta) {
+    size_t bytes;
+
+    bytes = __atomic_add_fetch(&h->stats.bytes, delta, __ATOMIC_RELAXED);
+    if (bytes > __atomic_load_n(&h->stats.peak, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&h->stats.peak, bytes, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * mymalloc() allocates memory from heap "h".  We return null on
+ * failure and the caller reports the error.
+ */
 
 static void *
-mymalloc(size_t size) {
-    void *ret = malloc(size);
-    if (ret == 0) {
-        fputs("C Template library: out of memory\n", stderr);
-        exit(1);
+mymalloc(heap *h, size_t size) {
+    blockhdr *b = (blockhdr *) h->alloc.mallocfunc(h->alloc.arg,
+        sizeof(*b) + size);
+
+    if (b == 0) {
+        __atomic_add_fetch(&h->stats.failures, 1, __ATOMIC_RELAXED);
+        return 0;
     }
-    return ret;
+    b->h.heap = h;
+    b->h.size = size;
+    b->h.alloc = h->alloc;
+    __atomic_add_fetch(&h->stats.allocs, 1, __ATOMIC_RELAXED);
+    count(h, size);
+    return b + 1;
+}
+
+/*
+ * myrealloc() resizes a block allocated by mymalloc() or allocates
+ * a new block from heap "h" if "ptr" is null.  We return null on
+ * failure, leaving the block unchanged.
+ */
+
+static void *
+myrealloc(heap *h, void *ptr, size_t size) {
+    blockhdr *b;
+    size_t oldsize;
+
+    if (ptr == 0) {
+        return mymalloc(h, size);
+    }
+    b = (blockhdr *) ptr - 1;
+    h = b->h.heap;
+    oldsize = b->h.size;
+    b = (blockhdr *) b->h.alloc.reallocfunc(b->h.alloc.arg, b,
+        sizeof(*b) + size);
+    if (b == 0) {
+        __atomic_add_fetch(&h->stats.failures, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    b->h.size = size;
+    count(h, (long) size - (long) oldsize);
+    return b + 1;
+}
+
+/* myfree() frees a block allocated by mymalloc() */
+
+static void
+myfree(void *ptr) {
+    blockhdr *b;
+    heap *h;
+
+    if (ptr != 0) {
+        b = (blockhdr *) ptr - 1;
+        h = b->h.heap;
+        __atomic_add_fetch(&h->stats.frees, 1, __ATOMIC_RELAXED);
+        count(h, - (long) b->h.size);
+        b->h.alloc.freefunc(b->h.alloc.arg, b);
+    }
+}
+
+/*
+ * heapof() returns the heap that block "ptr" came from, or the global
+ * heap if "ptr" is null, so that a variable list or loop variable
+ * grows from the heap it was created from.
+ */
+
+static heap *
+heapof(const void *ptr) {
+    return ptr == 0 ? &global_heap : ((const blockhdr *) ptr - 1)->h.heap;
+}
+
+/*
+ * bufappend() appends "len" characters at "p" to buffer "b", getting
+ * more memory from heap "h" as needed.  We return 0 on success or -1
+ * if we run out of memory.
+ */
+
+static int
+bufappend(heap *h, buffer *b, const char *p, size_t len) {
+    size_t size;
+    char *data;
+
+    if (b->len + len > b->size) {
+        for (size = b->size == 0 ? 256 : b->size; size < b->len + len;) {
+            size *= 2;
+        }
+        if ((data = (char *) myrealloc(h, b->data, size)) == 0) {
+            return -1;
+        }
+        b->data = data;
+        b->size = size;
+    }
+    memcpy(b->data + b->len, p, len);
+    b->len += len;
+    return 0;
+}
+
+/* mystrdup() returns a copy of string "s" allocated from heap "h" */
+
+static char *
+mystrdup(heap *h, const char *s) {
+    char *ret = (char *) mymalloc(h, strlen(s) + 1);
+
+    return ret == 0 ? 0 : strcpy(ret, s);
+}
+
+/*
+ * nomem() records that template "t" ran out of memory.  The
+ * template is then in error and cannot be output.
+ */
+
+static void
+nomem(template *t) {
+    if (t->nomem == 0 && t->errout != 0) {
+        fprintf(t->errout, "C Template library: out of memory "
+            "parsing file \"%s\"\n", t->filename);
+    }
+    t->nomem = t->error = 1;
 }
 
 
 void TMPL_tagname_set( TMPL_Tags tag, const char* label ) {
+	char *name;
+
 	// this code creates a memory leak.
-	TMPL_Tag_Names[tag] = mymalloc( strlen(label+1) );
-	strcpy(TMPL_Tag_Names[tag], label);
+	if ((name = mystrdup(&global_heap, label)) != 0) {
+		TMPL_Tag_Names[tag] = name;
+	}
 }
 
 
@@ -258,15 +888,27 @@ const char* TMPL_tagname_get( TMPL_Tags tag ) {
 }
 
 
+/* nanotime() returns a monotonic clock reading in nanoseconds */
+
+static unsigned long long
+nanotime(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
 /*
  * newtemplate() creates a new template struct and reads the template
  * file "filename" into memory.  If "tmplstr" is non-null then it is
- * the template, so we do not read "filename".
+ * the template, so we do not read "filename".  If "copy" is non-zero
+ * then we make a copy of "tmplstr".  We always copy "filename".  On
+ * failure we return null and set "*err" to TMPL_ERROR or TMPL_ENOMEM.
  */
 
 static template *
-newtemplate(const char *filename, const char *tmplstr,
-    const TMPL_fmtlist *fmtlist, FILE *out, FILE *errout)
+newtemplate(heap *h, const char *filename, const char *tmplstr, int copy,
+    const TMPL_fmtlist *fmtlist, FILE *errout, int *err)
 {
     template *t;
     FILE *fp;
@@ -277,47 +919,76 @@ newtemplate(const char *filename, const char *tmplstr,
         if (errout != 0) {
             fputs("C Template library: no template specified\n", errout);
         }
+        *err = TMPL_ERROR;
         return 0;
     }
     if (tmplstr == 0) {
-        if ((fp = fopen(filename, "r")) != 0 &&
-            fstat(fileno(fp), &stb) == 0 &&
-            S_ISREG(stb.st_mode) != 0 &&
-            (buf = (char *) mymalloc(stb.st_size + 1)) != 0 &&
-            (stb.st_size == 0 ||
-            fread(buf, 1, stb.st_size, fp) == stb.st_size))
+        if ((fp = fopen(filename, "r")) == 0 ||
+            fstat(fileno(fp), &stb) != 0 ||
+            S_ISREG(stb.st_mode) == 0)
         {
+            goto unreadable;
+        }
+        if ((buf = (char *) mymalloc(h, stb.st_size + 1)) == 0) {
             fclose(fp);
-            buf[stb.st_size] = 0;
+            goto nomem;
         }
-        else {
-            if (errout != 0) {
-                fprintf(errout, "C Template library: failed to read "
-                    "template from file \"%s\"\n", filename);
-            }
-            if (buf != 0) {
-                free(buf);
-            }
-            if (fp != 0) {
-                fclose(fp);
-            }
-            return 0;
+        if (stb.st_size != 0 &&
+            fread(buf, 1, stb.st_size, fp) != stb.st_size)
+        {
+            goto unreadable;
         }
+        fclose(fp);
+        buf[stb.st_size] = 0;
     }
-    t = (template *) mymalloc(sizeof(*t));
-    t->filename = filename != 0 ? filename : "(none)";
-    t->tmplstr = tmplstr != 0 ? tmplstr : buf;
+    else if (copy != 0 && (buf = mystrdup(h, tmplstr)) == 0) {
+        goto nomem;
+    }
+    if (filename == 0) {
+        filename = "(none)";
+    }
+    if ((t = (template *) mymalloc(h, sizeof(*t))) == 0) {
+        goto nomem;
+    }
+    if ((t->filename = mystrdup(h, filename)) == 0) {
+        myfree(t);
+        goto nomem;
+    }
+    t->heap = h;
+    t->tmplstr = buf != 0 ? buf : tmplstr;
+    t->ownstr = buf != 0;
     t->fmtlist = fmtlist;
     t->scanptr = t->tmplstr;
     t->roottag = t->curtag = t->nexttag = 0;
-    t->out = out;
     t->errout = errout;
     t->linenum = 1;
-    t->error = 0;
+    t->error = t->nomem = 0;
     t->include_depth = 0;
     t->loop_depth = 0;
-    t->break_level = t->cont_level = 0;
+    t->trimleft = t->trimright = t->trimnext = 0;
+    t->minify = 0;
+    t->rawelem = -1;
     return t;
+
+nomem:
+    if (errout != 0) {
+        fputs("C Template library: out of memory\n", errout);
+    }
+    myfree(buf);
+    *err = TMPL_ENOMEM;
+    return 0;
+
+unreadable:
+    if (errout != 0) {
+        fprintf(errout, "C Template library: failed to read "
+            "template from file \"%s\"\n", filename);
+    }
+    myfree(buf);
+    if (fp != 0) {
+        fclose(fp);
+    }
+    *err = TMPL_ERROR;
+    return 0;
 }
 
 /* newtag() allocates a new tagnode */
@@ -340,7 +1011,10 @@ newtag(template *t, TMPL_Tags kind) {
         break;
 
     default:
-        ret = (tagnode *) mymalloc(sizeof(*ret));
+        if ((ret = (tagnode *) mymalloc(t->heap, sizeof(*ret))) == 0) {
+            nomem(t);
+            return 0;
+        }
         break;
     }
     ret->kind = kind;
@@ -348,55 +1022,101 @@ newtag(template *t, TMPL_Tags kind) {
     return ret;
 }
 
+static void freetag(tagnode *tag);
+
+/* freesection() frees a cached section */
+
+static void
+freesection(section *sec) {
+    if (sec != 0) {
+        myfree(sec->deps);
+        myfree(sec);
+    }
+}
+
+/* freewindow() frees the window of a TMPL_Tag_Loop tag */
+
+static void
+freewindow(window *w) {
+    if (w != 0) {
+        myfree((void *) w->offset.var);
+        myfree((void *) w->limit.var);
+        myfree((void *) w->step.var);
+        myfree(w);
+    }
+}
+
+/*
+ * freetemplate() frees a template struct, its parse tree and the
+ * memory where the input template is stored (if we allocated it).
+ */
+
+static void
+freetemplate(template *t) {
+    myfree((void *) t->filename);
+    if (t->ownstr != 0) {
+        myfree((void *) t->tmplstr);
+    }
+    freetag(t->roottag);
+
+    /* a tag is left over if we stopped parsing when out of memory */
+
+    if (t->nexttag != 0 && t->nexttag != &t->reusable) {
+        freetag(t->nexttag);
+    }
+    myfree(t);
+}
+
 /*
  * freetag() recursively frees parse tree tagnodes.  We do not free
  * the text in a TMPL_Tag_Text tagnode because it points to memory where
- * the input template is stored, which we free elsewhere.
+ * the input template is stored, which we free elsewhere, but we free
+ * its deflated copy.
  */
 
 static void
 freetag(tagnode *tag) {
-    template *t;
-
     if (tag == 0) {
         return;
     }
     switch(tag->kind) {
 
+    case TMPL_Tag_Text:
+        myfree(tag->tag.text.deflated);
+        break;
+
     case TMPL_Tag_Var:
-        free((void *) tag->tag.var.varname);
-        if (tag->tag.var.dfltval != 0) {
-            free((void *) tag->tag.var.dfltval);
-        }
+        myfree((void *) tag->tag.var.varname);
+        myfree((void *) tag->tag.var.dfltval);
+        myfree((void *) tag->tag.var.fmtname);
         break;
 
     case TMPL_Tag_If:
     case TMPL_Tag_ElseIf:
-        free((void *) tag->tag.ifelse.varname);
-        if (tag->tag.ifelse.testval != 0) {
-            free((void *) tag->tag.ifelse.testval);
-        }
+        myfree((void *) tag->tag.ifelse.varname);
+        myfree((void *) tag->tag.ifelse.operator);
+        myfree((void *) tag->tag.ifelse.testval);
         freetag(tag->tag.ifelse.tbranch);
         freetag(tag->tag.ifelse.fbranch);
         break;
 
     case TMPL_Tag_Loop:
-        free((void *) tag->tag.loop.loopname);
+        myfree((void *) tag->tag.loop.loopname);
         freetag(tag->tag.loop.body);
+        freesection(tag->tag.loop.section);
+        freewindow(tag->tag.loop.window);
         break;
 
     case TMPL_Tag_Include:
-        free((void *) tag->tag.include.filename);
-        if ((t = tag->tag.include.tmpl) != 0) {
-            free((void *) t->filename);
-            free((void *) t->tmplstr);
-            freetag(t->roottag);
-            free(t);
+        myfree((void *) tag->tag.include.filename);
+        if (tag->tag.include.tmpl != 0) {
+            freetemplate(tag->tag.include.tmpl);
         }
+        freesection(tag->tag.include.section);
         break;
     }
     freetag(tag->next);
-    free(tag);
+    myfree(tag);
 }
 
 /* map TMPL_Tags to a human readable string */
@@ -439,6 +1159,25 @@ int is_delim_end( const char *p ) {
 }
 
 
+/*
+ * tcopy() returns a null terminated copy of the "len" characters
+ * at "p" or returns null if we are out of memory.
+ */
+
+static char *
+tcopy(template *t, const char *p, int len) {
+    char *ret;
+
+    if ((ret = (char *) mymalloc(t->heap, len + 1)) == 0) {
+        nomem(t);
+        return 0;
+    }
+    memcpy(ret, p, len);
+    ret[len] = 0;
+    return ret;
+}
+
+
 static const char *
 scanspaces(template *t, const char *p) {
     while (isspace(p[0])) {
@@ -502,7 +1241,6 @@ scanattr(template *t, const char *attrname, const char *p) {
     int len = strlen(attrname);
     int i;
     int quote = 0;
-    char *ret;
 
     if (strncasecmp(p, attrname, len) != 0) {
         return 0;
@@ -537,18 +1275,13 @@ scanattr(template *t, const char *attrname, const char *p) {
 
     /* i is now the length of the attribute value */
 
-    ret = (char *) mymalloc(i + 1);
-    memcpy(ret, p, i);
-    ret[i] = 0;
-    return ret;
+    return tcopy(t, p, i);
 }
 
 
 
 static char *
 scanname(template *t, const char *p) {
-    char *ret;
-
     p = scanspaces(t, p);
     
     int i=0;
@@ -562,17 +1295,12 @@ scanname(template *t, const char *p) {
     	
     t->scanptr = p + i;
 
-    ret = (char *) mymalloc(i + 1);
-    memcpy(ret, p, i);
-    ret[i] = 0;
-    return ret;
+    return tcopy(t, p, i);
 }
 
 
 static char *
 scanoperator(template *t, const char *p) {
-    char *ret;
-
     p = scanspaces(t, p);
     
     int i=0;
@@ -586,10 +1314,7 @@ scanoperator(template *t, const char *p) {
     	
     t->scanptr = p + i;
 
-    ret = (char *) mymalloc(i + 1);
-    memcpy(ret, p, i);
-    ret[i] = 0;
-    return ret;
+    return tcopy(t, p, i);
 }
 
 
@@ -597,7 +1322,6 @@ static char *
 scanvalue(template *t, const char *p) {
 	int i = 0;
     int quote = 0;
-    char *ret;
 
     p = scanspaces(t, p);
     if (*p == '"' || *p == '\'') {
@@ -625,10 +1349,7 @@ scanvalue(template *t, const char *p) {
 
     /* i is now the length of the value */
 
-    ret = (char *) mymalloc(i + 1);
-    memcpy(ret, p, i);
-    ret[i] = 0;
-    return ret;
+    return tcopy(t, p, i);
 }
 
 
@@ -647,6 +1368,141 @@ findfmt(const TMPL_fmtlist *fmtlist, const char *name) {
     return 0;
 }
 
+static const char *newfilename(heap *h, const char *inclfile,
+    const char *parentfile);
+
+/*
+ * newsection() returns a new cached section that keeps its output
+ * for "ttl" seconds.  We find its dependencies after it is parsed.
+ */
+
+static section *
+newsection(template *t, int ttl) {
+    static unsigned long serial;
+    section *sec;
+
+    if ((sec = (section *) mymalloc(t->heap, sizeof(*sec))) == 0) {
+        nomem(t);
+        return 0;
+    }
+    sec->id = __atomic_add_fetch(&serial, 1, __ATOMIC_RELAXED);
+    sec->ttl = ttl;
+    sec->complete = 0;
+    sec->ndeps = sec->maxdeps = 0;
+    sec->deps = 0;
+    return sec;
+}
+
+/*
+ * isnumber() returns true if string "value" is a decimal integer,
+ * which may be negative, and stores it in "*num".
+ */
+
+static int
+isnumber(const char *value, long *num) {
+    const char *digits = value + (value[0] == '-');
+    char *end;
+
+    if (*digits < '0' || *digits > '9') {
+        return 0;
+    }
+    errno = 0;
+    *num = strtol(value, &end, 10);
+    return *end == 0 && errno == 0;
+}
+
+/*
+ * parsenum() sets "v" to the value of string "s", which may be null,
+ * as a VAL_INT or VAL_DOUBLE if it is a decimal number or else as a
+ * VAL_STRING.  An IF tag does this once for its test value so that
+ * comparing it with a typed value parses nothing.
+ */
+
+static void
+parsenum(const char *s, varvalue *v) {
+    char *end;
+
+    memset(v, 0, sizeof(*v));
+    v->type = VAL_STRING;
+    v->prec = -1;
+    v->str = s;
+    if (s == 0 || (*s != '-' && *s != '.' && (*s < '0' || *s > '9'))) {
+        return;
+    }
+    errno = 0;
+    v->i = strtoll(s, &end, 10);
+    if (*end == 0 && errno == 0) {
+        v->type = VAL_INT;
+        return;
+    }
+    v->d = strtod(s, &end);
+    if (*end == 0 && end != s) {
+        v->type = VAL_DOUBLE;
+    }
+}
+
+/*
+ * initattr() sets window attribute "wa" from attribute value "value",
+ * which is a number, the name of a variable or null for "dflt".  We
+ * return -1 if the number is less than "min".
+ */
+
+static int
+initattr(windowattr *wa, const char *value, long dflt, long min) {
+    wa->num = dflt;
+    wa->var = 0;
+    if (value == 0) {
+        return 0;
+    }
+    if (isnumber(value, &wa->num) == 0) {
+        wa->var = value;
+        wa->num = dflt;
+    }
+    return wa->var == 0 && wa->num < min ? -1 : 0;
+}
+
+/*
+ * newwindow() returns the window of a TMPL_Tag_Loop tag with attribute
+ * values "offset", "limit" and "step", any of which may be null.  On
+ * success the window keeps the values that are variable names and we
+ * free the others.  Otherwise we return null and set "*err".
+ */
+
+static window *
+newwindow(template *t, char *offset, char *limit, char *step,
+    const char **err)
+{
+    window w, *wp;
+
+    if (initattr(&w.offset, offset, 0, 0) != 0) {
+        *err = "(bad \"offset=\" attribute) ";
+        return 0;
+    }
+    if (initattr(&w.limit, limit, -1, 0) != 0) {
+        *err = "(bad \"limit=\" attribute) ";
+        return 0;
+    }
+    if (initattr(&w.step, step, 1, LONG_MIN + 1) != 0 || w.step.num == 0) {
+        *err = "(bad \"step=\" attribute) ";
+        return 0;
+    }
+    if ((wp = (window *) mymalloc(t->heap, sizeof(*wp))) == 0) {
+        nomem(t);
+        return 0;
+    }
+    *wp = w;
+    if (w.offset.var == 0) {
+        myfree(offset);
+    }
+    if (w.limit.var == 0) {
+        myfree(limit);
+    }
+    if (w.step.var == 0) {
+        myfree(step);
+    }
+    return wp;
+}
+
 /*
  * scantag() scans a template tag.  If successful we return a tagnode
  * for the tag and advance t->scanptr to the first character after the
@@ -662,9 +1518,15 @@ scantag(template *t, const char *p) {
     tagnode *tag;
     int linenum = t->linenum;
     int len, level;
-    char *name = 0, *value = 0, *fmt = 0, *operator = 0;
+    char *name = 0, *value = 0, *fmt = 0, *operator = 0, *cache = 0;
+    char *mode = 0, *offset = 0, *limit = 0, *step = 0;
+    const char *newfile;
     TMPL_fmtfunc func;
-    char *err = "";
+    section *sec = 0;
+    window *win = 0;
+    const char *err = "";
+    char errbuf[40];
+    int trimleft = 0, trimright = 0;
 
     if (is_tag(TMPL_Tag_CommentStart, p)) {
     	len = tag_length(TMPL_Tag_CommentStart);
@@ -673,6 +1535,13 @@ scantag(template *t, const char *p) {
     }
 	else if (strncmp(p, tagname(TMPL_Tag_DelimStart), len = strlen(tagname(TMPL_Tag_DelimStart))) == 0) {
 		p += len;
+
+		/* {{- trims the white space before the tag */
+
+		if (*p == '-') {
+			trimleft = 1;
+			p = scanspaces(t, p + 1);
+		}
 	}
 	else {
         return 0;
@@ -733,7 +1602,9 @@ scantag(template *t, const char *p) {
 
     p = scanspaces(t, t->scanptr);
     if (hasname != 0 && p == t->scanptr) {
-		fprintf(t->errout, "No spaces :-<\n");
+        if (t->errout != 0) {
+            fprintf(t->errout, "No spaces :-<\n");
+        }
         goto failure;
     }
 
@@ -741,7 +1612,11 @@ scantag(template *t, const char *p) {
      * These tags require one "name =" attribute. The TMPL_Tag_Var tag
      * may have optional "fmt =" and "default =" attributes.  The
      * TMPL_Tag_If and TMPL_Tag_ElseIf tags may have an optional "value ="
-     * attribute. Attributes can come in any order.
+     * attribute.  The TMPL_Tag_Loop and TMPL_Tag_Include tags may have an
+     * optional "cache =" attribute, the TMPL_Tag_Loop tag may have
+     * optional "offset =", "limit =" and "step =" attributes and the
+     * TMPL_Tag_Include tag may have an optional "mode =" attribute.
+     * Attributes can come in any order.
      */
 
     switch(kind) {
@@ -751,6 +1626,18 @@ scantag(template *t, const char *p) {
     	if ((name = scanattr(t, "name", p)) != 0 || (name = scanvalue(t, p)) != 0) {
 			p = scanspaces(t, t->scanptr);
 		}
+		while ((cache == 0 && (cache = scanattr(t, "cache", p)) != 0) ||
+			   (kind == TMPL_Tag_Include && mode == 0 &&
+			   (mode = scanattr(t, "mode", p)) != 0) ||
+			   (kind == TMPL_Tag_Loop && offset == 0 &&
+			   (offset = scanattr(t, "offset", p)) != 0) ||
+			   (kind == TMPL_Tag_Loop && limit == 0 &&
+			   (limit = scanattr(t, "limit", p)) != 0) ||
+			   (kind == TMPL_Tag_Loop && step == 0 &&
+			   (step = scanattr(t, "step", p)) != 0))
+		{
+			p = scanspaces(t, t->scanptr);
+		}
         break;
 
     case TMPL_Tag_Var:
@@ -789,8 +1676,8 @@ scantag(template *t, const char *p) {
 				if (strlen(operator) > 10 || strlen(operator) == 0) {
 					err = "(unknown operator) ";
 				} else {
-					err = mymalloc( 30 );
-					sprintf(err, "(unkown operator %s)", operator);
+					sprintf(errbuf, "(unkown operator %s)", operator);
+					err = errbuf;
 				}
 				goto failure;
 			}
@@ -830,12 +1717,19 @@ scantag(template *t, const char *p) {
         break;
     }
 
-    /* check for end of tag */
+    /* check for end of tag unless an attribute ran out of memory */
 
+    if (t->nomem != 0) {
+        goto failure;
+    }
     p = scanspaces(t, p);
     if (commentish == 0 && is_tag(TMPL_Tag_DelimEnd, p)) {
     	len = tag_length(TMPL_Tag_DelimEnd);
     }
+    else if (commentish == 0 && p[0] == '-' && is_tag(TMPL_Tag_DelimEnd, p+1)) {
+		len = tag_length(TMPL_Tag_DelimEnd) + 1;
+		trimright = 1;    /* -}} trims the white space after the tag */
+    }
     else if (commentish == 0 && container == 0 && p[0] == '/' && is_tag(TMPL_Tag_DelimEnd, p+1)) {
 		len = tag_length(TMPL_Tag_DelimEnd) + 1;
     }
@@ -843,7 +1737,10 @@ scantag(template *t, const char *p) {
     	len = tag_length(TMPL_Tag_CommentEnd);
     }
     else {
-		fprintf(t->errout, "No DELIM_RIGHT found. line %d\n", t->tagline);
+        if (t->errout != 0) {
+            fprintf(t->errout, "No DELIM_RIGHT found. line %d\n",
+                t->tagline);
+        }
         goto failure;
     }
 
@@ -856,6 +1753,18 @@ scantag(template *t, const char *p) {
         goto failure;
     }
 
+    if (cache != 0) {
+        if (cache[strspn(cache, "0123456789")] != 0) {
+            err = "(bad \"cache=\" attribute) ";
+            goto failure;
+        }
+        if ((sec = newsection(t, atoi(cache))) == 0) {
+            goto failure;
+        }
+        myfree(cache);
+        cache = 0;
+    }
+
     switch(kind) {
 
     case TMPL_Tag_Var:
@@ -865,12 +1774,15 @@ scantag(template *t, const char *p) {
                 err = "(bad \"fmt=\" attribute) ";
                 goto failure;
             }
-            free(fmt);
         }
-        tag = newtag(t, kind);
+        if ((tag = newtag(t, kind)) == 0) {
+            goto failure;
+        }
         tag->tag.var.varname = name;
         tag->tag.var.dfltval = value;
+        tag->tag.var.fmtname = fmt;
         tag->tag.var.fmtfunc = func;
+        tag->tag.var.slot = -1;
         break;
 
     case TMPL_Tag_Include:
@@ -878,15 +1790,50 @@ scantag(template *t, const char *p) {
             err = "(check for include cycle) ";
             goto failure;
         }
-        tag = newtag(t, kind);
+
+        /*
+         * A raw included file is output as is when we get to it, so
+         * we find its name now.
+         */
+
+        if (mode != 0) {
+            if (strcmp(mode, "raw") != 0) {
+                err = "(bad \"mode=\" attribute) ";
+                goto failure;
+            }
+            if ((newfile = newfilename(t->heap, name, t->filename)) == 0) {
+                nomem(t);
+                goto failure;
+            }
+            myfree(name);
+            name = (char *) newfile;
+        }
+        if ((tag = newtag(t, kind)) == 0) {
+            goto failure;
+        }
         tag->tag.include.filename = name;
         tag->tag.include.tmpl = 0;
+        tag->tag.include.section = sec;
+        tag->tag.include.raw = mode != 0;
+        myfree(mode);
         break;
 
     case TMPL_Tag_Loop:
-        tag = newtag(t, kind);
+        if (offset != 0 || limit != 0 || step != 0) {
+            if ((win = newwindow(t, offset, limit, step, &err)) == 0) {
+                goto failure;
+            }
+            offset = limit = step = 0;
+        }
+        if ((tag = newtag(t, kind)) == 0) {
+            goto failure;
+        }
         tag->tag.loop.loopname = name;
         tag->tag.loop.body = 0;
+        tag->tag.loop.section = sec;
+        tag->tag.loop.window = win;
+        tag->tag.loop.slot = -1;
+        tag->tag.loop.nslots = 0;
         break;
 
     case TMPL_Tag_Break:
@@ -901,26 +1848,37 @@ scantag(template *t, const char *p) {
                 err = "(bad \"level=\" attribute) ";
                 goto failure;
             }
-            free(value);
+            myfree(value);
+            value = 0;
+        }
+        if ((tag = newtag(t, kind)) == 0) {
+            goto failure;
         }
-        tag = newtag(t, kind);
         tag->tag.breakcont.level = level;
         break;
 
     case TMPL_Tag_If:
     case TMPL_Tag_ElseIf:
-        tag = newtag(t, kind);
+        if ((tag = newtag(t, kind)) == 0) {
+            goto failure;
+        }
         tag->tag.ifelse.varname = name;
         tag->tag.ifelse.operator = operator;
         tag->tag.ifelse.testval = value;
+        parsenum(value, &tag->tag.ifelse.testnum);
         tag->tag.ifelse.tbranch = 0;
         tag->tag.ifelse.fbranch = 0;
+        tag->tag.ifelse.slot = -1;
         break;
 
     default:
-        tag = newtag(t, kind);
+        if ((tag = newtag(t, kind)) == 0) {
+            goto failure;
+        }
         break;
     }
+    t->trimleft = trimleft;
+    t->trimright = trimright;
     return tag;
 
 failure:
@@ -928,22 +1886,107 @@ failure:
     /* restore line number, clean up and return null */
 
     t->linenum = linenum;
-    if (name != 0) {
-        free(name);
-    }
-    if (value != 0) {
-        free(value);
-    }
-    if (fmt != 0) {
-        free(fmt);
-    }
-    if (kind != 0 && t->errout != 0) {
+    myfree(name);
+    myfree(value);
+    myfree(fmt);
+    myfree(operator);
+    myfree(cache);
+    myfree(mode);
+    myfree(offset);
+    myfree(limit);
+    myfree(step);
+    freesection(sec);
+    freewindow(win);
+    if (kind != 0 && t->errout != 0 && t->nomem == 0) {
         fprintf(t->errout, "Ignoring bad %s tag %sin file \"%s\" line %d\n",
             tagname(kind), err, t->filename, t->tagline);
     }
     return 0;
 }
 
+/*
+ * Text in these HTML elements is kept as is when we minify text.
+ */
+
+static const char *const rawelems[] = { "pre", "textarea", "script",
+    "style", 0 };
+
+/*
+ * minify() minifies the "len" characters of text at "p", which are in
+ * a template string that we own, in place and returns the new length.
+ * We replace each run of white space with one space, or with a newline
+ * if it has one, and remove HTML comments (but not <!--[if ...]>
+ * comments) that end in the same text sequence.  We keep the text in
+ * the elements in "rawelems" as is, and t->rawelem tells the next text
+ * sequence if we are still inside one.
+ */
+
+static int
+minify(template *t, char *p, int len) {
+    int i = 0, n = 0, k, nl, e, elen;
+
+    while (i < len) {
+        if (t->rawelem >= 0) {
+            elen = strlen(rawelems[t->rawelem]);
+            if (p[i] == '<' && p[i + 1] == '/' && i + 2 + elen <= len &&
+                strncasecmp(p + i + 2, rawelems[t->rawelem], elen) == 0)
+            {
+                t->rawelem = -1;
+            }
+            p[n++] = p[i++];
+            continue;
+        }
+        if (isspace(p[i])) {
+            for (k = i, nl = 0; k < len && isspace(p[k]); k++) {
+                nl |= p[k] == '\n';
+            }
+
+            /* merge with the white space before a removed comment */
+
+            if (n > 0 && (p[n - 1] == ' ' || p[n - 1] == '\n')) {
+                if (nl) {
+                    p[n - 1] = '\n';
+                }
+                i = k;
+                continue;
+            }
+
+            /* do not put a newline right after a \ that had none */
+
+            if (n > 0 && p[n - 1] == '\\' && p[i] != '\n' &&
+                (p[i] != '\r' || p[i + 1] != '\n'))
+            {
+                nl = 0;
+            }
+            p[n++] = nl ? '\n' : ' ';
+            i = k;
+            continue;
+        }
+        if (p[i] == '<' && strncmp(p + i, "<!--", 4) == 0 && p[i + 4] != '[') {
+            for (k = i + 4; k + 3 <= len && strncmp(p + k, "-->", 3) != 0; k++)
+                ;
+            if (k + 3 <= len) {
+                i = k + 3;
+                continue;
+            }
+        }
+        if (p[i] == '<') {
+            for (e = 0; rawelems[e] != 0; e++) {
+                elen = strlen(rawelems[e]);
+                if (i + 1 + elen <= len &&
+                    strncasecmp(p + i + 1, rawelems[e], elen) == 0 &&
+                    is_name_char(p[i + 1 + elen]) == 0)
+                {
+                    t->rawelem = e;
+                    break;
+                }
+            }
+        }
+        p[n++] = p[i++];
+    }
+    return n;
+}
+
 /*
  * scan() is the main scanner function.  We return the next text sequence
  * or template tag in t->curtag or we set it to null at the end of the
@@ -954,15 +1997,20 @@ failure:
  * save it in t->nexttag and return the text.  We will return t->nexttag
  * the next time scan() is called.  If we find a tag with no preceding
  * text, then we return the tag.  If we find a comment with no preceding
- * text, then we try again.
+ * text, then we try again.  Text that trim markers ({{- and -}}) or
+ * minifying leave empty counts as no text.
  */
 
 static void
 scan(template *t) {
     tagnode *tag = 0;
     const char *p;
-    int i;
+    int i, start = 0;
 
+    if (t->nomem != 0) {     /* out of memory, stop parsing */
+        t->curtag = t->nexttag = 0;
+        return;
+    }
     if (t->nexttag != 0) {   /* return tag from previous call */
         t->curtag = t->nexttag;
         t->nexttag = 0;
@@ -1004,11 +2052,28 @@ scan(template *t) {
     if (p[i] == 0) {
         t->scanptr = p + i;
     }
-    if (i > 0) {
+
+    /* trim the text for a -}} before it or a {{- after it */
+
+    while (t->trimnext != 0 && start < i && isspace(p[start])) {
+        start++;
+    }
+    while (tag != 0 && t->trimleft != 0 && i > start && isspace(p[i - 1])) {
+        i--;
+    }
+    t->trimnext = tag != 0 && t->trimright != 0;
+    if (t->minify != 0 && t->ownstr != 0 && i > start) {
+        i = start + minify(t, (char *) p + start, i - start);
+    }
+    if (i > start) {
         t->nexttag = tag;            /* save the tag (if any)    */
-        tag = newtag(t, TMPL_Tag_Text);   /* return the text sequence */
-        tag->tag.text.start = p;
-        tag->tag.text.len   = i;
+        if ((tag = newtag(t, TMPL_Tag_Text)) == 0) {
+            t->curtag = 0;           /* out of memory, stop parsing */
+            return;
+        }
+        tag->tag.text.start = p + start;
+        tag->tag.text.len   = i - start;
+        tag->tag.text.deflated = 0;
     }
     t->curtag = tag;
 }
@@ -1022,117 +2087,367 @@ scan(template *t) {
 static tagnode *parselist(template *t, int stop);
 
 /*
- * parseif() parses a TMPL_Tag_If statement, which looks like this:
- *
- * <TMPL_Tag_If name = "varname" value = "testvalue" >
- *    template-list
- * <TMPL_Tag_ElseIf name = "varname" value = "testvalue" >
- *    template-list
- * <TMPL_Tag_Else>
- *    template-list
- * </TMPL_Tag_If>
- *
- * A template-list is any sequence (including an empty sequence)
- * of text, template tags, if statements or loop statements.  There
- * can be zero or more TMPL_Tag_ElseIf tags followed by zero or one
- * TMPL_Tag_Else tag.  There must be a final /TMPL_Tag_If tag.
- *
- * "iftag" is a TMPL_Tag_If tagnode, which has pointers for a true branch
- * and a false branch.  We construct a parse tree for the if statement
- * with "iftag" at the root.  When we are done t->curtag points to
- * the tag that follows the /TMPL_Tag_If tag for this statement.
+ * Inside a loop statement, these names are loop metadata variables
+ * that describe the current iteration of the innermost loop.
  */
 
-static void
-parseif(template *t, int stop) {
-    tagnode *iftag = t->curtag;
-    int linenum = t->tagline;
-    int mystop = stop | TMPL_Tag_Else | TMPL_Tag_ElseIf | TMPL_Tag_EndIf;
+enum { META_COUNTER, META_INDEX, META_FIRST, META_LAST, META_ODD,
+    META_SIZE };
+
+static const char *const metanames[] = {
+    [META_COUNTER] = "__counter__",   /* 1, 2, 3 ... */
+    [META_INDEX]   = "__index__",     /* 0, 1, 2 ... */
+    [META_FIRST]   = "__first__",     /* "true" or "" */
+    [META_LAST]    = "__last__",      /* "true" or "" */
+    [META_ODD]     = "__odd__",       /* "true" or "" (first is odd) */
+    [META_SIZE]    = "__size__",      /* number of iterations */
+    0
+};
 
-    iftag->tag.ifelse.tbranch = parselist(t, mystop);
-    while (t->curtag != 0 && t->curtag->kind == TMPL_Tag_ElseIf) {
-        iftag->tag.ifelse.fbranch = t->curtag;
-        iftag = t->curtag;
-        iftag->tag.ifelse.tbranch = parselist(t, mystop);
-    }
-    if (t->curtag != 0 && t->curtag->kind == TMPL_Tag_Else) {
-        iftag->tag.ifelse.fbranch = parselist(t, stop | TMPL_Tag_EndIf);
-    }
-    if (t->curtag != 0 && t->curtag->kind == TMPL_Tag_EndIf) {
-        scan(t);  /* success, scan next tag */
+/* ismeta() returns the META_ value of "name" or -1 */
+
+static int
+ismeta(const char *name) {
+    int i;
+
+    if (name[0] != '_' || name[1] != '_') {
+        return -1;
     }
-    else {
-        if (t->errout != 0) {
-            fprintf(t->errout, "%s tag in file \"%s\" line %d "
-                "has no %s tag\n", tagname(TMPL_Tag_If), t->filename, linenum, tagname(TMPL_Tag_EndIf));
+    for (i = 0; metanames[i] != 0; i++) {
+        if (strcmp(name, metanames[i]) == 0) {
+            return i;
         }
-        t->error = 1;
     }
+    return -1;
 }
 
 /*
- * parseloop() parses a TMPL_Tag_Loop statement which looks like this:
- *
- * <TMPL_Tag_Loop name = "loopname">
- *   template-list
- * </TMPL_Tag_Loop>
- *
- * "looptag" is a TMPL_Tag_Loop tagnode, which has a pointer for the
- * loop body.  We construct a parse tree for the loop statement
- * with "looptag" at the root.  When we are done, t->curtag points
- * to the tag that follows the /TMPL_Tag_Loop tag for this statement.
+ * adddep() adds "name" to the dependencies of cached section "sec"
+ * unless it is already there.  We return -1 if we run out of memory.
  */
 
-static void
-parseloop(template *t, int stop) {
-    tagnode *looptag = t->curtag;
-    int linenum = t->tagline;
-
-    t->loop_depth++;
-    looptag->tag.loop.body = parselist(t, stop | TMPL_Tag_EndLoop);
-    t->loop_depth--;
+static int
+adddep(heap *h, section *sec, const char *name) {
+    const char **deps;
+    int i;
 
-    if (t->curtag != 0 && t->curtag->kind == TMPL_Tag_EndLoop) {
-        scan(t);  /* success, scan next tag */
+    for (i = 0; i < sec->ndeps; i++) {
+        if (strcmp(sec->deps[i], name) == 0) {
+            return 0;
+        }
     }
-    else {
-        if (t->errout != 0) {
-            fprintf(t->errout, "%s tag in file \"%s\" line %d "
-                "has no %s tag\n", tagname(TMPL_Tag_Loop), t->filename, linenum, tagname(TMPL_Tag_EndLoop));
+    if (sec->ndeps == sec->maxdeps) {
+        i = sec->maxdeps == 0 ? 8 : sec->maxdeps * 2;
+        deps = (const char **) myrealloc(h, sec->deps, i * sizeof(*deps));
+        if (deps == 0) {
+            return -1;
         }
-        t->error = 1;
+        sec->deps = deps;
+        sec->maxdeps = i;
     }
+    sec->deps[sec->ndeps++] = name;
+    return 0;
 }
 
 /*
- * parselist() is the top level parser function.  It parses a
- * template-list which is any sequence of text, TMPL_Tag_Var tags,
- * TMPL_Tag_Include tags, if statements or loop statements.
- * We return a parse tree which is a linked list of tagnodes.  The
- * "stop" parameter is a bitmap of tag kinds that we expect to end
- * this list.  For example, if we are parsing the template-list
- * following a TMPL_Tag_If tag, then we expect the list to end with a
- * TMPL_Tag_ElseIf tag or TMPL_Tag_Else tag or /TMPL_Tag_If tag.  If we are parsing the
- * template-list that comprises the entire template, then "stop" is zero
- * so that we keep going to the end of the template.  When we are done,
- * t->curtag is the tag that caused us to stop, or null at the end of
- * the template.
+ * adddepname() adds variable "name" (if not null) to the dependencies
+ * of "sec" unless it is a loop metadata variable for a loop inside the
+ * section ("inloop" is true).
  */
 
-static tagnode *
-parselist(template *t, int stop) {
-    tagnode *list = 0, *tail, *tag;
+static int
+adddepname(heap *h, section *sec, const char *name, int inloop) {
+    if (name == 0 || (inloop != 0 && ismeta(name) >= 0)) {
+        return 0;
+    }
+    return adddep(h, sec, name);
+}
 
-    scan(t);
-    while ((tag = t->curtag) != 0) {
-        switch(tag->kind) {
+/*
+ * adddeps() adds the names of all variables and loop variables that
+ * parse tree "tag" refers to to the dependencies of "sec".  Loop
+ * metadata variables are dependencies only outside of loop statements
+ * in the section ("inloop" is false), where they describe a loop that
+ * encloses the section.  We return 0 on success or non-zero if the
+ * tree includes files that are not parsed yet or if we run out of
+ * memory.  tagdeps() does the same for "tag" alone, without the tags
+ * that follow it.
+ */
 
-        case TMPL_Tag_ElseIf:    /* check for terminator tag */
-        case TMPL_Tag_Else:
-        case TMPL_Tag_EndIf:
-        case TMPL_Tag_EndLoop:
-            if ((tag->kind & stop) != 0) {
-                return list;
+static int adddeps(heap *h, section *sec, const tagnode *tag, int inloop);
+
+static int
+tagdeps(heap *h, section *sec, const tagnode *tag, int inloop) {
+    int ret = 0;
+    const char *name = 0;
+    const window *w;
+    template *t2;
+
+    switch(tag->kind) {
+
+    case TMPL_Tag_Var:
+        name = tag->tag.var.varname;
+        break;
+
+    case TMPL_Tag_If:
+    case TMPL_Tag_ElseIf:
+        name = tag->tag.ifelse.varname;
+        ret |= adddeps(h, sec, tag->tag.ifelse.tbranch, inloop);
+        ret |= adddeps(h, sec, tag->tag.ifelse.fbranch, inloop);
+        break;
+
+    case TMPL_Tag_Loop:
+        name = tag->tag.loop.loopname;
+        if ((w = tag->tag.loop.window) != 0) {
+            ret |= adddepname(h, sec, w->offset.var, inloop);
+            ret |= adddepname(h, sec, w->limit.var, inloop);
+            ret |= adddepname(h, sec, w->step.var, inloop);
+        }
+        ret |= adddeps(h, sec, tag->tag.loop.body, 1);
+        break;
+
+    case TMPL_Tag_Include:
+        if (tag->tag.include.raw != 0) {
+            break;
+        }
+        if ((t2 = tag->tag.include.tmpl) == 0 || t2->error != 0) {
+            ret |= 1;
+        }
+        else {
+            ret |= adddeps(h, sec, t2->roottag, inloop);
+        }
+        break;
+    }
+    ret |= adddepname(h, sec, name, inloop);
+    return ret;
+}
+
+static int
+adddeps(heap *h, section *sec, const tagnode *tag, int inloop) {
+    int ret = 0;
+
+    for (; tag != 0; tag = tag->next) {
+        ret |= tagdeps(h, sec, tag, inloop);
+    }
+    return ret;
+}
+
+/*
+ * finddeps() finds the dependencies of the cached section at
+ * TMPL_Tag_Loop or TMPL_Tag_Include tag "tag".  If the section
+ * includes files that are not parsed yet, then the dependencies are
+ * incomplete and we try again the next time the section is output.
+ */
+
+static void
+finddeps(heap *h, tagnode *tag) {
+    section *sec;
+
+    if (tag->kind == TMPL_Tag_Loop) {
+        sec = tag->tag.loop.section;
+        sec->ndeps = 0;
+        sec->complete = adddep(h, sec, tag->tag.loop.loopname) == 0 &&
+            adddeps(h, sec, tag->tag.loop.body, 1) == 0;
+    }
+    else {
+        sec = tag->tag.include.section;
+        sec->ndeps = 0;
+        sec->complete = tag->tag.include.raw != 0 ||
+            adddeps(h, sec, tag->tag.include.tmpl->roottag, 0) == 0;
+    }
+}
+
+/*
+ * slotof() returns the slot for name "name" in "names", the names of
+ * the slots of a loop body so far, adding it if need be.  We return
+ * -1 for a loop metadata variable, which changes from row to row, or
+ * if we run out of memory.
+ */
+
+static int
+slotof(heap *h, section *names, const char *name) {
+    int i;
+
+    if (ismeta(name) >= 0) {
+        return -1;
+    }
+    for (i = 0; i < names->ndeps; i++) {
+        if (strcmp(names->deps[i], name) == 0) {
+            return i;
+        }
+    }
+    return adddep(h, names, name) == 0 ? i : -1;
+}
+
+/*
+ * addslots() gives the tags in "list" slots in "names" (see
+ * findslots()).  A loop statement gets a slot for its loop variable
+ * but not for the names in its body, which has its own.
+ */
+
+static void
+addslots(heap *h, tagnode *list, section *names) {
+    tagnode *tag;
+
+    for (tag = list; tag != 0; tag = tag->next) {
+        switch (tag->kind) {
+
+        case TMPL_Tag_Var:
+            tag->tag.var.slot = slotof(h, names, tag->tag.var.varname);
+            break;
+
+        case TMPL_Tag_If:
+        case TMPL_Tag_ElseIf:
+            tag->tag.ifelse.slot = slotof(h, names, tag->tag.ifelse.varname);
+            addslots(h, tag->tag.ifelse.tbranch, names);
+            addslots(h, tag->tag.ifelse.fbranch, names);
+            break;
+
+        case TMPL_Tag_Loop:
+            tag->tag.loop.slot = slotof(h, names, tag->tag.loop.loopname);
+            break;
+
+        default:
+            break;
+        }
+    }
+}
+
+/*
+ * findslots() gives each name that the body of loop statement
+ * "looptag" looks up a slot in the loop's lookup cache (see
+ * slotvalue()), so that a name that a row does not have is looked up
+ * in the enclosing variable lists once per loop, not once per row.
+ * The tags of included files have no slots.  If we run out of memory,
+ * then the tags that did not get a slot just do without.
+ */
+
+static void
+findslots(heap *h, tagnode *looptag) {
+    section names;
+
+    memset(&names, 0, sizeof(names));
+    addslots(h, looptag->tag.loop.body, &names);
+    looptag->tag.loop.nslots = names.ndeps;
+    myfree(names.deps);
+}
+
+/*
+ * parseif() parses a TMPL_Tag_If statement, which looks like this:
+ *
+ * <TMPL_Tag_If name = "varname" value = "testvalue" >
+ *    template-list
+ * <TMPL_Tag_ElseIf name = "varname" value = "testvalue" >
+ *    template-list
+ * <TMPL_Tag_Else>
+ *    template-list
+ * </TMPL_Tag_If>
+ *
+ * A template-list is any sequence (including an empty sequence)
+ * of text, template tags, if statements or loop statements.  There
+ * can be zero or more TMPL_Tag_ElseIf tags followed by zero or one
+ * TMPL_Tag_Else tag.  There must be a final /TMPL_Tag_If tag.
+ *
+ * "iftag" is a TMPL_Tag_If tagnode, which has pointers for a true branch
+ * and a false branch.  We construct a parse tree for the if statement
+ * with "iftag" at the root.  When we are done t->curtag points to
+ * the tag that follows the /TMPL_Tag_If tag for this statement.
+ */
+
+static void
+parseif(template *t, int stop) {
+    tagnode *iftag = t->curtag;
+    int linenum = t->tagline;
+    int mystop = stop | TMPL_Tag_Else | TMPL_Tag_ElseIf | TMPL_Tag_EndIf;
+
+    iftag->tag.ifelse.tbranch = parselist(t, mystop);
+    while (t->curtag != 0 && t->curtag->kind == TMPL_Tag_ElseIf) {
+        iftag->tag.ifelse.fbranch = t->curtag;
+        iftag = t->curtag;
+        iftag->tag.ifelse.tbranch = parselist(t, mystop);
+    }
+    if (t->curtag != 0 && t->curtag->kind == TMPL_Tag_Else) {
+        iftag->tag.ifelse.fbranch = parselist(t, stop | TMPL_Tag_EndIf);
+    }
+    if (t->curtag != 0 && t->curtag->kind == TMPL_Tag_EndIf) {
+        scan(t);  /* success, scan next tag */
+    }
+    else {
+        if (t->errout != 0 && t->nomem == 0) {
+            fprintf(t->errout, "%s tag in file \"%s\" line %d "
+                "has no %s tag\n", tagname(TMPL_Tag_If), t->filename, linenum, tagname(TMPL_Tag_EndIf));
+        }
+        t->error = 1;
+    }
+}
+
+/*
+ * parseloop() parses a TMPL_Tag_Loop statement which looks like this:
+ *
+ * <TMPL_Tag_Loop name = "loopname">
+ *   template-list
+ * </TMPL_Tag_Loop>
+ *
+ * "looptag" is a TMPL_Tag_Loop tagnode, which has a pointer for the
+ * loop body.  We construct a parse tree for the loop statement
+ * with "looptag" at the root.  When we are done, t->curtag points
+ * to the tag that follows the /TMPL_Tag_Loop tag for this statement.
+ */
+
+static void
+parseloop(template *t, int stop) {
+    tagnode *looptag = t->curtag;
+    int linenum = t->tagline;
+
+    t->loop_depth++;
+    looptag->tag.loop.body = parselist(t, stop | TMPL_Tag_EndLoop);
+    t->loop_depth--;
+    findslots(t->heap, looptag);
+    if (looptag->tag.loop.section != 0) {
+        finddeps(t->heap, looptag);
+    }
+
+    if (t->curtag != 0 && t->curtag->kind == TMPL_Tag_EndLoop) {
+        scan(t);  /* success, scan next tag */
+    }
+    else {
+        if (t->errout != 0 && t->nomem == 0) {
+            fprintf(t->errout, "%s tag in file \"%s\" line %d "
+                "has no %s tag\n", tagname(TMPL_Tag_Loop), t->filename, linenum, tagname(TMPL_Tag_EndLoop));
+        }
+        t->error = 1;
+    }
+}
+
+/*
+ * parselist() is the top level parser function.  It parses a
+ * template-list which is any sequence of text, TMPL_Tag_Var tags,
+ * TMPL_Tag_Include tags, if statements or loop statements.
+ * We return a parse tree which is a linked list of tagnodes.  The
+ * "stop" parameter is a bitmap of tag kinds that we expect to end
+ * this list.  For example, if we are parsing the template-list
+ * following a TMPL_Tag_If tag, then we expect the list to end with a
+ * TMPL_Tag_ElseIf tag or TMPL_Tag_Else tag or /TMPL_Tag_If tag.  If we are parsing the
+ * template-list that comprises the entire template, then "stop" is zero
+ * so that we keep going to the end of the template.  When we are done,
+ * t->curtag is the tag that caused us to stop, or null at the end of
+ * the template.
+ */
+
+static tagnode *
+parselist(template *t, int stop) {
+    tagnode *list = 0, *tail, *tag;
+
+    scan(t);
+    while ((tag = t->curtag) != 0) {
+        switch(tag->kind) {
+
+        case TMPL_Tag_ElseIf:    /* check for terminator tag */
+        case TMPL_Tag_Else:
+        case TMPL_Tag_EndIf:
+        case TMPL_Tag_EndLoop:
+            if ((tag->kind & stop) != 0) {
+                return list;
             }
 
             /* unexpected terminator tag -- keep going */
@@ -1179,511 +2494,5081 @@ parselist(template *t, int stop) {
 /*
  * PARSE TREE WALKING FUNCTIONS
  *
- * valueof() looks up a variable by name and returns its value
- * or returns null if not found.  We search "varlist" and any
- * enclosing variable lists.  The parent of "varlist" is a
- * loop variable, whose parent is a variable list that encloses
- * "varlist".
+ * colvalue() sets "v" to the value of column "col" in row "row" of a
+ * bound loop variable and returns 1, or returns 0 if it has none.  We
+ * read the data in place.  A char array without a terminating null is
+ * copied to ctx->scratch, which the next call may reuse.
  */
 
-static char *
-valueof(const char *varname, const TMPL_varlist *varlist) {
-    TMPL_var *var;
+static int
+colvalue(TMPL_context *ctx, const boundcol *col, size_t row, varvalue *v) {
+    const char *p = col->base + row * col->stride;
+    int i;
+    int64_t i64;
 
-    while(varlist != 0) {
-        for (var = varlist->var; var != 0; var = var->next) {
-            if (strcmp(varname, var->name) == 0) {
-                return var->value;
-            }
+    v->type = VAL_STRING;
+    v->prec = -1;
+    switch (col->type) {
+
+    case TMPL_COL_STRING:
+        memcpy(&v->str, p, sizeof(v->str));
+        return v->str != 0;
+
+    case TMPL_COL_CHARS:
+        if (memchr(p, 0, col->size) != 0) {
+            v->str = p;
+            return 1;
         }
-        varlist = varlist->parent == 0 ? 0 : varlist->parent->parent;
+        ctx->scratch.len = 0;
+        if (bufappend(&ctx->heap, &ctx->scratch, p, col->size) != 0 ||
+            bufappend(&ctx->heap, &ctx->scratch, "", 1) != 0)
+        {
+            ctx->error = TMPL_ENOMEM;
+            return 0;
+        }
+        v->str = ctx->scratch.data;
+        return 1;
+
+    case TMPL_COL_INT:
+        memcpy(&i, p, sizeof(i));
+        v->type = VAL_INT;
+        v->i = i;
+        return 1;
+
+    case TMPL_COL_INT64:
+        memcpy(&i64, p, sizeof(i64));
+        v->type = VAL_INT;
+        v->i = i64;
+        return 1;
+
+    case TMPL_COL_DOUBLE:
+        memcpy(&v->d, p, sizeof(v->d));
+        v->type = VAL_DOUBLE;
+        return 1;
     }
     return 0;
 }
 
 /*
- * findloop() looks up a loop variable by name and returns it or
- * returns null if not found.  We search "varlist" and any
- * enclosing variable lists.
+ * funcvalue() sets "v" to the value of VAL_FUNC variable "var" and
+ * returns 1, or returns 0 if its callback returned null.  We call the
+ * callback the first time a render reads the variable and keep a copy
+ * of its value in ctx->memovals for the rest of the render.  The next
+ * call may move the copy.
  */
 
-static TMPL_loop *
-findloop(const char *loopname, const TMPL_varlist *varlist) {
-    TMPL_loop *loop;
-
-    while (varlist != 0) {
-        for (loop = varlist->loop; loop != 0; loop = loop->next) {
-            if (strcmp(loopname, loop->name) == 0) {
-                return loop;
+static int
+funcvalue(TMPL_context *ctx, const TMPL_var *var, varvalue *v) {
+    const memo *m = (const memo *) ctx->memos.data;
+    size_t i, n = ctx->memos.len / sizeof(memo);
+    const char *value;
+    memo entry;
+
+    for (i = 0; i < n && m[i].var != var; i++)
+        ;
+    if (i == n) {
+        entry.var = var;
+        entry.off = MEMO_NONE;
+        value = var->num.func.func(var->name, var->num.func.arg);
+        if (value != 0) {
+            entry.off = ctx->memovals.len;
+            if (bufappend(&ctx->heap, &ctx->memovals, value,
+                strlen(value) + 1) != 0)
+            {
+                ctx->error = TMPL_ENOMEM;
+                return 0;
             }
         }
-        varlist = varlist->parent == 0 ? 0 : varlist->parent->parent;
+        if (bufappend(&ctx->heap, &ctx->memos, (const char *) &entry,
+            sizeof(entry)) != 0)
+        {
+            ctx->error = TMPL_ENOMEM;
+            return 0;
+        }
+        m = (const memo *) ctx->memos.data;
     }
-    return 0;
+    if (m[i].off == MEMO_NONE) {
+        return 0;
+    }
+    v->type = VAL_STRING;
+    v->prec = -1;
+    v->str = ctx->memovals.data + m[i].off;
+    return 1;
 }
 
 /*
- * istrue() evaluates a TMPL_Tag_If (or TMPL_Tag_ElseIf) tag for true or false.
- *
- * <TMPL_Tag_If name="varname"> is true if 1) simple variable "varname"
- * exists and is not the null string or 2) the loop variable "varname"
- * exists.  Otherwise false.
- *
- * <TMPL_Tag_If name="varname" value=""> is true if "varname" does not exist
- * or if "varname" has a null value.
- *
- * <TMPL_Tag_If name="varname" value="testvalue"> is true if simple variable
- * "varname" has value "testvalue". Otherwise false.
+ * scopevalue() looks up a variable by name in "varlist" but not in the
+ * variable lists that enclose it.  We set "v" to its value and return
+ * 1, or return 0 if it has no value, or return -1 if not found.  A
+ * variable list of a bound loop variable is a cursor, whose variables
+ * are the columns of its row.  We search the base of a variable list
+ * (and its base, if any) too.
  */
 
-static int
-is_true(const tagnode *iftag, const TMPL_varlist *varlist) {
-    const char *testval = iftag->tag.ifelse.testval;
-    const char *operator = iftag->tag.ifelse.operator;
-    const char *value = valueof(iftag->tag.ifelse.varname, varlist);
-    //TMPL_loop *loop = 0;
+static int valueof(TMPL_context *ctx, const char *varname,
+    const TMPL_varlist *varlist, varvalue *v);
 
-    if (operator == 0) {
-    	if (value) {
-    		return (strlen(value) > 1);
-    	}
-    	
-    	return (findloop(iftag->tag.ifelse.varname, varlist) > 0);
-    	
-    } else if (value == 0 || testval == 0) {
-    	return 0;
-    	
-    } else {
-    	return
-    		(strcmp(operator, "==") == 0 && strcmp(value, testval) == 0) ||
-			(strcmp(operator, "!=") == 0 && strcmp(value, testval) != 0) ||
-			(strcmp(operator, "<") == 0 && strcmp(value, testval) < 0) ||
-			(strcmp(operator, ">") == 0 && strcmp(value, testval) > 0) ||
-			(strcmp(operator, ">=") == 0 && strcmp(value, testval) >= 0) ||
-			(strcmp(operator, "<=") == 0 && strcmp(value, testval) <= 0);
-	}
-	
-	return 0;
-}
+static int
+scopevalue(TMPL_context *ctx, const char *varname,
+    const TMPL_varlist *varlist, varvalue *v)
+{
+    TMPL_var *var;
+    const TMPL_loop *loop;
+    int i;
 
-/*
- * write_text() writes a text sequence handling \ escapes.
- *
- * A single \ at the end of a line is not output and neither
- * is the line terminator (\n or \r\n).
+    for (var = varlist->var; var != 0; var = var->next) {
+        if (strcmp(varname, var->name) == 0) {
+            if (var->type == VAL_FUNC) {
+                return funcvalue(ctx, var, v);
+            }
+            v->type = var->type;
+            v->prec = var->prec;
+            v->str = var->value;
+            if (var->type == VAL_DOUBLE) {
+                v->d = var->num.d;
+            }
+            else if (var->type == VAL_STREAM) {
+                v->stream = var->num.stream.func;
+                v->arg = var->num.stream.arg;
+                v->i = 1;
+            }
+            else {
+                v->i = var->num.i;
+            }
+            return 1;
+        }
+    }
+    if ((loop = varlist->parent) != 0 && loop->cols != 0) {
+        for (i = 0; i < loop->ncols; i++) {
+            if (strcmp(varname, loop->cols[i].name) == 0) {
+                return colvalue(ctx, &loop->cols[i],
+                    ((const cursor *) varlist)->row, v);
+            }
+        }
+    }
+    if (varlist->base != 0 && valueof(ctx, varname, varlist->base, v)) {
+        return 1;
+    }
+    return -1;
+}
+
+/*
+ * valueof() looks up a variable by name, sets "v" to its value and
+ * returns 1, or returns 0 if not found.  We search "varlist" and any
+ * enclosing variable lists.  The parent of "varlist" is a
+ * loop variable, whose parent is a variable list that encloses
+ * "varlist".
+ */
+
+static int
+valueof(TMPL_context *ctx, const char *varname,
+    const TMPL_varlist *varlist, varvalue *v)
+{
+    int ret;
+
+    while(varlist != 0) {
+        if ((ret = scopevalue(ctx, varname, varlist, v)) >= 0) {
+            return ret;
+        }
+        varlist = varlist->parent == 0 ? 0 : varlist->parent->parent;
+    }
+    return 0;
+}
+
+/*
+ * outervalue() looks up a variable like valueof() in "varlist" and the
+ * lists that enclose it, and then in the "resume" list (and the lists
+ * that enclose it) of loop statement "ls" and of each loop statement
+ * that encloses it.  So the rows of a loop variable that came from a
+ * base still see the variable lists that the loop statement sees.
+ */
+
+static int
+outervalue(TMPL_context *ctx, const char *varname,
+    const TMPL_varlist *varlist, const loopstate *ls, varvalue *v)
+{
+    int ret;
+
+    for (;;) {
+        while (varlist != 0) {
+            if ((ret = scopevalue(ctx, varname, varlist, v)) >= 0) {
+                return ret;
+            }
+            varlist = varlist->parent == 0 ? 0 : varlist->parent->parent;
+        }
+        while (ls != 0 && ls->resume == 0) {
+            ls = ls->outer;
+        }
+        if (ls == 0) {
+            return 0;
+        }
+        varlist = ls->resume;
+        ls = ls->outer;
+    }
+}
+
+/*
+ * metavalue() sets "v" to the value of loop metadata variable "name"
+ * for the innermost loop statement being output and returns 1, or
+ * returns 0 if "name" is not one or we are not in a loop.  The values
+ * are typed, so nothing is formatted unless it is output.
+ */
+
+static int
+metavalue(TMPL_context *ctx, const char *name, varvalue *v) {
+    loopstate *ls = ctx->loop;
+
+    if (ls == 0) {
+        return 0;
+    }
+    v->type = VAL_INT;
+    switch (ismeta(name)) {
+
+    case META_COUNTER:
+        v->i = ls->index + 1;
+        break;
+
+    case META_INDEX:
+        v->i = ls->index;
+        break;
+
+    case META_FIRST:
+        v->type = VAL_BOOL;
+        v->i = ls->index == 0;
+        break;
+
+    case META_LAST:
+        v->type = VAL_BOOL;
+        v->i = ls->index + 1 == ls->count;
+        break;
+
+    case META_ODD:
+        v->type = VAL_BOOL;
+        v->i = ls->index % 2 == 0;
+        break;
+
+    case META_SIZE:
+        v->i = ls->count;
+        break;
+
+    default:
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * getvalue() looks up a variable for the walker, which sees the loop
+ * metadata variables as well as the variables in "varlist".  We set
+ * "v" to its value and return 1, or return 0 if not found.
+ */
+
+static int
+getvalue(TMPL_context *ctx, const char *varname,
+    const TMPL_varlist *varlist, varvalue *v)
+{
+    if (varname[0] == '_' && metavalue(ctx, varname, v) != 0) {
+        return 1;
+    }
+    return outervalue(ctx, varname, varlist, ctx->loop, v);
+}
+
+/*
+ * fmtint() writes "n" in decimal so that it ends just before "end"
+ * and returns where it starts, which saves a trip through snprintf().
+ */
+
+static char *
+fmtint(char *end, long long n) {
+    unsigned long long u = n < 0 ? 0ULL - (unsigned long long) n :
+        (unsigned long long) n;
+
+    do {
+        *--end = (char) ('0' + u % 10);
+    } while ((u /= 10) != 0);
+    if (n < 0) {
+        *--end = '-';
+    }
+    return end;
+}
+
+/*
+ * valuestr() returns value "v" as a string.  We format a typed value
+ * in ctx->numbuf, which the next call reuses.  A VAL_BOOL is "true"
+ * or "" like the loop metadata variables.  A VAL_DOUBLE has "prec"
+ * decimal places or else up to 15 significant digits.
+ */
+
+static const char *
+valuestr(TMPL_context *ctx, const varvalue *v) {
+    char *end = ctx->numbuf + sizeof(ctx->numbuf) - 1;
+
+    switch (v->type) {
+
+    case VAL_INT:
+        *end = 0;
+        return fmtint(end, v->i);
+
+    case VAL_BOOL:
+        return v->i != 0 ? "true" : "";
+
+    case VAL_DOUBLE:
+        if (v->prec < 0 && v->d > -1e15 && v->d < 1e15 &&
+            v->d == (double) (long long) v->d)
+        {
+            *end = 0;
+            return fmtint(end, (long long) v->d);
+        }
+        if (v->prec >= 0 && v->d > -1e21 && v->d < 1e21) {
+            snprintf(ctx->numbuf, sizeof(ctx->numbuf), "%.*f", v->prec, v->d);
+        }
+        else {
+            snprintf(ctx->numbuf, sizeof(ctx->numbuf), "%.15g", v->d);
+        }
+        return ctx->numbuf;
+    }
+    return v->str;
+}
+
+/*
+ * isscratch() returns true if variable value "value" is in a buffer
+ * of "ctx" that the next lookup may reuse.
+ */
+
+static int
+isscratch(const TMPL_context *ctx, const char *value) {
+    return (value >= ctx->numbuf && value < ctx->numbuf + sizeof(ctx->numbuf))
+        || value == ctx->scratch.data || (value >= ctx->memovals.data &&
+        value < ctx->memovals.data + ctx->memovals.len);
+}
+
+/*
+ * lookup() looks up a variable like getvalue() and returns its value
+ * as a string, or returns null if not found.
+ */
+
+static const char *
+lookup(TMPL_context *ctx, const char *varname, const TMPL_varlist *varlist)
+{
+    varvalue v;
+
+    return getvalue(ctx, varname, varlist, &v) != 0 ? valuestr(ctx, &v) : 0;
+}
+
+/*
+ * scopeloop() looks up a loop variable by name in "varlist" and its
+ * base (but not in the variable lists that enclose it) and returns it
+ * or returns null if not found.
+ */
+
+static TMPL_loop *findloop(const char *loopname,
+    const TMPL_varlist *varlist);
+
+static TMPL_loop *
+scopeloop(const char *loopname, const TMPL_varlist *varlist) {
+    TMPL_loop *loop;
+
+    for (loop = varlist->loop; loop != 0; loop = loop->next) {
+        if (strcmp(loopname, loop->name) == 0) {
+            return loop;
+        }
+    }
+    return varlist->base != 0 ? findloop(loopname, varlist->base) : 0;
+}
+
+/*
+ * findloop() looks up a loop variable by name and returns it or
+ * returns null if not found.  We search "varlist", its base and any
+ * enclosing variable lists like valueof().
+ */
+
+static TMPL_loop *
+findloop(const char *loopname, const TMPL_varlist *varlist) {
+    TMPL_loop *loop;
+
+    while (varlist != 0) {
+        if ((loop = scopeloop(loopname, varlist)) != 0) {
+            return loop;
+        }
+        varlist = varlist->parent == 0 ? 0 : varlist->parent->parent;
+    }
+    return 0;
+}
+
+/*
+ * outerloop() looks up a loop variable like findloop() and then in
+ * the "resume" lists of loop statement "ls" and the loop statements
+ * that enclose it, like outervalue().
+ */
+
+static TMPL_loop *
+outerloop(const char *loopname, const TMPL_varlist *varlist,
+    const loopstate *ls)
+{
+    TMPL_loop *loop;
+
+    for (;;) {
+        if ((loop = findloop(loopname, varlist)) != 0) {
+            return loop;
+        }
+        while (ls != 0 && ls->resume == 0) {
+            ls = ls->outer;
+        }
+        if (ls == 0) {
+            return 0;
+        }
+        varlist = ls->resume;
+        ls = ls->outer;
+    }
+}
+
+/*
+ * inscope() returns true if variable list "list" is "varlist" or one
+ * of the variable lists that enclose it.
+ */
+
+static int
+inscope(const TMPL_varlist *list, const TMPL_varlist *varlist) {
+    for (; varlist != 0; varlist = varlist->parent == 0 ? 0 :
+        varlist->parent->parent)
+    {
+        if (varlist == list) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * rowslot() returns slot "slotno" of the lookup cache of the innermost
+ * loop being output, for a tag whose variable list "varlist" is a row
+ * of that loop, or returns null if there is no such slot.  Only the
+ * tags of a loop body have slots, and we walk them only while that
+ * loop is the innermost one being output.
+ */
+
+static slot *
+rowslot(TMPL_context *ctx, int slotno, const TMPL_varlist *varlist) {
+    const loopstate *ls = ctx->loop;
+
+    if (slotno < 0 || ls == 0 || slotno >= ls->nslots ||
+        varlist->parent == 0)
+    {
+        return 0;
+    }
+    return (slot *) ctx->slots.data + ls->slotbase + slotno;
+}
+
+/*
+ * slotvalue() looks up a variable like getvalue() for a tag with slot
+ * "slotno" (or -1) in row "varlist".  We search the row every time,
+ * but we search the variable lists that enclose the loop variable
+ * only the first time and keep the result in the slot.  A value in a
+ * buffer that a later lookup may reuse is not kept.
+ */
+
+static int
+slotvalue(TMPL_context *ctx, int slotno, const char *varname,
+    const TMPL_varlist *varlist, varvalue *v)
+{
+    slot *s = rowslot(ctx, slotno, varlist);
+    int ret;
+
+    if (s == 0) {
+        return getvalue(ctx, varname, varlist, v);
+    }
+    if ((ret = scopevalue(ctx, varname, varlist, v)) >= 0) {
+        return ret;
+    }
+    if (s->vstate == SLOT_EMPTY) {
+        if (outervalue(ctx, varname, varlist->parent->parent, ctx->loop,
+            v) == 0)
+        {
+            s->vstate = SLOT_MISSING;
+            return 0;
+        }
+        if (isscratch(ctx, v->str) == 0) {
+            s->v = *v;
+            s->vstate = SLOT_FOUND;
+        }
+        return 1;
+    }
+    if (s->vstate == SLOT_MISSING) {
+        return 0;
+    }
+    *v = s->v;
+    return 1;
+}
+
+/*
+ * slotloop() looks up a loop variable like findloop() for a tag with
+ * slot "slotno" (or -1) in row "varlist", like slotvalue().
+ */
+
+static TMPL_loop *
+slotloop(TMPL_context *ctx, int slotno, const char *loopname,
+    const TMPL_varlist *varlist)
+{
+    slot *s = rowslot(ctx, slotno, varlist);
+    TMPL_loop *loop;
+
+    if (s == 0) {
+        return outerloop(loopname, varlist, ctx->loop);
+    }
+    if ((loop = scopeloop(loopname, varlist)) != 0) {
+        return loop;
+    }
+    if (s->lstate == SLOT_EMPTY) {
+        s->loop = outerloop(loopname, varlist->parent->parent, ctx->loop);
+        s->lstate = s->loop != 0 ? SLOT_FOUND : SLOT_MISSING;
+    }
+    return s->loop;
+}
+
+/*
+ * istrue() evaluates a TMPL_Tag_If (or TMPL_Tag_ElseIf) tag for true or
+ * false with testvar(), which evaluates the variable name, operator and
+ * test value (parsed into "test" with parsenum()) of such a tag.
+ *
+ * <TMPL_Tag_If name="varname"> is true if 1) simple variable "varname"
+ * exists and is not the null string or 2) the loop variable "varname"
+ * exists.  Otherwise false.
+ *
+ * <TMPL_Tag_If name="varname" value=""> is true if "varname" does not exist
+ * or if "varname" has a null value.
+ *
+ * <TMPL_Tag_If name="varname" value="testvalue"> is true if simple variable
+ * "varname" has value "testvalue". Otherwise false.
+ *
+ * A typed value (an integer, a double or a boolean) is true if it is
+ * not zero, and the other operators compare it with "testvalue" as
+ * numbers if "testvalue" is a number.  Otherwise we compare strings.
+ * A streamed variable is true, but we do not call its callback, so
+ * the other operators are false.  A tag in a loop body passes its
+ * slot (see slotvalue()) and other callers pass -1.  Like putvar(), we
+ * count the lookup in the statistics.
+ */
+
+static int
+testvar(TMPL_context *ctx, const char *varname, const char *operator,
+    const char *testval, const varvalue *test, int slotno,
+    const TMPL_varlist *varlist)
+{
+    varvalue v;
+    int found = slotvalue(ctx, slotno, varname, varlist, &v);
+    int cmp;
+    //TMPL_loop *loop = 0;
+
+    if (ctx->stats_enabled != 0) {
+        ctx->stats.lookups++;
+        ctx->stats.misses += found == 0;
+    }
+    if (operator == 0) {
+    	if (found && v.type == VAL_STRING) {
+    		return (strlen(v.str) > 1);
+    	}
+    	if (found) {
+    		return v.type == VAL_DOUBLE ? v.d != 0 : v.i != 0;
+    	}
+    	
+    	return (slotloop(ctx, slotno, varname, varlist) > 0);
+    	
+    } else if (!found || testval == 0 || v.type == VAL_STREAM) {
+    	return 0;
+    	
+    } else if (v.type != VAL_STRING && test->type != VAL_STRING) {
+    	/* typed value and numeric test value: compare numbers */
+    	if (v.type != VAL_DOUBLE && test->type == VAL_INT) {
+    		cmp = (v.i > test->i) - (v.i < test->i);
+    	} else {
+    		double a = v.type == VAL_DOUBLE ? v.d : (double) v.i;
+    		double b = test->type == VAL_DOUBLE ? test->d : (double) test->i;
+    		cmp = (a > b) - (a < b);
+    	}
+    } else {
+    	cmp = strcmp(valuestr(ctx, &v), testval);
+    }
+    return
+    	(strcmp(operator, "==") == 0 && cmp == 0) ||
+		(strcmp(operator, "!=") == 0 && cmp != 0) ||
+		(strcmp(operator, "<") == 0 && cmp < 0) ||
+		(strcmp(operator, ">") == 0 && cmp > 0) ||
+		(strcmp(operator, ">=") == 0 && cmp >= 0) ||
+		(strcmp(operator, "<=") == 0 && cmp <= 0);
+}
+
+static int
+is_true(TMPL_context *ctx, const tagnode *iftag,
+    const TMPL_varlist *varlist)
+{
+    return testvar(ctx, iftag->tag.ifelse.varname,
+        iftag->tag.ifelse.operator, iftag->tag.ifelse.testval,
+        &iftag->tag.ifelse.testnum, iftag->tag.ifelse.slot, varlist);
+}
+
+/*
+ * OUTPUT FUNCTIONS
+ *
+ * emit() is where all template output goes.  We count the bytes
+ * so that statistics need no help from the output stream, and we
+ * keep a copy of the output of cached sections.  Parameter "stable"
+ * is true if the output at "p" stays put until the render is done.
+ */
+
+static void putchunk(TMPL_context *ctx, const char *p, size_t len);
+static void putgather(TMPL_context *ctx, const char *p, size_t len,
+    int stable);
+static void putgzip(TMPL_context *ctx, const char *p, size_t len);
+
+static void overlimit(TMPL_context *ctx, unsigned long long limit,
+    const char *what);
+static unsigned long long hashbytes(unsigned long long h, const void *p,
+    size_t len);
+
+static void
+emit(TMPL_context *ctx, const char *p, size_t len, int stable) {
+    if (ctx->maxbytes != 0 && ctx->nbytes + len > ctx->maxbytes) {
+        overlimit(ctx, ctx->maxbytes, "bytes of output");
+        return;
+    }
+    if (len > 0) {
+        switch (ctx->sink) {
+
+        case SINK_FILE:
+            fwrite(p, 1, len, ctx->out);
+            break;
+
+        case SINK_CHUNK:
+            putchunk(ctx, p, len);
+            break;
+
+        case SINK_GATHER:
+            putgather(ctx, p, len, stable);
+            break;
+
+        case SINK_BUFFER:
+            if (bufappend(&ctx->heap, &ctx->outbuf, p, len) != 0) {
+                ctx->error = TMPL_ENOMEM;
+            }
+            break;
+
+        case SINK_GZIP:
+            putgzip(ctx, p, len);
+            break;
+        }
+        ctx->nbytes += len;
+        if (ctx->hashing != 0) {
+            ctx->hash = hashbytes(ctx->hash, p, len);
+        }
+        if (ctx->capdepth > 0 && ctx->capfailed == 0 &&
+            bufappend(&ctx->heap, &ctx->capture, p, len) != 0)
+        {
+            ctx->capfailed = 1;
+        }
+    }
+}
+
+/*
+ * Format functions write to a FILE pointer.  When we need to see
+ * everything that is output, we pass format functions a stream that
+ * sends its output to emit().  cookie_write() is the stream's write
+ * function.
+ */
+
+static ssize_t
+cookie_write(void *cookie, const char *buf, size_t size) {
+    emit((TMPL_context *) cookie, buf, size, 0);
+    return size;
+}
+
+/*
+ * fmtstream() returns the stream that format functions write to
+ * when we need to see the output, or "out" if we cannot create it.
+ */
+
+static FILE *
+fmtstream(TMPL_context *ctx) {
+    static cookie_io_functions_t funcs = { 0, cookie_write, 0, 0 };
+
+    if (ctx->cookie == 0) {
+        ctx->cookie = fopencookie(ctx, "w", funcs);
+    }
+    return ctx->cookie != 0 ? ctx->cookie : ctx->out;
+}
+
+/*
+ * putchunk() outputs "len" bytes at "p" for a resumable render.  We
+ * copy what fits in the caller's buffer and suspend the walker until
+ * the caller asks for more.  We never suspend inside a format
+ * function, because the stream it writes to must not be left busy,
+ * so we save the rest in ctx->pending and format() outputs it later.
+ */
+
+static void
+putchunk(TMPL_context *ctx, const char *p, size_t len) {
+    resumable *r = ctx->resume;
+    size_t n;
+
+    while (len > 0) {
+        n = r->cap - r->len < len ? r->cap - r->len : len;
+        memcpy(r->buf + r->len, p, n);
+        r->len += n;
+        p += n;
+        len -= n;
+        if (len == 0) {
+            break;
+        }
+        if (ctx->infmt != 0) {
+            if (bufappend(&ctx->heap, &ctx->pending, p, len) != 0) {
+                ctx->error = TMPL_ENOMEM;
+            }
+            break;
+        }
+        swapcontext(&r->walker, &r->caller);
+    }
+}
+
+/*
+ * flushgather() writes the output collected by a gathered render.  If
+ * the write fails, we set ctx->error, which ends the render.
+ */
+
+static void
+flushgather(TMPL_context *ctx) {
+    gather *g = ctx->gather;
+    struct iovec *iov = g->iov;
+    int niov = g->niov;
+    ssize_t n;
+
+    while (niov > 0) {
+        if ((n = writev(g->fd, iov, niov)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ctx->error = TMPL_ERROR;
+            break;
+        }
+
+        /* skip what was written and try again with the rest */
+
+        for (; niov > 0 && (size_t) n >= iov->iov_len; iov++, niov--) {
+            n -= iov->iov_len;
+        }
+        if (niov > 0) {
+            iov->iov_base = (char *) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    g->niov = 0;
+    g->used = 0;
+}
+
+/*
+ * putgather() adds "len" bytes at "p" to the output of a gathered
+ * render.  Unless the output is stable we copy it to the scratch
+ * buffer, or write it right away if it does not fit.
+ */
+
+static void
+putgather(TMPL_context *ctx, const char *p, size_t len, int stable) {
+    gather *g = ctx->gather;
+    struct iovec *last;
+
+    if (g->niov == GATHER_IOVS ||
+        (stable == 0 && len > GATHER_SCRATCH - g->used))
+    {
+        flushgather(ctx);
+    }
+    if (stable == 0 && len <= GATHER_SCRATCH) {
+        p = memcpy(g->scratch + g->used, p, len);
+        g->used += len;
+        stable = 1;
+    }
+
+    /* join output that follows the previous piece */
+
+    last = g->niov > 0 ? &g->iov[g->niov - 1] : 0;
+    if (last != 0 && (char *) last->iov_base + last->iov_len == p) {
+        last->iov_len += len;
+    }
+    else {
+        g->iov[g->niov].iov_base = (char *) p;
+        g->iov[g->niov++].iov_len = len;
+    }
+    if (stable == 0) {
+        flushgather(ctx);
+    }
+}
+
+#ifndef TMPL_NO_ZLIB
+
+/*
+ * zlib allocates memory for deflating with zalloc() and zfree(),
+ * which use the heap that "opaque" points to.
+ */
+
+static voidpf
+zalloc(voidpf opaque, uInt items, uInt size) {
+    return mymalloc((heap *) opaque, (size_t) items * size);
+}
+
+static void
+zfree(voidpf opaque, voidpf ptr) {
+    myfree(ptr);
+}
+
+/*
+ * gzdeflate() deflates the input of a gzip render's deflate stream
+ * with flush mode "flush" and writes the deflated output.
+ */
+
+static void
+gzdeflate(TMPL_context *ctx, int flush) {
+    gzsink *gz = ctx->gz;
+    size_t n;
+
+    do {
+        gz->zs.next_out = gz->out;
+        gz->zs.avail_out = sizeof(gz->out);
+        deflate(&gz->zs, flush);
+        n = sizeof(gz->out) - gz->zs.avail_out;
+        if (n > 0 && fwrite(gz->out, 1, n, ctx->out) != n) {
+            ctx->error = TMPL_ERROR;
+        }
+    } while (gz->zs.avail_out == 0);
+}
+
+/* putgzip() adds "len" bytes at "p" to the output of a gzip render */
+
+static void
+putgzip(TMPL_context *ctx, const char *p, size_t len) {
+    gzsink *gz = ctx->gz;
+    uInt n;
+
+    while (len > 0) {
+        n = len < UINT_MAX ? (uInt) len : UINT_MAX;
+        gz->crc = crc32(gz->crc, (const Bytef *) p, n);
+        gz->size += n;
+        gz->zs.next_in = (Bytef *) p;
+        gz->zs.avail_in = n;
+        gzdeflate(ctx, Z_NO_FLUSH);
+        p += n;
+        len -= n;
+    }
+}
+
+static void write_text(TMPL_context *ctx, const char *p, int len);
+
+/*
+ * newdeflated() deflates the text sequence in "tag" on its own at
+ * compression "level" and returns the result, or null if we cannot.
+ * The memory belongs to template "t".  We get the text as it is
+ * output from write_text() in ctx->outbuf.
+ */
+
+static deflated *
+newdeflated(TMPL_context *ctx, template *t, tagnode *tag, int level) {
+    buffer *b = &ctx->outbuf;
+    int sink = ctx->sink, error = ctx->error;
+    unsigned long long nbytes = ctx->nbytes;
+    deflated *d = 0, *d2;
+    z_stream zs;
+    uLong bound;
+    size_t dictlen;
+
+    ctx->sink = SINK_BUFFER;
+    ctx->error = 0;
+    b->len = 0;
+    write_text(ctx, tag->tag.text.start, tag->tag.text.len);
+    ctx->sink = sink;
+    ctx->nbytes = nbytes;
+    if (ctx->error != 0 || b->len == 0 || b->len > UINT_MAX) {
+        ctx->error = error;
+        return 0;
+    }
+    ctx->error = error;
+
+    memset(&zs, 0, sizeof(zs));
+    zs.zalloc = zalloc;
+    zs.zfree = zfree;
+    zs.opaque = t->heap;
+    if (deflateInit2(&zs, level, Z_DEFLATED, -MAX_WBITS, 8,
+        Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        return 0;
+    }
+
+    /* a Z_SYNC_FLUSH adds at most 10 bytes to the bound for Z_FINISH */
+
+    bound = deflateBound(&zs, b->len) + 10;
+    dictlen = b->len < 32768 ? b->len : 32768;
+    d = (deflated *) mymalloc(t->heap, sizeof(*d) + bound + dictlen);
+    if (d != 0) {
+        zs.next_in = (Bytef *) b->data;
+        zs.avail_in = b->len;
+        zs.next_out = d->data;
+        zs.avail_out = bound;
+        if (deflate(&zs, Z_SYNC_FLUSH) != Z_OK || zs.avail_in != 0 ||
+            zs.avail_out == 0)
+        {
+            myfree(d);
+            d = 0;
+        }
+    }
+    deflateEnd(&zs);
+    if (d == 0) {
+        return 0;
+    }
+    d->level = level;
+    d->crc = crc32(0, (const Bytef *) b->data, b->len);
+    d->len = b->len;
+    d->zlen = bound - zs.avail_out;
+    d->dictlen = dictlen;
+    memcpy(d->data + d->zlen, b->data + b->len - dictlen, dictlen);
+
+    /* give back the memory the deflated data did not need */
+
+    d2 = (deflated *) myrealloc(t->heap, d, sizeof(*d) + d->zlen + dictlen);
+    if (d2 != 0) {
+        d = d2;
+    }
+    d->dict = d->data + d->zlen;
+    return d;
+}
+
+/*
+ * putdeflated() outputs the text sequence in "tag" for a gzip render
+ * by copying its deflated data, which we make the first time.  We
+ * return 0 on success or -1 if the caller should output the text.
+ */
+
+static int
+putdeflated(TMPL_context *ctx, template *t, tagnode *tag) {
+    gzsink *gz = ctx->gz;
+    deflated *d = tag->tag.text.deflated;
+
+    if (ctx->hashing != 0 || (ctx->maxbytes != 0 && (d == 0 ||
+        ctx->nbytes + d->len > ctx->maxbytes)))
+    {
+        return -1;       /* let emit() hash the text or check the limit */
+    }
+    if (d == 0 || d->level != gz->level) {
+        myfree(d);
+        d = tag->tag.text.deflated = newdeflated(ctx, t, tag, gz->level);
+        if (d == 0) {
+            return -1;
+        }
+    }
+
+    /* end what we have deflated so far on a byte boundary */
+
+    gz->zs.avail_in = 0;
+    gzdeflate(ctx, Z_SYNC_FLUSH);
+    if (fwrite(d->data, 1, d->zlen, ctx->out) != d->zlen) {
+        ctx->error = TMPL_ERROR;
+    }
+    gz->crc = crc32_combine(gz->crc, d->crc, d->len);
+    gz->size += d->len;
+    ctx->nbytes += d->len;
+
+    /* later output may refer back to the text */
+
+    deflateSetDictionary(&gz->zs, d->dict, d->dictlen);
+    return 0;
+}
+
+#else
+
+/* without zlib no render has SINK_GZIP, so these are never called */
+
+static void
+putgzip(TMPL_context *ctx, const char *p, size_t len) {
+}
+
+static int
+putdeflated(TMPL_context *ctx, template *t, tagnode *tag) {
+    return -1;
+}
+
+#endif
+
+/*
+ * format() outputs "value" with format function "fmtfunc", which
+ * writes to a stream.
+ */
+
+static void endfmt(TMPL_context *ctx);
+
+static void
+format(TMPL_context *ctx, TMPL_fmtfunc fmtfunc, const char *value) {
+    ctx->infmt = 1;
+    fmtfunc(value, ctx->fmtout);
+    endfmt(ctx);
+}
+
+/*
+ * putstream() outputs streamed variable "name" with value "v", whose
+ * callback writes to a stream like a format function.
+ */
+
+static void
+putstream(TMPL_context *ctx, const char *name, const varvalue *v) {
+    ctx->infmt = 1;
+    v->stream(name, v->arg, ctx->fmtout);
+    endfmt(ctx);
+}
+
+/* endfmt() finishes the output of a format function or a callback */
+
+static void
+endfmt(TMPL_context *ctx) {
+    if (ctx->fmtout != ctx->out) {
+        fflush(ctx->fmtout);
+    }
+    ctx->infmt = 0;
+    if (ctx->pending.len > 0) {
+        putchunk(ctx, ctx->pending.data, ctx->pending.len);
+        ctx->pending.len = 0;
+    }
+}
+
+/*
+ * write_text() writes a text sequence handling \ escapes.
+ *
+ * A single \ at the end of a line is not output and neither
+ * is the line terminator (\n or \r\n).
+ *
+ * \\ at the end of a line is output as a single \ followed
+ * by the line terminator.
+ *
+ * Any other \ is output unchanged.
+ */
+
+static void
+write_text(TMPL_context *ctx, const char *p, int len) {
+    int i, k, start;
+
+    /* output runs of characters between the escapes that we remove */
+
+    for (i = start = 0; i < len; i++) {
+
+        /* check for \ or \\ before \n or \r\n */
+
+        if (p[i] == '\\') {
+            k = i + 1;
+            if (k < len && p[k] == '\\') {
+                k++;
+            }
+            if (k < len && p[k] == '\r') {
+                k++;
+            }
+            if (k < len && p[k] == '\n') {
+                emit(ctx, p + start, i - start, 1);
+                if (p[i + 1] == '\\') {
+                    start = ++i;  /* skip first \ */
+                }
+                else {
+                    i = k;        /* skip \ and line terminator */
+                    start = k + 1;
+                }
+            }
+        }
+    }
+    emit(ctx, p + start, len - start, 1);
+}
+
+/*
+ * newfilename() returns a copy of an include file name with
+ * possible modifications.  If the include file name begins
+ * with ".../" then we replace "..." with the directory name
+ * of the parent template file.  If there is no directory
+ * name then we strip ".../".
+ */
+
+static const char *
+newfilename(heap *h, const char *inclfile, const char *parentfile) {
+    char *newfile, *cp;
+
+    newfile = mymalloc(h, strlen(parentfile) + strlen(inclfile) + 1);
+    if (newfile == 0) {
+        return 0;
+    }
+    if (strncmp(inclfile, ".../", 4) != 0) {
+        return strcpy(newfile, inclfile);
+    }
+    strcpy(newfile, parentfile);
+    cp = strrchr(newfile, '/');
+    strcpy(cp == 0 ? newfile : cp + 1, inclfile + 4);
+    return newfile;
+}
+
+/*
+ * include_stats() adds "ns" nanoseconds to the statistics for
+ * included template file "filename".  We track a limited number of
+ * files and quietly ignore any more.  We copy the name, truncated if
+ * need be, because the statistics can outlive the template.
+ */
+
+static void
+include_stats(TMPL_stats *stats, const char *filename,
+    unsigned long calls, unsigned long long ns)
+{
+    int i;
+
+    for (i = 0; i < stats->nincludes; i++) {
+        if (strncmp(stats->includes[i].filename, filename,
+            TMPL_STATS_NAMELEN - 1) == 0) {
+            break;
+        }
+    }
+    if (i == stats->nincludes) {
+        if (i == TMPL_STATS_INCLUDES) {
+            return;
+        }
+        strncpy(stats->includes[i].filename, filename,
+            TMPL_STATS_NAMELEN - 1);
+        stats->includes[i].filename[TMPL_STATS_NAMELEN - 1] = 0;
+        stats->includes[i].calls = 0;
+        stats->includes[i].ns = 0;
+        stats->nincludes++;
+    }
+    stats->includes[i].calls += calls;
+    stats->includes[i].ns += ns;
+}
+
+/* bucket() returns the histogram bucket for "n" */
+
+static int
+bucket(unsigned long long n) {
+    int b;
+
+    for (b = 0; n > 1 && b < TMPL_STATS_BUCKETS - 1; b++) {
+        n >>= 1;
+    }
+    return b;
+}
+
+/*
+ * FRAGMENT CACHE FUNCTIONS
+ *
+ * We use the 64 bit FNV-1a hash.  hashbytes() adds "len" bytes at
+ * "p" to hash "h".
+ */
+
+#define HASH_INIT 0xcbf29ce484222325ULL
+
+static unsigned long long
+hashbytes(unsigned long long h, const void *p, size_t len) {
+    const unsigned char *cp = (const unsigned char *) p;
+
+    while (len-- > 0) {
+        h = (h ^ *cp++) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/* hashstr() adds a string and its terminating null to hash "h" */
+
+static unsigned long long
+hashstr(unsigned long long h, const char *s) {
+    return hashbytes(h, s, strlen(s) + 1);
+}
+
+/*
+ * hashloop() adds loop variable "loop" to hash "h", which means all
+ * of its variable lists and everything in them.  Like sectionkey(),
+ * we hash what a computed variable returns and a streamed variable's
+ * callback.
+ */
+
+static unsigned long long
+hashloop(TMPL_context *ctx, unsigned long long h, const TMPL_loop *loop) {
+    const TMPL_varlist *vl;
+    const TMPL_var *var;
+    const TMPL_loop *lp;
+    const boundcol *col;
+    const char *p;
+    varvalue v;
+    size_t i;
+
+    for (i = 0; loop->cols != 0 && i < loop->nrows; i++) {
+        h = hashbytes(h, "{", 1);
+        for (col = loop->cols; col < loop->cols + loop->ncols; col++) {
+            p = col->base + i * col->stride;
+            if (col->type == TMPL_COL_STRING) {
+                memcpy(&p, p, sizeof(p));
+                h = p == 0 ? hashbytes(h, "", 1) : hashstr(h, p);
+            }
+            else {
+                h = hashbytes(h, p, col->size);
+            }
+        }
+        h = hashbytes(h, "}", 1);
+    }
+    for (i = 0; loop->cols == 0 && i < loop->nrows; i++) {
+        vl = loop->rows[i];
+        h = hashbytes(h, "{", 1);
+        for (var = vl->var; var != 0; var = var->next) {
+            h = hashstr(hashstr(h, var->name), var->value);
+            if (var->type == VAL_FUNC) {
+                h = funcvalue(ctx, var, &v) != 0 ?
+                    hashstr(hashbytes(h, "=", 1), v.str) : h;
+            }
+            else if (var->type != VAL_STRING) {
+                h = hashbytes(hashbytes(h, &var->type, sizeof(var->type)),
+                    &var->num, sizeof(var->num));
+                h = hashbytes(h, &var->prec, sizeof(var->prec));
+            }
+        }
+        for (lp = vl->loop; lp != 0; lp = lp->next) {
+            h = hashloop(ctx, hashstr(h, lp->name), lp);
+        }
+        h = hashbytes(h, "}", 1);
+    }
+    return h;
+}
+
+/*
+ * sectionkey() returns the fragment cache key of cached section "sec"
+ * whose dependencies we look up in "varlist" and then in the "resume"
+ * lists of loop statement "ls" and those that enclose it (see
+ * outervalue()).  Each name may be a simple variable, a loop variable
+ * or both (or neither).  We cannot see what a streamed variable
+ * outputs, so we use its callback.
+ */
+
+static unsigned long long
+sectionkey(TMPL_context *ctx, const section *sec,
+    const TMPL_varlist *varlist, const loopstate *ls)
+{
+    unsigned long long h = HASH_INIT;
+    varvalue v;
+    const TMPL_loop *loop;
+    int i;
+
+    for (i = 0; i < sec->ndeps; i++) {
+        h = hashstr(h, sec->deps[i]);
+        if ((sec->deps[i][0] == '_' && metavalue(ctx, sec->deps[i], &v)) ||
+            outervalue(ctx, sec->deps[i], varlist, ls, &v) != 0)
+        {
+            h = hashbytes(h, "=", 1);
+            if (v.type == VAL_STREAM) {
+                h = hashbytes(hashbytes(h, &v.stream, sizeof(v.stream)),
+                    &v.arg, sizeof(v.arg));
+            }
+            else {
+                h = hashstr(h, valuestr(ctx, &v));
+            }
+        }
+        if ((loop = outerloop(sec->deps[i], varlist, ls)) != 0) {
+            h = hashloop(ctx, hashbytes(h, "[", 1), loop);
+        }
+        h = hashbytes(h, ";", 1);
+    }
+    return h;
+}
+
+/* unlinkentry() removes entry "e" from the lists of cache "c" */
+
+static void
+unlinkentry(cache *c, cacheentry *e) {
+    cacheentry **ep;
+
+    for (ep = &c->bucket[e->key % CACHE_BUCKETS]; *ep != e;
+        ep = &(*ep)->next)
+        ;
+    *ep = e->next;
+    if (e->newer != 0) {
+        e->newer->older = e->older;
+    }
+    else {
+        c->newest = e->older;
+    }
+    if (e->older != 0) {
+        e->older->newer = e->newer;
+    }
+    else {
+        c->oldest = e->newer;
+    }
+    c->bytes -= e->len;
+}
+
+/* makenewest() puts entry "e" at the head of the LRU list */
+
+static void
+makenewest(cache *c, cacheentry *e) {
+    e->older = c->newest;
+    e->newer = 0;
+    if (c->newest != 0) {
+        c->newest->newer = e;
+    }
+    else {
+        c->oldest = e;
+    }
+    c->newest = e;
+}
+
+/*
+ * shrinkcache() discards the least recently used entries in cache "c"
+ * until it holds at most "size" bytes.  If "size" is 0, then we
+ * discard every entry, even empty ones.
+ */
+
+static void
+shrinkcache(cache *c, size_t size) {
+    cacheentry *e;
+
+    while ((e = c->oldest) != 0 && (c->bytes > size || size == 0)) {
+        unlinkentry(c, e);
+        myfree(e);
+    }
+}
+
+/*
+ * cachefind() returns the unexpired cache entry for section "id" with
+ * key "key" or returns null if there is none.
+ */
+
+static cacheentry *
+cachefind(cache *c, unsigned long id, unsigned long long key) {
+    cacheentry *e;
+
+    for (e = c->bucket[key % CACHE_BUCKETS]; e != 0; e = e->next) {
+        if (e->key == key && e->id == id) {
+            break;
+        }
+    }
+    if (e == 0) {
+        return 0;
+    }
+    unlinkentry(c, e);
+    if (e->expires != 0 && e->expires <= nanotime()) {
+        myfree(e);
+        return 0;
+    }
+
+    /* relink the entry as the most recently used */
+
+    e->next = c->bucket[key % CACHE_BUCKETS];
+    c->bucket[key % CACHE_BUCKETS] = e;
+    c->bytes += e->len;
+    makenewest(c, e);
+    return e;
+}
+
+/*
+ * cachestore() saves "len" bytes of output at "p" for section "sec"
+ * with key "key", discarding the least recently used entries to stay
+ * within the size limit.  If we run out of memory we save nothing.
+ */
+
+static void
+cachestore(TMPL_context *ctx, const section *sec, unsigned long long key,
+    const char *p, size_t len)
+{
+    cache *c = ctx->cache;
+    cacheentry *e;
+    int ttl = sec->ttl > 0 ? sec->ttl : c->ttl;
+
+    if (len > c->maxbytes) {
+        return;
+    }
+    shrinkcache(c, c->maxbytes - len);
+    e = (cacheentry *) mymalloc(&ctx->heap, sizeof(*e) + len);
+    if (e == 0) {
+        return;
+    }
+    e->id = sec->id;
+    e->key = key;
+    e->expires = ttl > 0 ? nanotime() + ttl * 1000000000ULL : 0;
+    e->len = len;
+    memcpy(e->data, p, len);
+    e->next = c->bucket[key % CACHE_BUCKETS];
+    c->bucket[key % CACHE_BUCKETS] = e;
+    c->bytes += len;
+    makenewest(c, e);
+}
+
+
+/*
+ * fmtoutput() chooses the stream for format functions.  We need to
+ * see their output if we are collecting statistics, saving the output
+ * of a cached section, hashing or mapping the output or not writing
+ * to a file pointer.
+ */
+
+static void
+fmtoutput(TMPL_context *ctx) {
+    if (ctx->stats_enabled != 0 || ctx->capdepth > 0 ||
+        ctx->hashing != 0 || ctx->mapping != 0 || ctx->maxbytes != 0 ||
+        ctx->sink != SINK_FILE)
+    {
+        ctx->fmtout = fmtstream(ctx);
+    }
+    else {
+        ctx->fmtout = ctx->out;
+    }
+}
+
+/*
+ * A render context may limit the bytes of output, loop iterations,
+ * included files and time of each render (see
+ * TMPL_set_render_limits()).  overlimit() stops a render that exceeds
+ * "limit" of "what".
+ */
+
+static void
+overlimit(TMPL_context *ctx, unsigned long long limit, const char *what) {
+    if (ctx->error == 0) {
+        if (ctx->errout != 0) {
+            fprintf(ctx->errout, "C Template library: render stopped "
+                "after %llu %s\n", limit, what);
+        }
+        ctx->error = TMPL_ELIMIT;
+    }
+}
+
+/*
+ * overdue() counts the steps of a render with a deadline and looks at
+ * the clock every DEADLINE_STEPS steps.  We return true if the render
+ * is past its deadline, and stop it.
+ */
+
+static int
+overdue(TMPL_context *ctx) {
+    if (--ctx->steps > 0) {
+        return 0;
+    }
+    ctx->steps = DEADLINE_STEPS;
+    if (nanotime() < ctx->deadline) {
+        return 0;
+    }
+    overlimit(ctx, ctx->maxms, "milliseconds");
+    return 1;
+}
+
+/*
+ * walk() walks the template parse tree and outputs the result.  We
+ * process the tree nodes according to the data in "varlist".
+ */
+
+static void walktag(TMPL_context *ctx, template *t, tagnode *tag,
+    const TMPL_varlist *varlist);
+
+static void
+walk(TMPL_context *ctx, template *t, tagnode *tag,
+    const TMPL_varlist *varlist)
+{
+    /*
+     * if ctx->break_level is non zero then we are unwinding the
+     * recursion after encountering a TMPL_Tag_Break tag.  The same
+     * is true for ctx->cont_level and TMPL_Tag_Continue.
+     */
+
+    for (; tag != 0 && ctx->break_level == 0 && ctx->cont_level == 0 &&
+        ctx->error == 0; tag = tag->next)
+    {
+        if (ctx->deadline != 0 && overdue(ctx)) {
+            break;
+        }
+        walktag(ctx, t, tag, varlist);
+    }
+}
+
+/*
+ * windowvalue() returns the value of window attribute "wa", looking up
+ * its variable (if any) in "varlist".  We return "dflt" if the variable
+ * does not exist or is not a number.
+ */
+
+static long
+windowvalue(TMPL_context *ctx, const windowattr *wa, long dflt,
+    const TMPL_varlist *varlist)
+{
+    const char *value;
+    long num;
+
+    if (wa->var == 0) {
+        return wa->num;
+    }
+    if ((value = lookup(ctx, wa->var, varlist)) == 0 ||
+        isnumber(value, &num) == 0)
+    {
+        return dflt;
+    }
+    return num;
+}
+
+/*
+ * windowrows() sets the rows in window "w" (null for all rows) that a
+ * TMPL_Tag_Loop statement outputs from loop variable "loop" in "ls".
+ * Rows outside the window cost nothing because we go straight to the
+ * rows inside.
+ */
+
+static void
+windowrows(TMPL_context *ctx, const window *w, const TMPL_loop *loop,
+    const TMPL_varlist *varlist, loopstate *ls)
+{
+    long offset, limit;
+    size_t start, end, stride;
+
+    ls->first = 0;
+    ls->step = 1;
+    ls->count = loop->nrows;
+    if (w == 0) {
+        return;
+    }
+
+    /* ignore an offset or limit < 0 or a step of 0 from a variable */
+
+    if ((offset = windowvalue(ctx, &w->offset, 0, varlist)) < 0) {
+        offset = 0;
+    }
+    limit = windowvalue(ctx, &w->limit, -1, varlist);
+    if ((ls->step = windowvalue(ctx, &w->step, 1, varlist)) == 0 ||
+        ls->step == LONG_MIN)
+    {
+        ls->step = 1;
+    }
+    start = (unsigned long) offset < loop->nrows ? (size_t) offset :
+        loop->nrows;
+    end = limit < 0 || (unsigned long) limit >= loop->nrows - start ?
+        loop->nrows : start + limit;
+    stride = ls->step > 0 ? ls->step : -ls->step;
+    ls->count = (end - start + stride - 1) / stride;
+    ls->first = ls->step > 0 || end == start ? start : end - 1;
+}
+
+/*
+ * runloop() outputs a loop statement for loop variable "loop", once
+ * for each of its variable lists (or for the rows in window "w",
+ * which may be null).  We walk parse tree "body" of template "t" for
+ * each row, or in code generated by TMPL_emit_c(), we call "genbody".
+ * The body has "nslots" slots in its lookup cache (see findslots()).
+ */
+
+static void
+runloop(TMPL_context *ctx, TMPL_loop *loop, const window *w,
+    const TMPL_varlist *varlist, template *t, tagnode *body,
+    int nslots, TMPL_genfunc genbody)
+{
+    static const slot empty;
+    TMPL_varlist *vl;
+    loopstate ls;
+    cursor cur;
+    size_t row;
+    int i;
+
+    if (ctx->stats_enabled != 0) {
+        ctx->stats.loops++;
+    }
+    windowrows(ctx, w, loop, varlist, &ls);
+    ls.outer = ctx->loop;
+    ls.resume = inscope(loop->parent, varlist) ? 0 : varlist;
+    ctx->loop = &ls;
+
+    /* the lookup cache starts empty, and a slot we cannot add is unused */
+
+    ls.slotbase = ctx->slots.len / sizeof(slot);
+    for (ls.nslots = 0; ls.nslots < nslots; ls.nslots++) {
+        if (bufappend(&ctx->heap, &ctx->slots, (const char *) &empty,
+            sizeof(empty)) != 0)
+        {
+            break;
+        }
+    }
+
+    /* the cursor is on our stack so that a loop may nest in itself */
+
+    memset(&cur, 0, sizeof(cur));
+    cur.varlist.parent = loop;
+
+    row = ls.first;
+    for (ls.index = 0; ls.index < ls.count; ls.index++) {
+        if (ctx->stats_enabled != 0) {
+            ctx->stats.iterations++;
+        }
+        if (ctx->maxiters != 0 && ++ctx->iters > ctx->maxiters) {
+            overlimit(ctx, ctx->maxiters, "loop iterations");
+            break;
+        }
+        if (ctx->deadline != 0 && overdue(ctx)) {
+            break;
+        }
+
+        /* start fetching the next row while we output this one */
+
+        if (loop->cols == 0) {
+            vl = loop->rows[row];
+        }
+        else {
+            cur.row = row;
+            vl = &cur.varlist;
+        }
+        row += ls.step;
+        if (ls.index + 1 < ls.count) {
+            if (loop->cols == 0) {
+                PREFETCH(loop->rows[row]);
+            }
+            else {
+                for (i = 0; i < loop->ncols; i++) {
+                    PREFETCH(loop->cols[i].base + row * loop->cols[i].stride);
+                }
+            }
+        }
+        if (genbody != 0) {
+            genbody(ctx, vl);
+        }
+        else {
+            walk(ctx, t, body, vl);
+        }
+
+        /*
+         * if ctx->break_level is nonzero then we encountered a
+         * TMPL_Tag_Break tag inside this TMPL_Tag_Loop so we need to
+         * break here.
+         */
+
+        if (ctx->break_level > 0) {
+            ctx->break_level--;
+            break;
+        }
+
+        /*
+         * if ctx->cont_level is nonzero then we encountered a
+         * TMPL_Tag_Continue inside this TMPL_Tag_Loop.  Depending
+         * on the level we either break here or continue
+         */
+
+        if (ctx->cont_level > 0 && --ctx->cont_level > 0) {
+            break;
+        }
+    }
+    ctx->slots.len = ls.slotbase * sizeof(slot);
+    ctx->loop = ls.outer;
+}
+
+/*
+ * walkloop() outputs the TMPL_Tag_Loop statement at "tag", walking its
+ * body once for each variable list in the loop variable (or for the
+ * rows in its window).
+ */
+
+static void
+walkloop(TMPL_context *ctx, template *t, tagnode *tag,
+    const TMPL_varlist *varlist)
+{
+    TMPL_loop *loop;
+
+    loop = slotloop(ctx, tag->tag.loop.slot, tag->tag.loop.loopname, varlist);
+    if (loop != 0) {
+        runloop(ctx, loop, tag->tag.loop.window, varlist, t,
+            tag->tag.loop.body, tag->tag.loop.nslots, 0);
+    }
+}
+
+/*
+ * parseinclude() opens and parses the file included by the
+ * TMPL_Tag_Include tag at "tag" in template "t" unless it is already
+ * parsed.  We return 0 on success or TMPL_ERROR or TMPL_ENOMEM.  An
+ * included file with syntax errors is always an error.
+ */
+
+static int
+parseinclude(template *t, tagnode *tag, FILE *errout) {
+    template *t2;
+    const char *newfile;
+    int err;
+
+    if ((t2 = tag->tag.include.tmpl) == 0) {
+        newfile = newfilename(t->heap, tag->tag.include.filename,
+            t->filename);
+        if (newfile == 0) {
+            return TMPL_ENOMEM;
+        }
+        t2 = newtemplate(t->heap, newfile, 0, 0, t->fmtlist, errout, &err);
+        myfree((void *) newfile);
+        if (t2 == 0) {
+            return err;
+        }
+        tag->tag.include.tmpl = t2;
+        t2->include_depth = t->include_depth + 1;
+        t2->minify = t->minify;
+        t2->roottag = parselist(t2, 0);
+    }
+    if (t2->error != 0) {
+        return t2->nomem != 0 ? TMPL_ENOMEM : TMPL_ERROR;
+    }
+    return 0;
+}
+
+/*
+ * loadinclude() returns the template for the TMPL_Tag_Include tag at
+ * "tag".  On the first visit we open and parse the included file.  We
+ * return null on failure.
+ */
+
+static template *
+loadinclude(TMPL_context *ctx, template *t, tagnode *tag) {
+    unsigned long long start;
+
+    if (tag->tag.include.tmpl == 0 && ctx->stats_enabled != 0) {
+        start = nanotime();
+        ctx->error = parseinclude(t, tag, ctx->errout);
+        ctx->stats.parse_ns += nanotime() - start;
+    }
+    else {
+        ctx->error = parseinclude(t, tag, ctx->errout);
+    }
+    return ctx->error == 0 ? tag->tag.include.tmpl : 0;
+}
+
+/* walkinclude() outputs the file included by TMPL_Tag_Include "tag" */
+
+static void
+walkinclude(TMPL_context *ctx, template *t, tagnode *tag,
+    const TMPL_varlist *varlist)
+{
+    template *t2;
+    unsigned long long start;
+
+    if (ctx->maxincludes != 0 && ++ctx->includes > ctx->maxincludes) {
+        overlimit(ctx, ctx->maxincludes, "included files");
+        return;
+    }
+    if ((t2 = loadinclude(ctx, t, tag)) == 0) {
+        return;
+    }
+
+    /* walk the included file's parse tree */
+
+    if (ctx->stats_enabled != 0) {
+        start = nanotime();
+        walk(ctx, t2, t2->roottag, varlist);
+        include_stats(&ctx->stats, t2->filename, 1, nanotime() - start);
+    }
+    else {
+        walk(ctx, t2, t2->roottag, varlist);
+    }
+}
+
+/*
+ * walkraw() outputs file "filename", included by a TMPL_Tag_Include
+ * tag with a mode="raw" attribute, as is.  If the output goes to a file
+ * descriptor and we do not need to see it, then we let the kernel
+ * copy the file with sendfile().  Otherwise (or if sendfile() does
+ * not work for these files) we read and output the file.
+ */
+
+static void
+walkraw(TMPL_context *ctx, const char *filename) {
+    char buf[8192];
+    struct stat stb;
+    off_t off = 0;
+    ssize_t n = 0;
+    int fd, outfd = -1;
+
+    if (ctx->maxincludes != 0 && ++ctx->includes > ctx->maxincludes) {
+        overlimit(ctx, ctx->maxincludes, "included files");
+        return;
+    }
+    if ((fd = open(filename, O_RDONLY)) < 0 || fstat(fd, &stb) != 0) {
+        if (ctx->errout != 0) {
+            fprintf(ctx->errout, "C Template library: failed to read "
+                "file \"%s\"\n", filename);
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        ctx->error = TMPL_ERROR;
+        return;
+    }
+    if (ctx->capdepth == 0 && ctx->hashing == 0 &&
+        S_ISREG(stb.st_mode) != 0 &&
+        (ctx->maxbytes == 0 || ctx->nbytes + stb.st_size <= ctx->maxbytes))
+    {
+        if (ctx->sink == SINK_FILE && (outfd = fileno(ctx->out)) >= 0) {
+            fflush(ctx->out);
+        }
+        else if (ctx->sink == SINK_GATHER) {
+            flushgather(ctx);
+            outfd = ctx->gather->fd;
+        }
+    }
+    if (outfd >= 0) {
+        while (off < stb.st_size &&
+            ((n = sendfile(outfd, fd, &off, stb.st_size - off)) > 0 ||
+            (n < 0 && errno == EINTR)))
+            ;
+        ctx->nbytes += off;
+        if (n < 0 && errno != EINVAL && errno != ENOSYS) {
+            ctx->error = TMPL_ERROR;
+        }
+        else if (lseek(fd, off, SEEK_SET) < 0) {
+            ctx->error = TMPL_ERROR;
+        }
+    }
+    while (ctx->error == 0 && (n = read(fd, buf, sizeof(buf))) != 0) {
+        if (n > 0) {
+            emit(ctx, buf, n, 0);
+        }
+        else if (errno != EINTR) {
+            ctx->error = TMPL_ERROR;
+        }
+    }
+    close(fd);
+}
+
+/*
+ * walkcached() outputs cached section "sec" at "tag".  If the
+ * fragment cache has the output for the current values of the
+ * section's dependencies then we output that.  Otherwise we output
+ * the section normally and save the output in the cache.
+ */
+
+static void
+walkcached(TMPL_context *ctx, template *t, tagnode *tag,
+    const TMPL_varlist *varlist, section *sec)
+{
+    const TMPL_varlist *scope = varlist;
+    TMPL_loop *loop = 0;
+    loopstate ls;
+    cacheentry *e;
+    unsigned long long key;
+    size_t start;
+
+    /*
+     * The body of a loop statement sees the variable lists that
+     * enclose the loop variable, not necessarily "varlist", and then
+     * "varlist" too if the loop variable came from a base (see
+     * runloop()).  "ls" stands for the loop statement in the key.
+     */
+
+    ls.outer = ctx->loop;
+    ls.resume = 0;
+    if (tag->kind == TMPL_Tag_Loop) {
+        if ((loop = outerloop(tag->tag.loop.loopname, varlist,
+            ctx->loop)) == 0)
+        {
+            return;
+        }
+        scope = loop->parent;
+        ls.resume = inscope(scope, varlist) ? 0 : varlist;
+    }
+    else if (tag->tag.include.raw == 0 && loadinclude(ctx, t, tag) == 0) {
+        return;
+    }
+    if (sec->complete == 0) {
+        finddeps(t->heap, tag);
+    }
+    if (sec->complete == 0) {
+        key = 0;    /* cannot cache yet */
+    }
+    else {
+        key = sectionkey(ctx, sec, scope, &ls);
+
+        /* the window of a loop statement may come from "varlist" */
+
+        if (loop != 0 && tag->tag.loop.window != 0) {
+            windowrows(ctx, tag->tag.loop.window, loop, varlist, &ls);
+            key = hashbytes(key, &ls.first, sizeof(ls.first));
+            key = hashbytes(key, &ls.step, sizeof(ls.step));
+            key = hashbytes(key, &ls.count, sizeof(ls.count));
+        }
+    }
+    if (sec->complete != 0 &&
+        (e = cachefind(ctx->cache, sec->id, key)) != 0)
+    {
+        if (ctx->stats_enabled != 0) {
+            ctx->stats.cache_hits++;
+        }
+        emit(ctx, e->data, e->len, 0);
+        return;
+    }
+    if (ctx->stats_enabled != 0) {
+        ctx->stats.cache_misses++;
+    }
+
+    /* output the section and capture the output */
+
+    start = ctx->capture.len;
+    if (ctx->capdepth++ == 0) {
+        fmtoutput(ctx);
+    }
+    if (tag->kind == TMPL_Tag_Loop) {
+        walkloop(ctx, t, tag, varlist);
+    }
+    else if (tag->tag.include.raw != 0) {
+        walkraw(ctx, tag->tag.include.filename);
+    }
+    else {
+        walkinclude(ctx, t, tag, varlist);
+    }
+
+    /*
+     * Do not save the output if it is incomplete because of an error
+     * or a TMPL_Tag_Break or TMPL_Tag_Continue for an enclosing loop.
+     */
+
+    if (sec->complete != 0 && ctx->capfailed == 0 && ctx->error == 0 &&
+        ctx->break_level == 0 && ctx->cont_level == 0)
+    {
+        cachestore(ctx, sec, key, ctx->capture.data + start,
+            ctx->capture.len - start);
+    }
+    if (--ctx->capdepth == 0) {
+        ctx->capture.len = 0;
+        ctx->capfailed = 0;
+        fmtoutput(ctx);
+    }
+}
+
+/*
+ * putvar() outputs the value of variable "varname" (or "dfltval" if
+ * it does not exist) for a TMPL_Tag_Var tag, with format function
+ * "fmtfunc" if it is not null.  A streamed variable outputs itself
+ * without the format function.  A tag in a loop body passes its slot
+ * (see slotvalue()) and other callers pass -1.
+ */
+
+static void
+putvar(TMPL_context *ctx, const char *varname, const char *dfltval,
+    TMPL_fmtfunc fmtfunc, int slotno, const TMPL_varlist *varlist)
+{
+    varvalue v;
+    int found = slotvalue(ctx, slotno, varname, varlist, &v);
+    const char *value = found != 0 ? valuestr(ctx, &v) : 0;
+
+    if (ctx->stats_enabled != 0) {
+        ctx->stats.lookups++;
+        ctx->stats.misses += value == 0;
+    }
+    if (found != 0 && v.type == VAL_STREAM) {
+        putstream(ctx, varname, &v);
+        return;
+    }
+    if (value == 0 && (value = dfltval) == 0) {
+        return;
+    }
+
+    /* Use the tag's format function or else just use emit() */
+
+    if (fmtfunc != 0) {
+        format(ctx, fmtfunc, value);
+    }
+    else {
+        emit(ctx, value, strlen(value), isscratch(ctx, value) == 0);
+    }
+}
+
+/* walktag() outputs one tree node */
+
+static void
+walktag(TMPL_context *ctx, template *t, tagnode *tag,
+    const TMPL_varlist *varlist)
+{
+    if (ctx->stats_enabled != 0) {
+        ctx->stats.visits[tag->kind]++;
+    }
+    switch(tag->kind) {
+
+    case TMPL_Tag_Text:
+        if (ctx->sink != SINK_GZIP || tag->tag.text.len < GZIP_SPLICE ||
+            ctx->capdepth > 0 || putdeflated(ctx, t, tag) != 0)
+        {
+            write_text(ctx, tag->tag.text.start, tag->tag.text.len);
+        }
+        break;
+
+    case TMPL_Tag_Var:
+        putvar(ctx, tag->tag.var.varname, tag->tag.var.dfltval,
+            tag->tag.var.fmtfunc, tag->tag.var.slot, varlist);
+        break;
+
+    case TMPL_Tag_If:
+    case TMPL_Tag_ElseIf:
+        if (is_true(ctx, tag, varlist)) {
+            walk(ctx, t, tag->tag.ifelse.tbranch, varlist);
+        }
+        else {
+            walk(ctx, t, tag->tag.ifelse.fbranch, varlist);
+        }
+        break;
+
+    case TMPL_Tag_Loop:
+        if (tag->tag.loop.section != 0 && ctx->cache != 0) {
+            walkcached(ctx, t, tag, varlist, tag->tag.loop.section);
+        }
+        else {
+            walkloop(ctx, t, tag, varlist);
+        }
+        break;
+
+    /*
+     * For a TMPL_Tag_Break or TMPL_Tag_Continue tag we terminate the walk
+     * of this TMPL_Tag_Loop body and set ctx->break_level or
+     * ctx->cont_level to unwind the recursion.
+     */
+
+    case TMPL_Tag_Break:
+        ctx->break_level = tag->tag.breakcont.level;
+        break;
+
+    case TMPL_Tag_Continue:
+        ctx->cont_level = tag->tag.breakcont.level;
+        break;
+
+    case TMPL_Tag_Include:
+        if (tag->tag.include.section != 0 && ctx->cache != 0) {
+            walkcached(ctx, t, tag, varlist, tag->tag.include.section);
+        }
+        else if (tag->tag.include.raw != 0) {
+            walkraw(ctx, tag->tag.include.filename);
+        }
+        else {
+            walkinclude(ctx, t, tag, varlist);
+        }
+        break;
+    }
+}
+
+/*
+ * OUTPUT MAP FUNCTIONS
+ *
+ * ismapped() returns true if an output map records "tag".
+ */
+
+static int
+ismapped(const tagnode *tag) {
+    switch (tag->kind) {
+
+    case TMPL_Tag_Var:
+    case TMPL_Tag_If:
+    case TMPL_Tag_Loop:
+        return 1;
+
+    case TMPL_Tag_Include:
+        return tag->tag.include.raw == 0;
+
+    default:
+        return 0;
+    }
+}
+
+/*
+ * mapdeps() finds the names that the output of map entry "e" depends
+ * on.  If its tag includes files that are not parsed yet, then the
+ * names are incomplete and we look again after it is output.
+ */
+
+static void
+mapdeps(mapentry *e) {
+    e->deps.ndeps = 0;
+    e->deps.complete = tagdeps(&global_heap, &e->deps, e->tag, 0) == 0;
+}
+
+/*
+ * ischanged() returns true if map entry "e" depends on any of the
+ * "nchanged" names in "changed" (or might, because its names are
+ * incomplete).
+ */
+
+static int
+ischanged(const mapentry *e, const char *const *changed, int nchanged) {
+    int i, k;
+
+    if (e->deps.complete == 0) {
+        return 1;
+    }
+    for (i = 0; i < e->deps.ndeps; i++) {
+        for (k = 0; k < nchanged; k++) {
+            if (strcmp(e->deps.deps[i], changed[k]) == 0) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * walkmap() outputs the top level of template map->tmpl like walk()
+ * and records the output of its tags in "map".  If "prev" is not
+ * null, then it is the output that "map" describes, and we copy from
+ * it the output of each tag that depends on none of the names in
+ * "changed".  Otherwise we start a new map.
+ */
+
+static void
+walkmap(TMPL_context *ctx, TMPL_map *map, const TMPL_varlist *varlist,
+    const char *prev, const char *const *changed, int nchanged)
+{
+    template *t = map->tmpl;
+    const tagnode *tag;
+    mapentry *e;
+    size_t start;
+    int i = 0, n;
+
+    if (prev == 0) {
+        map->nentries = 0;
+    }
+    for (tag = t->roottag; tag != 0 && ctx->break_level == 0 &&
+        ctx->cont_level == 0 && ctx->error == 0; tag = tag->next)
+    {
+        if (ctx->deadline != 0 && overdue(ctx)) {
+            break;
+        }
+        if (ismapped(tag) == 0) {
+            walktag(ctx, t, (tagnode *) tag, varlist);
+            continue;
+        }
+        if (prev != 0 && i == map->nentries) {
+            ctx->error = TMPL_ERROR;    /* "map" is not for this output */
+            break;
+        }
+        if (prev == 0 && map->nentries == map->maxentries) {
+            n = map->maxentries == 0 ? 16 : map->maxentries * 2;
+            e = (mapentry *) myrealloc(&global_heap, map->entries,
+                n * sizeof(*e));
+            if (e == 0) {
+                ctx->error = TMPL_ENOMEM;
+                break;
+            }
+            memset(e + map->maxentries, 0,
+                (n - map->maxentries) * sizeof(*e));
+            map->entries = e;
+            map->maxentries = n;
+        }
+        e = &map->entries[prev == 0 ? map->nentries++ : i++];
+        start = ctx->nbytes;
+        if (prev == 0 || ischanged(e, changed, nchanged) != 0) {
+            walktag(ctx, t, (tagnode *) tag, varlist);
+        }
+        else {
+            emit(ctx, prev + e->start, e->len, 1);
+        }
+        if (prev == 0 || e->deps.complete == 0) {
+            e->tag = tag;
+            mapdeps(e);
+        }
+        e->start = start;
+        e->len = ctx->nbytes - start;
+    }
+    map->complete = tag == 0 && ctx->error == 0;
+    map->len = ctx->nbytes;
+}
+
+/*
+ * beginrender() gets render context "ctx" ready to output a template
+ * to "sink" (and "out" for SINK_FILE) and returns the start time.
+ */
+
+static unsigned long long
+beginrender(TMPL_context *ctx, int sink, FILE *out, FILE *errout) {
+    ctx->sink = sink;
+    ctx->out = ctx->fmtout = out;
+    ctx->errout = errout;
+    ctx->error = 0;
+    ctx->break_level = ctx->cont_level = 0;
+    ctx->nbytes = 0;
+    ctx->capdepth = ctx->capfailed = 0;
+    ctx->capture.len = ctx->pending.len = 0;
+    ctx->infmt = 0;
+    ctx->loop = 0;
+    ctx->slots.len = 0;
+    if (ctx->resume != 0) {
+        ctx->resume->active = 0;
+    }
+    if (ctx->gather != 0) {
+        ctx->gather->niov = 0;
+        ctx->gather->used = 0;
+    }
+    ctx->outbuf.len = 0;
+    ctx->memos.len = ctx->memovals.len = 0;
+    ctx->iters = ctx->includes = 0;
+    ctx->hash = HASH_INIT;
+    ctx->deadline = ctx->maxms != 0 ?
+        nanotime() + ctx->maxms * 1000000ULL : 0;
+    ctx->steps = DEADLINE_STEPS;
+    fmtoutput(ctx);
+    return ctx->stats_enabled != 0 ? nanotime() : 0;
+}
+
+/* endrender() updates the statistics of a render begun at "start" */
+
+static void
+endrender(TMPL_context *ctx, unsigned long long start) {
+    unsigned long long ns;
+
+    if (ctx->stats_enabled != 0) {
+        ns = nanotime() - start;
+        ctx->stats.renders++;
+        ctx->stats.errors += ctx->error != 0;
+        ctx->stats.limited += ctx->error == TMPL_ELIMIT;
+        ctx->stats.render_ns += ns;
+        ctx->stats.bytes += ctx->nbytes;
+        ctx->stats.time_hist[bucket(ns / 1000)]++;
+        ctx->stats.bytes_hist[bucket(ctx->nbytes)]++;
+    }
+}
+
+/*
+ * coroutine() runs the walker for a resumable render.  When it
+ * returns, control goes back to TMPL_render_next().
+ */
+
+static void
+coroutine(unsigned int lo, unsigned int hi) {
+    TMPL_context *ctx;
+    resumable *r;
+
+    ctx = (TMPL_context *) ((unsigned long) lo |
+        (unsigned long) hi << 16 << 16);
+    r = ctx->resume;
+    walk(ctx, r->tmpl, r->tmpl->roottag, r->varlist);
+    endrender(ctx, r->start);
+    r->done = 1;
+}
+
+/*
+ * REFERENCE FUNCTIONS
+ *
+ * addref() returns the member of name list "list" with name "name",
+ * adding it to the end of the list if it is not there.  We return
+ * null if we run out of memory.
+ */
+
+static TMPL_ref *
+addref(TMPL_ref **list, const char *name) {
+    TMPL_ref *ref;
+
+    for (; (ref = *list) != 0; list = &ref->next) {
+        if (strcmp(ref->name, name) == 0) {
+            return ref;
+        }
+    }
+    if ((ref = (TMPL_ref *) mymalloc(&global_heap, sizeof(*ref))) != 0) {
+        ref->next = 0;
+        ref->name = name;
+        ref->body = 0;
+        *list = ref;
+    }
+    return ref;
+}
+
+/*
+ * addvarref() adds variable "name" (if not null) to "refs" unless it
+ * is a loop metadata variable.  We return -1 if we run out of memory.
+ */
+
+static int
+addvarref(TMPL_refs *refs, const char *name) {
+    if (name == 0 || ismeta(name) >= 0) {
+        return 0;
+    }
+    return addref(&refs->vars, name) == 0 ? -1 : 0;
+}
+
+/*
+ * addrefs() adds the names that parse tree "tag" of template "t"
+ * refers to to "refs", except for loop metadata variables.  The names
+ * inside a loop statement go in the loop variable's own TMPL_refs.  We
+ * parse included files that are not parsed yet, writing errors to
+ * "errout".  We return 0 on success or TMPL_ERROR or TMPL_ENOMEM.
+ */
+
+static int
+addrefs(TMPL_refs *refs, template *t, tagnode *tag, FILE *errout) {
+    TMPL_ref *ref;
+    const window *w;
+    template *t2;
+    int ret;
+
+    for (; tag != 0; tag = tag->next) {
+        switch(tag->kind) {
+
+        case TMPL_Tag_Var:
+            if (addvarref(refs, tag->tag.var.varname) != 0 ||
+                (tag->tag.var.fmtname != 0 &&
+                addref(&refs->fmts, tag->tag.var.fmtname) == 0))
+            {
+                return TMPL_ENOMEM;
+            }
+            break;
+
+        case TMPL_Tag_If:
+        case TMPL_Tag_ElseIf:
+            if (addvarref(refs, tag->tag.ifelse.varname) != 0) {
+                return TMPL_ENOMEM;
+            }
+            if ((ret = addrefs(refs, t, tag->tag.ifelse.tbranch,
+                errout)) != 0 ||
+                (ret = addrefs(refs, t, tag->tag.ifelse.fbranch,
+                errout)) != 0)
+            {
+                return ret;
+            }
+            break;
+
+        case TMPL_Tag_Loop:
+            if ((w = tag->tag.loop.window) != 0 &&
+                (addvarref(refs, w->offset.var) != 0 ||
+                addvarref(refs, w->limit.var) != 0 ||
+                addvarref(refs, w->step.var) != 0))
+            {
+                return TMPL_ENOMEM;
+            }
+            if ((ref = addref(&refs->loops, tag->tag.loop.loopname)) == 0) {
+                return TMPL_ENOMEM;
+            }
+            if (ref->body == 0) {
+                ref->body = (TMPL_refs *) mymalloc(&global_heap,
+                    sizeof(*ref->body));
+                if (ref->body == 0) {
+                    return TMPL_ENOMEM;
+                }
+                memset(ref->body, 0, sizeof(*ref->body));
+            }
+            if ((ret = addrefs(ref->body, t, tag->tag.loop.body,
+                errout)) != 0)
+            {
+                return ret;
+            }
+            break;
+
+        /* an included file shares the scope of the INCLUDE tag */
+
+        case TMPL_Tag_Include:
+            if (tag->tag.include.raw != 0) {
+                if (addref(&refs->includes, tag->tag.include.filename) == 0) {
+                    return TMPL_ENOMEM;
+                }
+                break;
+            }
+            if ((ret = parseinclude(t, tag, errout)) != 0) {
+                return ret;
+            }
+            t2 = tag->tag.include.tmpl;
+            if (addref(&refs->includes, t2->filename) == 0) {
+                return TMPL_ENOMEM;
+            }
+            if ((ret = addrefs(refs, t2, t2->roottag, errout)) != 0) {
+                return ret;
+            }
+            break;
+        }
+    }
+    return 0;
+}
+
+/* freerefs() frees a name list and everything it refers to */
+
+static void
+freerefs(TMPL_ref *ref) {
+    TMPL_ref *next;
+
+    for (; ref != 0; ref = next) {
+        next = ref->next;
+        TMPL_free_refs(ref->body);
+        myfree(ref);
+    }
+}
+
+/*
+ * C CODE GENERATION FUNCTIONS
+ *
+ * TMPL_emit_c() translates a parse tree into C.  Each template-list
+ * that a loop statement repeats or a file includes becomes a function
+ * that returns nonzero if the caller must stop (because of a
+ * TMPL_Tag_Break or TMPL_Tag_Continue tag or an error).  The rest
+ * becomes C statements that call the TMPL_gen functions, which
+ * share their code with the walker so that the output is the same.
+ * A codegen holds the state of one translation.
+ */
+
+typedef struct {
+    FILE *out;            /* where the C code goes */
+    const char *prefix;   /* name of the render function */
+    FILE *errout;         /* error output file pointer */
+    TMPL_context *ctx;    /* removes the \ escapes from text */
+    int nfuncs;           /* number of functions so far */
+    int ntexts;           /* number of text arrays so far */
+    int error;            /* TMPL_ERROR or TMPL_ENOMEM on failure */
+} codegen;
+
+/*
+ * putliteral() writes the "len" bytes at "p" as a C string literal.
+ * If "split" is true, then we start a new line after each \n and
+ * after every 64 characters.
+ */
+
+static void
+putliteral(FILE *fp, const char *p, size_t len, int split) {
+    size_t i, col = 0;
+    int c;
+
+    putc('"', fp);
+    for (i = 0; i < len; i++) {
+        if (split != 0 && col >= 64) {
+            fputs("\"\n    \"", fp);
+            col = 0;
+        }
+        c = (unsigned char) p[i];
+        if (c == '\n') {
+            fputs("\\n", fp);
+        }
+        else if (c == '\t') {
+            fputs("\\t", fp);
+        }
+        else if (c == '"' || c == '\\' || c == '?') {
+            fprintf(fp, "\\%c", c);   /* \? prevents trigraphs */
+        }
+        else if (c < ' ' || c > '~') {
+            fprintf(fp, "\\%03o", c);
+        }
+        else {
+            putc(c, fp);
+        }
+        col++;
+        if (split != 0 && c == '\n' && i + 1 < len) {
+            fputs("\"\n    \"", fp);
+            col = 0;
+        }
+    }
+    putc('"', fp);
+}
+
+/* putstr() writes string "s" as a C string literal or 0 if null */
+
+static void
+putstr(FILE *fp, const char *s) {
+    if (s == 0) {
+        putc('0', fp);
+    }
+    else {
+        putliteral(fp, s, strlen(s), 0);
+    }
+}
+
+/*
+ * putattr() writes window attribute "wa" as a C string literal, or 0
+ * if it has its default value "dflt".
+ */
+
+static void
+putattr(FILE *fp, const windowattr *wa, long dflt) {
+    if (wa->var == 0 && wa->num == dflt) {
+        putc('0', fp);
+    }
+    else if (wa->var != 0) {
+        putstr(fp, wa->var);
+    }
+    else {
+        fprintf(fp, "\"%ld\"", wa->num);
+    }
+}
+
+/*
+ * gentext() writes a text array for the text sequence at "tag" to the
+ * C file and a statement that outputs it to "fp".  We remove the
+ * \ escapes here so that the generated code need not.
+ */
+
+static void
+gentext(codegen *cg, const tagnode *tag, FILE *fp, int indent) {
+    buffer *b = &cg->ctx->outbuf;
+
+    b->len = 0;
+    write_text(cg->ctx, tag->tag.text.start, tag->tag.text.len);
+    if (cg->ctx->error != 0) {
+        cg->error = cg->ctx->error;
+        return;
+    }
+    if (b->len == 0) {
+        return;
+    }
+    fprintf(cg->out, "static const char %s_text%d[] =\n    ",
+        cg->prefix, cg->ntexts);
+    putliteral(cg->out, b->data, b->len, 1);
+    fputs(";\n\n", cg->out);
+    fprintf(fp, "%*sTMPL_gen_text(ctx, %s_text%d, sizeof(%s_text%d) - 1);\n",
+        indent, "", cg->prefix, cg->ntexts, cg->prefix, cg->ntexts);
+    cg->ntexts++;
+}
+
+static int genfunc(codegen *cg, template *t, tagnode *list);
+static void genlist(codegen *cg, template *t, tagnode *tag, FILE *fp,
+    int indent);
+
+/*
+ * genif() writes an if statement for the TMPL_Tag_If (or
+ * TMPL_Tag_ElseIf) tag at "tag" to "fp".  Each TMPL_Tag_ElseIf becomes
+ * an "else if".  A test value that is a number is written as a C
+ * constant too, so that the generated code does not parse it each
+ * time, unless it has no C constant (such as "-inf").
+ */
+
+static void
+genif(codegen *cg, template *t, tagnode *tag, FILE *fp, int indent) {
+    const varvalue *test;
+    int type;
+
+    fprintf(fp, "%*s", indent, "");
+    for (;;) {
+        test = &tag->tag.ifelse.testnum;
+        type = tag->tag.ifelse.operator == 0 ||
+            (test->type == VAL_INT && test->i == LLONG_MIN) ||
+            (test->type == VAL_DOUBLE && isfinite(test->d) == 0) ?
+            VAL_STRING : test->type;
+        fputs(type == VAL_INT ? "if (TMPL_gen_if_int(ctx, varlist, " :
+            type == VAL_DOUBLE ? "if (TMPL_gen_if_double(ctx, varlist, " :
+            "if (TMPL_gen_if(ctx, varlist, ", fp);
+        putstr(fp, tag->tag.ifelse.varname);
+        fputs(", ", fp);
+        putstr(fp, tag->tag.ifelse.operator);
+        fputs(", ", fp);
+        putstr(fp, tag->tag.ifelse.testval);
+        if (type == VAL_INT) {
+            fprintf(fp, ", %lldLL", test->i);
+        }
+        else if (type == VAL_DOUBLE) {
+            fprintf(fp, ", %.17g", test->d);
+        }
+        fputs(")) {\n", fp);
+        genlist(cg, t, tag->tag.ifelse.tbranch, fp, indent + 4);
+        fprintf(fp, "%*s}\n", indent, "");
+        if ((tag = tag->tag.ifelse.fbranch) == 0) {
+            return;
+        }
+        if (tag->kind != TMPL_Tag_ElseIf || tag->next != 0) {
+            break;
+        }
+        fprintf(fp, "%*selse ", indent, "");
+    }
+    fprintf(fp, "%*selse {\n", indent, "");
+    genlist(cg, t, tag, fp, indent + 4);
+    fprintf(fp, "%*s}\n", indent, "");
+}
+
+/*
+ * genlist() writes the statements for the template-list at "tag" to
+ * "fp", indented by "indent" spaces.  A fragment cache would only
+ * save time here, so we ignore "cache=" attributes.
+ */
+
+static void
+genlist(codegen *cg, template *t, tagnode *tag, FILE *fp, int indent) {
+    const window *w;
+    int n;
+
+    for (; tag != 0 && cg->error == 0; tag = tag->next) {
+        switch(tag->kind) {
+
+        case TMPL_Tag_Text:
+            gentext(cg, tag, fp, indent);
+            break;
+
+        case TMPL_Tag_Var:
+            fprintf(fp, "%*sTMPL_gen_var(ctx, varlist, ", indent, "");
+            putstr(fp, tag->tag.var.varname);
+            fputs(", ", fp);
+            putstr(fp, tag->tag.var.dfltval);
+            fputs(", ", fp);
+            putstr(fp, tag->tag.var.fmtname);
+            fputs(");\n", fp);
+            break;
+
+        case TMPL_Tag_If:
+        case TMPL_Tag_ElseIf:
+            genif(cg, t, tag, fp, indent);
+            break;
+
+        case TMPL_Tag_Loop:
+            if ((n = genfunc(cg, t, tag->tag.loop.body)) < 0) {
+                break;
+            }
+            w = tag->tag.loop.window;
+            fprintf(fp, "%*sif (TMPL_gen_loop(ctx, varlist, ", indent, "");
+            putstr(fp, tag->tag.loop.loopname);
+            if (w == 0) {
+                fputs(", 0, 0, 0", fp);
+            }
+            else {
+                fputs(", ", fp);
+                putattr(fp, &w->offset, 0);
+                fputs(", ", fp);
+                putattr(fp, &w->limit, -1);
+                fputs(", ", fp);
+                putattr(fp, &w->step, 1);
+            }
+            fprintf(fp, ", %s_%d) != 0) {\n%*sreturn 1;\n%*s}\n",
+                cg->prefix, n, indent + 4, "", indent, "");
+            break;
+
+        /* nothing after a TMPL_Tag_Break or TMPL_Tag_Continue is output */
+
+        case TMPL_Tag_Break:
+        case TMPL_Tag_Continue:
+            fprintf(fp, "%*sreturn TMPL_gen_%s(ctx, %d);\n", indent, "",
+                tag->kind == TMPL_Tag_Break ? "break" : "continue",
+                tag->tag.breakcont.level);
+            return;
+
+        case TMPL_Tag_Include:
+            if (tag->tag.include.raw != 0) {
+                fprintf(fp, "%*sif (TMPL_gen_raw(ctx, ", indent, "");
+                putstr(fp, tag->tag.include.filename);
+                fputs(") != 0) {\n", fp);
+            }
+            else {
+                if ((cg->error = parseinclude(t, tag, cg->errout)) != 0 ||
+                    (n = genfunc(cg, tag->tag.include.tmpl,
+                    tag->tag.include.tmpl->roottag)) < 0)
+                {
+                    break;
+                }
+                fprintf(fp, "%*sif (%s_%d(ctx, varlist) != 0) {\n",
+                    indent, "", cg->prefix, n);
+            }
+            fprintf(fp, "%*sreturn 1;\n%*s}\n", indent + 4, "", indent, "");
+            break;
+        }
+    }
+}
+
+/*
+ * genfunc() writes a function for the template-list at "list" in
+ * template "t" to the C file and returns its number, or returns -1 on
+ * failure.  We collect the statements in a memory stream, so that the
+ * functions and text arrays that they use come first.
+ */
+
+static int
+genfunc(codegen *cg, template *t, tagnode *list) {
+    FILE *fp;
+    char *code = 0;
+    size_t len = 0;
+    int n;
+
+    if ((fp = open_memstream(&code, &len)) == 0) {
+        cg->error = TMPL_ENOMEM;
+        return -1;
+    }
+    genlist(cg, t, list, fp, 4);
+    if (fclose(fp) != 0 && cg->error == 0) {
+        cg->error = TMPL_ENOMEM;
+    }
+    n = cg->nfuncs++;
+    if (cg->error == 0) {
+        fprintf(cg->out, "static int\n%s_%d(TMPL_context *ctx, "
+            "const TMPL_varlist *varlist) {\n", cg->prefix, n);
+        fwrite(code, 1, len, cg->out);
+        fputs("    return 0;\n}\n\n", cg->out);
+    }
+    free(code);
+    return cg->error == 0 ? n : -1;
+}
+
+/*
+ * VARIABLE LIST FUNCTIONS
+ *
+ * A variable list and its variables, loop variables and rows come from
+ * one heap.  A list or loop variable that a function creates to add
+ * to another comes from the heap of the other (see heapof()), and
+ * one created on its own comes from the global heap.
+ *
+ * newvarlist() returns a new empty variable list allocated from heap
+ * "h" or returns null if we run out of memory.
+ */
+
+static TMPL_varlist *
+newvarlist(heap *h) {
+    TMPL_varlist *varlist;
+
+    varlist = (TMPL_varlist *) mymalloc(h, sizeof(*varlist));
+    if (varlist != 0) {
+        memset(varlist, 0, sizeof(*varlist));
+    }
+    return varlist;
+}
+
+/*
+ * addvar() adds simple variable "name" with value "value" to variable
+ * list "varlist".  We store the TMPL_var struct, the name and the value
+ * in one block of memory.  We return 0 on success or -1 if we run out
+ * of memory.
+ */
+
+static int
+addvar(TMPL_varlist *varlist, const char *name, const char *value) {
+    TMPL_var *var;
+    size_t nlen = strlen(name) + 1, vlen = strlen(value) + 1;
+
+    var = (TMPL_var *) mymalloc(heapof(varlist), sizeof(*var) + nlen + vlen);
+    if (var == 0) {
+        return -1;
+    }
+    memcpy(var->value, value, vlen);
+    var->name = memcpy(var->value + vlen, name, nlen);
+    var->type = VAL_STRING;
+    var->prec = -1;
+    memset(&var->num, 0, sizeof(var->num));
+    var->size = vlen;
+    var->next = varlist->var;
+    varlist->var = var;
+    return 0;
+}
+
+/*
+ * setvar() sets simple variable "name" in "varlist" to string value
+ * "value", replacing the value of the first variable of that name in
+ * place or else adding one.  A variable that has room for the value
+ * keeps its memory, and one that needs more gets at least twice as
+ * much, so that setting it over and over soon stops allocating.  We
+ * return the variable or return null if we run out of memory.
+ */
+
+static TMPL_var *
+setvar(TMPL_varlist *varlist, const char *name, const char *value) {
+    TMPL_var **varp, *var;
+    size_t nlen, vlen = strlen(value) + 1, size;
+
+    for (varp = &varlist->var; (var = *varp) != 0; varp = &var->next) {
+        if (strcmp(name, var->name) == 0) {
+            break;
+        }
+    }
+    if (var == 0) {
+        return addvar(varlist, name, value) == 0 ? varlist->var : 0;
+    }
+    if (vlen > var->size) {
+        nlen = strlen(name) + 1;
+        size = vlen > var->size * 2 ? vlen : var->size * 2;
+        var = (TMPL_var *) myrealloc(heapof(varlist), var,
+            sizeof(*var) + nlen + size);
+        if (var == 0) {
+            return 0;
+        }
+        var->name = memmove(var->value + size, var->value + var->size, nlen);
+        var->size = size;
+        *varp = var;
+    }
+    memcpy(var->value, value, vlen);
+    var->type = VAL_STRING;
+    var->prec = -1;
+    memset(&var->num, 0, sizeof(var->num));
+    return var;
+}
+
+/*
+ * newloop() returns a new empty loop variable allocated from heap "h"
+ * or returns null if we run out of memory.
+ */
+
+static TMPL_loop *
+newloop(heap *h) {
+    TMPL_loop *loop;
+
+    loop = (TMPL_loop *) mymalloc(h, sizeof(*loop));
+    if (loop != 0) {
+        memset(loop, 0, sizeof(*loop));
+    }
+    return loop;
+}
+
+/*
+ * growloop() makes room for at least "maxrows" rows in loop variable
+ * "loop".  We return 0 on success or -1 if we run out of memory.
+ */
+
+static int
+growloop(TMPL_loop *loop, size_t maxrows) {
+    TMPL_varlist **rows;
+
+    if (maxrows <= loop->maxrows) {
+        return 0;
+    }
+    if (maxrows > (size_t) -1 / sizeof(*rows)) {
+        return -1;
+    }
+    rows = (TMPL_varlist **) myrealloc(heapof(loop), loop->rows,
+        maxrows * sizeof(*rows));
+    if (rows == 0) {
+        return -1;
+    }
+    loop->rows = rows;
+    loop->maxrows = maxrows;
+    return 0;
+}
+
+/* freeloop() frees a loop variable that is not in a variable list */
+
+static void
+freeloop(TMPL_loop *loop) {
+    size_t i;
+
+    if (loop != 0) {
+        for (i = 0; i < loop->nkept && loop->cols == 0; i++) {
+            TMPL_free_varlist(loop->rows[i]);
+        }
+        myfree(loop->rows);
+        myfree(loop->cols);
+        myfree(loop);
+    }
+}
+
+/*
+ * bindloop() returns a new bound loop variable with "nrows" rows and
+ * the "ncols" columns in "cols", whose names we copy.  The caller
+ * sets where the columns are.  We return null if a column is bad or
+ * if we run out of memory.
+ */
+
+static TMPL_loop *
+bindloop(size_t nrows, const TMPL_column *cols, int ncols) {
+    static const size_t sizes[] = {
+        [TMPL_COL_STRING] = sizeof(char *),
+        [TMPL_COL_CHARS]  = 0,
+        [TMPL_COL_INT]    = sizeof(int),
+        [TMPL_COL_INT64]  = sizeof(int64_t),
+        [TMPL_COL_DOUBLE] = sizeof(double),
+    };
+    TMPL_loop *loop;
+    size_t len = 0;
+    char *names;
+    int i;
+
+    if (cols == 0 || ncols < 1) {
+        return 0;
+    }
+    for (i = 0; i < ncols; i++) {
+        if (cols[i].name == 0 || cols[i].type < TMPL_COL_STRING ||
+            cols[i].type > TMPL_COL_DOUBLE ||
+            (cols[i].type == TMPL_COL_CHARS && cols[i].size == 0))
+        {
+            return 0;
+        }
+        len += strlen(cols[i].name) + 1;
+    }
+    if ((loop = newloop(&global_heap)) == 0) {
+        return 0;
+    }
+    loop->cols = (boundcol *) mymalloc(heapof(loop),
+        ncols * sizeof(*loop->cols) + len);
+    if (loop->cols == 0) {
+        freeloop(loop);
+        return 0;
+    }
+    names = (char *) (loop->cols + ncols);
+    for (i = 0; i < ncols; i++) {
+        loop->cols[i].name = strcpy(names, cols[i].name);
+        names += strlen(names) + 1;
+        loop->cols[i].type = cols[i].type;
+        loop->cols[i].size = cols[i].type == TMPL_COL_CHARS ?
+            cols[i].size : sizes[cols[i].type];
+        loop->cols[i].base = 0;
+        loop->cols[i].stride = 0;
+    }
+    loop->ncols = ncols;
+    loop->nrows = nrows;
+    return loop;
+}
+
+/*
+ * JSON FUNCTIONS
+ *
+ * A JSON object becomes a variable list.  A member whose value is a
+ * string, number or true becomes a simple variable and false becomes
+ * a variable with a null string value, so that an IF tag finds it
+ * false.  A null member is left out.  An array becomes a loop
+ * variable with a variable list for each element, and so does an
+ * object nested in an object (with one variable list).  An array
+ * element that is not an object becomes a variable list with one
+ * variable named "value".
+ *
+ * We decode strings into one buffer that we reuse, and copy them
+ * into the variables as we go.  The parser keeps its state in a
+ * jsonparser struct.
+ */
+
+#define JSON_MAX_DEPTH 100
+
+typedef struct {
+    const char *p;        /* next character to parse */
+    const char *end;      /* end of input */
+    int linenum;          /* current line number */
+    int depth;            /* nesting depth of objects and arrays */
+    buffer buf;           /* decoded strings */
+    const char *err;      /* error message (if any) */
+    heap *heap;           /* heap for the variable lists */
+}
+jsonparser;
+
+static TMPL_varlist *jsonobject(jsonparser *jp);
+
+/* jsonspaces() skips white space and returns the next character */
+
+static int
+jsonspaces(jsonparser *jp) {
+    for (; jp->p < jp->end; jp->p++) {
+        if (*jp->p == '\n') {
+            jp->linenum++;
+        }
+        else if (*jp->p != ' ' && *jp->p != '\t' && *jp->p != '\r') {
+            return (unsigned char) *jp->p;
+        }
+    }
+    return EOF;
+}
+
+/* jsonerror() records the first error and returns null */
+
+static void *
+jsonerror(jsonparser *jp, const char *err) {
+    if (jp->err == 0) {
+        jp->err = err;
+    }
+    return 0;
+}
+
+/* jsonhex() returns the value of 4 hex digits at "p" or -1 */
+
+static long
+jsonhex(const char *p) {
+    long val = 0;
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        if (!isxdigit((unsigned char) p[i])) {
+            return -1;
+        }
+        val = val * 16 + (isdigit((unsigned char) p[i]) ? p[i] - '0' :
+            tolower((unsigned char) p[i]) - 'a' + 10);
+    }
+    return val;
+}
+
+/*
+ * jsonstring() decodes the string at jp->p and appends it to jp->buf
+ * with a terminating null.  We return the offset of the string in
+ * jp->buf or -1 on failure.
+ */
+
+static long
+jsonstring(jsonparser *jp) {
+    long start = jp->buf.len;
+    const char *p = jp->p + 1, *run;
+    long c, c2;
+    char utf[4];
+    int n;
+
+    for (;;) {
+
+        /* copy characters up to a quote or backslash at once */
+
+        for (run = p; p < jp->end && *p != '"' && *p != '\\'; p++) {
+            if ((unsigned char) *p < ' ') {
+                jsonerror(jp, "control character in string");
+                return -1;
+            }
+        }
+        if (bufappend(jp->heap, &jp->buf, run, p - run) != 0) {
+            jsonerror(jp, "out of memory");
+            return -1;
+        }
+        if (p >= jp->end) {
+            jsonerror(jp, "unterminated string");
+            return -1;
+        }
+        if (*p++ == '"') {
+            break;
+        }
+        if (p >= jp->end) {
+            jsonerror(jp, "unterminated string");
+            return -1;
+        }
+        n = 1;
+        switch (*p++) {
+        case '"':  utf[0] = '"';  break;
+        case '\\': utf[0] = '\\'; break;
+        case '/':  utf[0] = '/';  break;
+        case 'b':  utf[0] = '\b'; break;
+        case 'f':  utf[0] = '\f'; break;
+        case 'n':  utf[0] = '\n'; break;
+        case 'r':  utf[0] = '\r'; break;
+        case 't':  utf[0] = '\t'; break;
+        case 'u':
+            if (jp->end - p < 4 || (c = jsonhex(p)) < 0) {
+                jsonerror(jp, "bad \\u escape");
+                return -1;
+            }
+            p += 4;
+
+            /* combine a surrogate pair */
+
+            if (c >= 0xd800 && c < 0xdc00 && jp->end - p >= 6 &&
+                p[0] == '\\' && p[1] == 'u' &&
+                (c2 = jsonhex(p + 2)) >= 0xdc00 && c2 < 0xe000)
+            {
+                c = 0x10000 + ((c - 0xd800) << 10) + (c2 - 0xdc00);
+                p += 6;
+            }
+
+            /* encode as UTF-8 */
+
+            if (c < 0x80) {
+                utf[0] = c;
+            }
+            else if (c < 0x800) {
+                utf[0] = 0xc0 | c >> 6;
+                utf[1] = 0x80 | (c & 0x3f);
+                n = 2;
+            }
+            else if (c < 0x10000) {
+                utf[0] = 0xe0 | c >> 12;
+                utf[1] = 0x80 | (c >> 6 & 0x3f);
+                utf[2] = 0x80 | (c & 0x3f);
+                n = 3;
+            }
+            else {
+                utf[0] = 0xf0 | c >> 18;
+                utf[1] = 0x80 | (c >> 12 & 0x3f);
+                utf[2] = 0x80 | (c >> 6 & 0x3f);
+                utf[3] = 0x80 | (c & 0x3f);
+                n = 4;
+            }
+            break;
+        default:
+            jsonerror(jp, "bad escape in string");
+            return -1;
+        }
+        if (bufappend(jp->heap, &jp->buf, utf, n) != 0) {
+            jsonerror(jp, "out of memory");
+            return -1;
+        }
+    }
+    if (bufappend(jp->heap, &jp->buf, "", 1) != 0) {
+        jsonerror(jp, "out of memory");
+        return -1;
+    }
+    jp->p = p;
+    return start;
+}
+
+/*
+ * jsonnumber() returns true if the "len" bytes at "p" are a number
+ * in the JSON grammar: an optional minus sign, an integer part
+ * without leading zeros, an optional fraction and an optional
+ * exponent.
+ */
+
+static int
+jsonnumber(const char *p, size_t len) {
+    size_t i = 0;
+
+    if (i < len && p[i] == '-') {
+        i++;
+    }
+    if (i < len && p[i] == '0') {
+        i++;
+    }
+    else if (i < len && isdigit((unsigned char) p[i])) {
+        while (i < len && isdigit((unsigned char) p[i])) {
+            i++;
+        }
+    }
+    else {
+        return 0;
+    }
+    if (i < len && p[i] == '.') {
+        if (++i == len || !isdigit((unsigned char) p[i])) {
+            return 0;
+        }
+        while (i < len && isdigit((unsigned char) p[i])) {
+            i++;
+        }
+    }
+    if (i < len && (p[i] == 'e' || p[i] == 'E')) {
+        if (++i < len && (p[i] == '+' || p[i] == '-')) {
+            i++;
+        }
+        if (i == len || !isdigit((unsigned char) p[i])) {
+            return 0;
+        }
+        while (i < len && isdigit((unsigned char) p[i])) {
+            i++;
+        }
+    }
+    return i == len;
+}
+
+/*
+ * jsonscalar() decodes the number, true, false or null at jp->p and
+ * appends its value to jp->buf like jsonstring().  We return the
+ * offset of the value, -2 for null or -1 on failure.
+ */
+
+static long
+jsonscalar(jsonparser *jp) {
+    long start = jp->buf.len;
+    const char *p = jp->p, *value = jp->p;
+    size_t len, n;
+
+    if (jp->end - p >= 4 && strncmp(p, "null", 4) == 0) {
+        jp->p += 4;
+        return -2;
+    }
+    if (jp->end - p >= 4 && strncmp(p, "true", 4) == 0) {
+        n = len = 4;
+    }
+    else if (jp->end - p >= 5 && strncmp(p, "false", 5) == 0) {
+        value = "";
+        len = 0;
+        n = 5;
+    }
+    else {
+        for (len = 0; p + len < jp->end && (isdigit((unsigned char) p[len])
+            || (p[len] != 0 && strchr("+-.eE", p[len]) != 0)); len++)
+            ;
+        if (len == 0 || (p[0] != '-' && !isdigit((unsigned char) p[0]))) {
+            jsonerror(jp, "unexpected character");
+            return -1;
+        }
+        if (!jsonnumber(p, len)) {
+            jsonerror(jp, "invalid number");
+            return -1;
+        }
+        n = len;
+    }
+    if (bufappend(jp->heap, &jp->buf, value, len) != 0 ||
+        bufappend(jp->heap, &jp->buf, "", 1) != 0)
+    {
+        jsonerror(jp, "out of memory");
+        return -1;
+    }
+    jp->p += n;
+    return start;
+}
+
+/*
+ * jsonelement() parses the array element at jp->p and returns a
+ * variable list for it, or returns null on failure.
+ */
+
+static TMPL_varlist *
+jsonelement(jsonparser *jp) {
+    TMPL_varlist *varlist;
+    long start = jp->buf.len, value;
+    int c;
+
+    if ((c = jsonspaces(jp)) == '{') {
+        return jsonobject(jp);
+    }
+    if (c == '[') {
+        return jsonerror(jp, "array in array");
+    }
+    if ((value = c == '"' ? jsonstring(jp) : jsonscalar(jp)) == -1) {
+        return 0;
+    }
+    if ((varlist = newvarlist(jp->heap)) == 0 ||
+        (value >= 0 && addvar(varlist, "value", jp->buf.data + value) != 0))
+    {
+        TMPL_free_varlist(varlist);
+        return jsonerror(jp, "out of memory");
+    }
+    jp->buf.len = start;
+    return varlist;
+}
+
+/*
+ * jsonarray() parses the array at jp->p and sets "*loop" to a loop
+ * variable for it, or to null if the array is empty.  We return 0 on
+ * success or -1 on failure.
+ */
+
+static int
+jsonarray(jsonparser *jp, TMPL_loop **loop) {
+    TMPL_varlist *varlist;
+    TMPL_loop *lp;
+    int c;
+
+    *loop = 0;
+    if (++jp->depth > JSON_MAX_DEPTH) {
+        jsonerror(jp, "too deeply nested");
+        return -1;
+    }
+    jp->p++;
+    if (jsonspaces(jp) == ']') {
+        jp->p++;
+        jp->depth--;
+        return 0;
+    }
+    for (;;) {
+        if ((varlist = jsonelement(jp)) == 0) {
+            break;
+        }
+        if ((lp = TMPL_add_varlist(*loop, varlist)) == 0) {
+            TMPL_free_varlist(varlist);
+            jsonerror(jp, "out of memory");
+            break;
+        }
+        *loop = lp;
+        if ((c = jsonspaces(jp)) == ']') {
+            jp->p++;
+            jp->depth--;
+            return 0;
+        }
+        if (c != ',') {
+            jsonerror(jp, "expected ',' or ']'");
+            break;
+        }
+        jp->p++;
+    }
+    freeloop(*loop);
+    *loop = 0;
+    return -1;
+}
+
+/*
+ * jsonmember() parses the value at jp->p of the object member whose
+ * name is at offset "name" in jp->buf and adds it to "varlist".  We
+ * return 0 on success or -1 on failure.
+ */
+
+static int
+jsonmember(jsonparser *jp, TMPL_varlist *varlist, long name) {
+    TMPL_varlist *vl;
+    TMPL_loop *loop = 0;
+    long value;
+    int c;
+
+    if ((c = jsonspaces(jp)) == '[') {
+        if (jsonarray(jp, &loop) != 0) {
+            return -1;
+        }
+    }
+    else if (c == '{') {
+        if ((vl = jsonobject(jp)) == 0) {
+            return -1;
+        }
+        if ((loop = TMPL_add_varlist(0, vl)) == 0) {
+            TMPL_free_varlist(vl);
+            jsonerror(jp, "out of memory");
+            return -1;
+        }
+    }
+    else {
+        if ((value = c == '"' ? jsonstring(jp) : jsonscalar(jp)) == -1) {
+            return -1;
+        }
+        if (value >= 0 && addvar(varlist, jp->buf.data + name,
+            jp->buf.data + value) != 0)
+        {
+            jsonerror(jp, "out of memory");
+            return -1;
+        }
+    }
+    if (loop != 0 && TMPL_add_loop(varlist, jp->buf.data + name, loop) == 0) {
+        freeloop(loop);
+        jsonerror(jp, "out of memory");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * jsonobject() parses the object at jp->p and returns it as a
+ * variable list, or returns null on failure.
+ */
+
+static TMPL_varlist *
+jsonobject(jsonparser *jp) {
+    TMPL_varlist *varlist;
+    long name;
+    int c;
+
+    if (++jp->depth > JSON_MAX_DEPTH) {
+        return jsonerror(jp, "too deeply nested");
+    }
+    if ((varlist = newvarlist(jp->heap)) == 0) {
+        return jsonerror(jp, "out of memory");
+    }
+    jp->p++;
+    if ((c = jsonspaces(jp)) == '}') {
+        jp->p++;
+        jp->depth--;
+        return varlist;
+    }
+    for (;;) {
+        if (c != '"') {
+            jsonerror(jp, "expected a member name");
+            break;
+        }
+        if ((name = jsonstring(jp)) < 0) {
+            break;
+        }
+        if (jsonspaces(jp) != ':') {
+            jsonerror(jp, "expected ':'");
+            break;
+        }
+        jp->p++;
+        if (jsonmember(jp, varlist, name) != 0) {
+            break;
+        }
+        jp->buf.len = name;
+        if ((c = jsonspaces(jp)) == '}') {
+            jp->p++;
+            jp->depth--;
+            return varlist;
+        }
+        if (c != ',') {
+            jsonerror(jp, "expected ',' or '}'");
+            break;
+        }
+        jp->p++;
+        c = jsonspaces(jp);
+    }
+    TMPL_free_varlist(varlist);
+    return 0;
+}
+
+/*
+ * EXPORTED FUNCTIONS
+ *
+ * TMPL_new_varlist() returns a new empty variable list allocated with
+ * the allocator of render context "ctx", or with the global allocator
+ * if "ctx" is null.  The variables, loop variables and rows added to
+ * it come from the same allocator.  We return null if we run out of
+ * memory.
+ */
+
+TMPL_varlist *
+TMPL_new_varlist(TMPL_context *ctx) {
+    return newvarlist(ctx != 0 ? &ctx->heap : &global_heap);
+}
+
+/*
+ * TMPL_add_var() adds one or more simple variables to variable list
+ * "varlist" and returns the result.  If "varlist" is null, then we
+ * create it.  The parameter list has a variable number of "char *"
+ * parameters terminated by a null parameter.  Each pair of parameters
+ * is a variable name and value that we store in a TMPL_var struct and
+ * link into "varlist".  If we run out of memory, then we return null
+ * (after freeing "varlist" only if we created it).
+ */
+
+TMPL_varlist *
+TMPL_add_var(TMPL_varlist *varlist, ...) {
+    va_list ap;
+    const char *name, *value;
+    TMPL_varlist *created = 0;
+
+    va_start(ap, varlist);
+    while ((name = va_arg(ap, char *)) != 0 &&
+        (value = va_arg(ap, char *)) != 0)
+    {
+        if (varlist == 0 &&
+            (varlist = created = newvarlist(&global_heap)) == 0)
+        {
+            break;
+        }
+        if (addvar(varlist, name, value) != 0) {
+            TMPL_free_varlist(created);
+            varlist = 0;
+            break;
+        }
+    }
+    va_end(ap);
+    return varlist;
+}
+
+/*
+ * addtyped() adds simple variable "name" of type "type" with no string
+ * value to "varlist" like TMPL_add_var().  The caller sets the value
+ * of varlist->var.
+ */
+
+static TMPL_varlist *
+addtyped(TMPL_varlist *varlist, const char *name, int type) {
+    TMPL_varlist *created = 0;
+
+    if (varlist == 0 &&
+        (varlist = created = newvarlist(&global_heap)) == 0)
+    {
+        return 0;
+    }
+    if (addvar(varlist, name, "") != 0) {
+        TMPL_free_varlist(created);
+        return 0;
+    }
+    varlist->var->type = type;
+    return varlist;
+}
+
+/*
+ * addnum() adds a simple variable with a typed value to "varlist" like
+ * TMPL_add_var().  It has no string value, so we format it only if it
+ * is output.
+ */
+
+static TMPL_varlist *
+addnum(TMPL_varlist *varlist, const char *name, const varvalue *v) {
+    if ((varlist = addtyped(varlist, name, v->type)) == 0) {
+        return 0;
+    }
+    varlist->var->prec = v->prec;
+    if (v->type == VAL_DOUBLE) {
+        varlist->var->num.d = v->d;
+    }
+    else {
+        varlist->var->num.i = v->i;
+    }
+    return varlist;
+}
+
+/*
+ * TMPL_add_int() adds simple variable "name" with integer value
+ * "value" to variable list "varlist" and returns the result, like
+ * TMPL_add_var().
+ */
+
+TMPL_varlist *
+TMPL_add_int(TMPL_varlist *varlist, const char *name, long long value) {
+    varvalue v;
+
+    v.type = VAL_INT;
+    v.prec = -1;
+    v.i = value;
+    return addnum(varlist, name, &v);
+}
+
+/*
+ * TMPL_add_double() adds simple variable "name" with floating point
+ * value "value" to variable list "varlist" and returns the result,
+ * like TMPL_add_var().  We output it with "decimals" decimal places
+ * (at most 20) or, if "decimals" is negative, with up to 15
+ * significant digits.
+ */
+
+TMPL_varlist *
+TMPL_add_double(TMPL_varlist *varlist, const char *name, double value,
+    int decimals)
+{
+    varvalue v;
+
+    v.type = VAL_DOUBLE;
+    v.prec = decimals > 20 ? 20 : decimals < 0 ? -1 : decimals;
+    v.d = value;
+    return addnum(varlist, name, &v);
+}
+
+/*
+ * TMPL_add_bool() adds simple variable "name" with boolean value
+ * "value" to variable list "varlist" and returns the result, like
+ * TMPL_add_var().  We output true as "true" and false as "".
+ */
+
+TMPL_varlist *
+TMPL_add_bool(TMPL_varlist *varlist, const char *name, int value) {
+    varvalue v;
+
+    v.type = VAL_BOOL;
+    v.prec = -1;
+    v.i = value != 0;
+    return addnum(varlist, name, &v);
+}
+
+/*
+ * TMPL_add_func() adds simple variable "name" to variable list
+ * "varlist" and returns the result, like TMPL_add_var().  Its value is
+ * what func(name, arg) returns (null if it has none), which we call
+ * the first time a render reads the variable.  The value need only
+ * last until "func" is called again, because we keep a copy for the
+ * rest of the render.
+ */
+
+TMPL_varlist *
+TMPL_add_func(TMPL_varlist *varlist, const char *name, TMPL_valfunc func,
+    void *arg)
+{
+    if ((varlist = addtyped(varlist, name, VAL_FUNC)) != 0) {
+        varlist->var->num.func.func = func;
+        varlist->var->num.func.arg = arg;
+    }
+    return varlist;
+}
+
+/*
+ * TMPL_add_stream() adds simple variable "name" to variable list
+ * "varlist" and returns the result, like TMPL_add_var().  A
+ * TMPL_Tag_Var tag outputs it by calling func(name, arg, out), which
+ * writes the value to stream "out" like a format function.
+ */
+
+TMPL_varlist *
+TMPL_add_stream(TMPL_varlist *varlist, const char *name,
+    TMPL_streamfunc func, void *arg)
+{
+    if ((varlist = addtyped(varlist, name, VAL_STREAM)) != 0) {
+        varlist->var->num.stream.func = func;
+        varlist->var->num.stream.arg = arg;
+    }
+    return varlist;
+}
+
+/*
+ * TMPL_set_var() sets simple variable "name" in variable list
+ * "varlist" to "value" and returns "varlist".  If "varlist" has a
+ * variable named "name" (not counting enclosing lists or its base),
+ * then we replace its value in place, so a variable list can be set
+ * again for each output without allocating memory.  Otherwise we add
+ * the variable like TMPL_add_var().  If "varlist" is null, then we
+ * create it.  We decline to change a base that is shared (see
+ * TMPL_set_base()).  If we run out of memory, then we return null
+ * (after freeing "varlist" only if we created it).
+ */
+
+TMPL_varlist *
+TMPL_set_var(TMPL_varlist *varlist, const char *name, const char *value) {
+    TMPL_varlist *created = 0;
+
+    if (name == 0 || value == 0 || (varlist != 0 &&
+        __atomic_load_n(&varlist->refs, __ATOMIC_ACQUIRE) != 0))
+    {
+        return varlist;
+    }
+    if (varlist == 0 &&
+        (varlist = created = newvarlist(&global_heap)) == 0)
+    {
+        return 0;
+    }
+    if (setvar(varlist, name, value) == 0) {
+        TMPL_free_varlist(created);
+        return 0;
+    }
+    return varlist;
+}
+
+/*
+ * setnum() sets a simple variable to a typed value like
+ * TMPL_set_var().
+ */
+
+static TMPL_varlist *
+setnum(TMPL_varlist *varlist, const char *name, const varvalue *v) {
+    TMPL_var *var;
+
+    if ((varlist = TMPL_set_var(varlist, name, "")) == 0 ||
+        __atomic_load_n(&varlist->refs, __ATOMIC_ACQUIRE) != 0)
+    {
+        return varlist;
+    }
+    for (var = varlist->var; strcmp(name, var->name) != 0; var = var->next)
+        ;
+    var->type = v->type;
+    var->prec = v->prec;
+    if (v->type == VAL_DOUBLE) {
+        var->num.d = v->d;
+    }
+    else {
+        var->num.i = v->i;
+    }
+    return varlist;
+}
+
+/*
+ * TMPL_set_int(), TMPL_set_double() and TMPL_set_bool() set simple
+ * variable "name" in variable list "varlist" to a typed value like
+ * TMPL_set_var() and return the result.  The values are like those
+ * of TMPL_add_int(), TMPL_add_double() and TMPL_add_bool().
+ */
+
+TMPL_varlist *
+TMPL_set_int(TMPL_varlist *varlist, const char *name, long long value) {
+    varvalue v;
+
+    v.type = VAL_INT;
+    v.prec = -1;
+    v.i = value;
+    return name == 0 ? varlist : setnum(varlist, name, &v);
+}
+
+TMPL_varlist *
+TMPL_set_double(TMPL_varlist *varlist, const char *name, double value,
+    int decimals)
+{
+    varvalue v;
+
+    v.type = VAL_DOUBLE;
+    v.prec = decimals > 20 ? 20 : decimals < 0 ? -1 : decimals;
+    v.d = value;
+    return name == 0 ? varlist : setnum(varlist, name, &v);
+}
+
+TMPL_varlist *
+TMPL_set_bool(TMPL_varlist *varlist, const char *name, int value) {
+    varvalue v;
+
+    v.type = VAL_BOOL;
+    v.prec = -1;
+    v.i = value != 0;
+    return name == 0 ? varlist : setnum(varlist, name, &v);
+}
+
+/*
+ * TMPL_remove_var() removes every simple variable named "name" from
+ * variable list "varlist" (but not from enclosing lists or its base)
+ * and returns how many it removed.  We decline to change a base that
+ * is shared.
+ */
+
+int
+TMPL_remove_var(TMPL_varlist *varlist, const char *name) {
+    TMPL_var **varp, *var;
+    int n = 0;
+
+    if (varlist == 0 || name == 0 ||
+        __atomic_load_n(&varlist->refs, __ATOMIC_ACQUIRE) != 0)
+    {
+        return 0;
+    }
+    for (varp = &varlist->var; (var = *varp) != 0;) {
+        if (strcmp(name, var->name) == 0) {
+            *varp = var->next;
+            myfree(var);
+            n++;
+        }
+        else {
+            varp = &var->next;
+        }
+    }
+    return n;
+}
+
+/*
+ * TMPL_json_varlist() builds a variable list from the "len" bytes of
+ * JSON text at "json", which must be an object (see JSON FUNCTIONS
+ * above).  If the text is not valid JSON or we run out of memory, we
+ * write a message to "errout" (if not null) and return null.
+ */
+
+TMPL_varlist *
+TMPL_json_varlist(const char *json, size_t len, FILE *errout) {
+    return TMPL_json_context_varlist(0, json, len, errout);
+}
+
+/*
+ * TMPL_json_context_varlist() is like TMPL_json_varlist() except that
+ * the variable list is allocated like TMPL_new_varlist(ctx).
+ */
+
+TMPL_varlist *
+TMPL_json_context_varlist(TMPL_context *ctx, const char *json, size_t len,
+    FILE *errout)
+{
+    jsonparser jp;
+    TMPL_varlist *varlist = 0;
+
+    memset(&jp, 0, sizeof(jp));
+    jp.heap = ctx != 0 ? &ctx->heap : &global_heap;
+    jp.p = json;
+    jp.end = json + len;
+    jp.linenum = 1;
+    if (jsonspaces(&jp) != '{') {
+        jsonerror(&jp, "expected an object");
+    }
+    else if ((varlist = jsonobject(&jp)) != 0 && jsonspaces(&jp) != EOF) {
+        jsonerror(&jp, "unexpected text after the object");
+        TMPL_free_varlist(varlist);
+        varlist = 0;
+    }
+    myfree(jp.buf.data);
+    if (varlist == 0 && errout != 0) {
+        fprintf(errout, "C Template library: %s in JSON input line %d\n",
+            jp.err, jp.linenum);
+    }
+    return varlist;
+}
+
+/*
+ * TMPL_add_loop() adds loop variable "loop" to variable list "varlist"
+ * and returns the result.  If "varlist" is null, then we create it.
+ * We decline to add "loop" if 1) "loop" has already been added to a
+ * variable list or 2) adding "loop" would create a cycle because
+ * "loop" contains "varlist".  If we run out of memory, then we return
+ * null (after freeing "varlist" only if we created it).
+ */
+
+TMPL_varlist *
+TMPL_add_loop(TMPL_varlist *varlist, const char *name, TMPL_loop *loop) {
+    TMPL_loop *lp;
+    TMPL_varlist *created = 0;
+
+    /* if sanity check fails, just return */
+
+    if (name == 0 || loop == 0 || loop->parent != 0) {
+        return varlist;
+    }
+    if (varlist == 0 && (varlist = created = newvarlist(heapof(loop))) == 0) {
+        return 0;
+    }
+
+    /* if sanity check for cycle fails, just return */
+
+    for (lp = varlist->parent; lp != 0;
+        lp = lp->parent == 0 ? 0 : lp->parent->parent)
+    {
+        if (lp == loop) {
+            return varlist;
+        }
+    }
+    if ((loop->name = mystrdup(heapof(varlist), name)) == 0) {
+        TMPL_free_varlist(created);
+        return 0;
+    }
+    loop->parent = varlist;
+    loop->next = varlist->loop;
+    varlist->loop = loop;
+    return varlist;
+}
+
+/*
+ * TMPL_add_varlist() adds variable list "varlist" to loop variable
+ * "loop" and returns the result.  If "loop" is null, then we create it.
+ * We decline to add "varlist" if 1) "varlist" has already been added
+ * to a loop variable or 2) adding "varlist" would create a cycle
+ * because "varlist" contains "loop".  If we run out of memory creating
+ * "loop", then we return null.
+ */
+
+TMPL_loop *
+TMPL_add_varlist(TMPL_loop *loop, TMPL_varlist *varlist) {
+    TMPL_varlist *vl;
+    TMPL_loop *created = 0;
+
+    /* if sanity check fails, just return */
+
+    if (varlist == 0 || varlist->parent != 0 ||
+        __atomic_load_n(&varlist->refs, __ATOMIC_ACQUIRE) != 0 ||
+        (loop != 0 && loop->cols != 0))
+    {
+        return loop;
+    }
+    if (loop == 0 && (loop = created = newloop(heapof(varlist))) == 0) {
+        return 0;
+    }
+
+    /* if sanity check for cycle fails, just return */
+
+    for (vl = loop->parent; vl != 0;
+        vl = vl->parent == 0 ? 0 : vl->parent->parent)
+    {
+        if (vl == varlist) {
+            return loop;
+        }
+    }
+    if (loop->nrows == loop->maxrows &&
+        growloop(loop, loop->maxrows == 0 ? 8 : loop->maxrows * 2) != 0)
+    {
+        freeloop(created);
+        return 0;
+    }
+    /* a row kept for reuse makes way for "varlist" */
+
+    if (loop->nrows < loop->nkept) {
+        TMPL_free_varlist(loop->rows[loop->nrows]);
+    }
+    varlist->parent = loop;
+    loop->rows[loop->nrows++] = varlist;
+    if (loop->nkept < loop->nrows) {
+        loop->nkept = loop->nrows;
+    }
+    return loop;
+}
+
+/*
+ * TMPL_reserve_loop() makes room for "nrows" rows in loop variable
+ * "loop", so that adding that many rows with TMPL_add_varlist() does
+ * not allocate memory again.  If "loop" is null, then we create it.
+ * We return "loop" or return null if we run out of memory.
+ */
+
+TMPL_loop *
+TMPL_reserve_loop(TMPL_loop *loop, size_t nrows) {
+    TMPL_loop *created = 0;
+
+    if (loop == 0 && (loop = created = newloop(&global_heap)) == 0) {
+        return 0;
+    }
+    if (loop->cols == 0 && growloop(loop, nrows) != 0) {
+        freeloop(created);
+        return 0;
+    }
+    return loop;
+}
+
+/* TMPL_loop_size() returns the number of rows in loop variable "loop" */
+
+size_t
+TMPL_loop_size(const TMPL_loop *loop) {
+    return loop == 0 ? 0 : loop->nrows;
+}
+
+/*
+ * TMPL_loop_row() returns row "i" of loop variable "loop", counting
+ * from 0, or returns null if there is no such row.
+ */
+
+TMPL_varlist *
+TMPL_loop_row(const TMPL_loop *loop, size_t i) {
+    return loop == 0 || loop->cols != 0 || i >= loop->nrows ? 0 :
+        loop->rows[i];
+}
+
+/*
+ * TMPL_reset_loop() empties loop variable "loop" but keeps its rows,
+ * with their variables, for TMPL_next_row() to reuse.
+ */
+
+void
+TMPL_reset_loop(TMPL_loop *loop) {
+    if (loop != 0 && loop->cols == 0) {
+        loop->nrows = 0;
+    }
+}
+
+/*
+ * TMPL_next_row() adds a row to loop variable "loop" and returns it.
+ * We reuse a row kept by TMPL_reset_loop(), which still has the
+ * variables that it had, or else add a new empty variable list.  We
+ * return null if "loop" is null or bound or if we run out of memory.
+ */
+
+TMPL_varlist *
+TMPL_next_row(TMPL_loop *loop) {
+    TMPL_varlist *varlist;
+
+    if (loop == 0 || loop->cols != 0) {
+        return 0;
+    }
+    if (loop->nrows < loop->nkept) {
+        return loop->rows[loop->nrows++];
+    }
+    if ((varlist = newvarlist(heapof(loop))) == 0 ||
+        TMPL_add_varlist(loop, varlist) == 0)
+    {
+        TMPL_free_varlist(varlist);
+        return 0;
+    }
+    return varlist;
+}
+
+/*
+ * TMPL_bind_rows() returns a bound loop variable whose "nrows" rows
+ * are C structs (or other data) starting at "rows", "stride" bytes
+ * apart.  Array "cols" of "ncols" columns gives the variable name,
+ * type and offset of each field that the template may refer to.  We
+ * read the fields when the template is output, so the data must not
+ * go away until then.  We return null if a parameter is bad or if we
+ * run out of memory.
+ */
+
+TMPL_loop *
+TMPL_bind_rows(const void *rows, size_t nrows, size_t stride,
+    const TMPL_column *cols, int ncols)
+{
+    TMPL_loop *loop;
+    int i;
+
+    if ((rows == 0 && nrows != 0) ||
+        (loop = bindloop(nrows, cols, ncols)) == 0)
+    {
+        return 0;
+    }
+    for (i = 0; i < ncols; i++) {
+        loop->cols[i].base = (const char *) rows + cols[i].offset;
+        loop->cols[i].stride = stride;
+    }
+    return loop;
+}
+
+/*
+ * TMPL_bind_columns() returns a bound loop variable with "nrows" rows
+ * whose columns are stored in separate arrays.  Column "cols[i]" is
+ * array "arrays[i]" and its offset is ignored.  Otherwise it is like
+ * TMPL_bind_rows().
+ */
+
+TMPL_loop *
+TMPL_bind_columns(const void *const *arrays, size_t nrows,
+    const TMPL_column *cols, int ncols)
+{
+    TMPL_loop *loop;
+    int i;
+
+    if (arrays == 0 || (loop = bindloop(nrows, cols, ncols)) == 0) {
+        return 0;
+    }
+    for (i = 0; i < ncols; i++) {
+        if (arrays[i] == 0 && nrows != 0) {
+            freeloop(loop);
+            return 0;
+        }
+        loop->cols[i].base = (const char *) arrays[i];
+        loop->cols[i].stride = loop->cols[i].size;
+    }
+    return loop;
+}
+
+/*
+ * TMPL_set_base() makes "base" the base of variable list "varlist"
+ * and returns "varlist".  If "varlist" is null, then we create it.  A
+ * lookup that does not find a name in "varlist" searches "base"
+ * before the variable lists that enclose "varlist", so many variable
+ * lists can share the variables of one base.  A base must not be
+ * changed while it is shared.  The base of "varlist" holds a reference
+ * to "base" until it is replaced or "varlist" is freed.  A null "base"
+ * removes the base of "varlist".  We decline to make a base of a
+ * variable list in a loop variable, or one that contains "varlist" or
+ * is based on it.  If we run out of memory, then we return null.
+ */
+
+TMPL_varlist *
+TMPL_set_base(TMPL_varlist *varlist, TMPL_varlist *base) {
+    const TMPL_varlist *vl;
+    TMPL_varlist *old;
+
+    if (base != 0) {
+        if (base->parent != 0) {
+            return varlist;
+        }
+
+        /* if sanity check for cycle fails, just return */
+
+        for (vl = varlist; vl != 0;
+            vl = vl->parent == 0 ? 0 : vl->parent->parent)
+        {
+            if (vl == base) {
+                return varlist;
+            }
+        }
+        for (vl = base; varlist != 0 && vl != 0; vl = vl->base) {
+            if (vl == varlist) {
+                return varlist;
+            }
+        }
+    }
+    if (varlist == 0 && (varlist = newvarlist(heapof(base))) == 0) {
+        return 0;
+    }
+    if (base != 0) {
+        __atomic_add_fetch(&base->refs, 1, __ATOMIC_RELAXED);
+    }
+    old = varlist->base;
+    varlist->base = base;
+    TMPL_free_varlist(old);
+    return varlist;
+}
+
+/*
+ * TMPL_free_varlist() recursively frees memory used by a TMPL_varlist.
+ * A base that other variable lists are based on just loses a
+ * reference, and the last one to free it frees it.
+ */
+
+void
+TMPL_free_varlist(TMPL_varlist *varlist) {
+    TMPL_loop *loop, *loopnext;
+    TMPL_var  *var,  *varnext;
+
+    if (varlist == 0 ||
+        __atomic_fetch_sub(&varlist->refs, 1, __ATOMIC_ACQ_REL) > 0)
+    {
+        return;
+    }
+    TMPL_free_varlist(varlist->base);
+    for (loop = varlist->loop; loop != 0; loop = loopnext) {
+        loopnext = loop->next;
+        myfree((void *) loop->name);
+        freeloop(loop);
+    }
+    for (var = varlist->var; var != 0; var = varnext) {
+        varnext = var->next;
+        myfree(var);
+    }
+    myfree(varlist);
+}
+
+/*
+ * TMPL_add_fmt() adds a name and function pointer to format function
+ * list "fmtlist" and returns the result.  If "fmtlist" is null, then
+ * we create it, otherwise we return "fmtlist".  Parameter "name" is
+ * the name used in the in the fmt="fmtname" attribute of a TMPL_Tag_Var
+ * tag.  Parameter "fmtfunc" is a pointer to a user supplied function
+ * with a prototype like this:
+ *
+ *   void funcname(const char *value, FILE *out);
+ *
+ * The function should output "value" to "out" with appropriate
+ * formatting or encoding.  If we run out of memory, then we return
+ * null.
+ */
+
+TMPL_fmtlist *
+TMPL_add_fmt(TMPL_fmtlist *fmtlist, const char *name,
+    TMPL_fmtfunc fmtfunc)
+{
+    TMPL_fmtlist *newfmt;
+    if (name == 0 || fmtfunc == 0) {
+        return fmtlist;
+    }
+    newfmt = (TMPL_fmtlist *) mymalloc(&global_heap,
+        sizeof(*newfmt) + strlen(name));
+    if (newfmt == 0) {
+        return 0;
+    }
+    strcpy(newfmt->name, name);
+    newfmt->fmtfunc = fmtfunc;
+    if (fmtlist == 0) {
+        newfmt->next = 0;
+        return newfmt;
+    }
+
+    /* if fmtlist is not null, then we return its original value */
+
+    newfmt->next = fmtlist->next;
+    fmtlist->next = newfmt;
+    return fmtlist;
+}
+
+/* TMPL_free_fmtlist frees memory used by a format function list */
+
+void
+TMPL_free_fmtlist(TMPL_fmtlist *fmtlist) {
+    if (fmtlist != 0) {
+        TMPL_free_fmtlist(fmtlist->next);
+        myfree(fmtlist);
+    }
+}
+
+/*
+ * compile() reads and parses a template and returns the result or
+ * returns null if the template cannot be read or has syntax errors.
+ * If "copy" is non-zero, then we make a copy of "tmplstr".  On
+ * failure we set "*err" to TMPL_ERROR or TMPL_ENOMEM.
+ */
+
+static template *
+compile(TMPL_context *ctx, const char *filename, const char *tmplstr,
+    int copy, const TMPL_fmtlist *fmtlist, FILE *errout, int *err)
+{
+    template *t;
+    unsigned long long start;
+    int stats = ctx != 0 && ctx->stats_enabled != 0;
+
+    start = stats ? nanotime() : 0;
+    t = newtemplate(ctx != 0 ? &ctx->heap : &global_heap, filename,
+        tmplstr, copy, fmtlist, errout, err);
+    if (t == 0) {
+        return 0;
+    }
+    t->minify = ctx != 0 && ctx->minify != 0;
+    t->roottag = parselist(t, 0);
+    if (stats) {
+        ctx->stats.parse_ns += nanotime() - start;
+    }
+    if (t->error != 0) {
+        *err = t->nomem != 0 ? TMPL_ENOMEM : TMPL_ERROR;
+        freetemplate(t);
+        return 0;
+    }
+    return t;
+}
+
+/*
+ * TMPL_write() outputs a template to open file pointer "out" using
+ * variable list "varlist".  If "tmplstr" is null, then we read the
+ * template from "filename", otherwise "tmplstr" is the template.
+ * Parameter "fmtlist" is a format function list that contains
+ * functions that TMPL_Tag_Var tags can specify to output variables.
+ * We return 0 on success otherwise TMPL_ERROR, or TMPL_ENOMEM if we
+ * run out of memory.  We write errors to open file pointer "errout".
+ */
+
+int
+TMPL_write(const char *filename, const char *tmplstr,
+    const TMPL_fmtlist *fmtlist, const TMPL_varlist *varlist,
+    FILE *out, FILE *errout)
+{
+    int ret;
+    template *t;
+
+    t = compile(0, filename, tmplstr, 0, fmtlist, errout, &ret);
+    if (t == 0) {
+        return ret;
+    }
+    ret = TMPL_render(0, t, varlist, out, errout);
+    freetemplate(t);
+    return ret;
+}
+
+/*
+ * TMPL_compile() reads and parses a template once so that it can be
+ * output many times with TMPL_render().  The parameters are the same
+ * as for TMPL_write().  We copy "filename" and "tmplstr", but
+ * "fmtlist" must remain valid until the template is freed, because
+ * included files are parsed when they are first output.  Parameter
+ * "ctx" may be null, otherwise we allocate memory with its allocator.
+ * We return null if the template cannot be read or has syntax errors
+ * or if we run out of memory.
+ */
+
+TMPL_template *
+TMPL_compile(TMPL_context *ctx, const char *filename, const char *tmplstr,
+    const TMPL_fmtlist *fmtlist, FILE *errout)
+{
+    int err;
+
+    return compile(ctx, filename, tmplstr, 1, fmtlist, errout, &err);
+}
+
+/*
+ * TMPL_render() outputs compiled template "tmpl" to open file pointer
+ * "out" using variable list "varlist" and writes errors to "errout".
+ * Parameter "ctx" may be null.  Since a render may parse included
+ * files and save the result in "tmpl", a compiled template must not
+ * be rendered by more than one thread at a time.  We return 0 on
+ * success otherwise TMPL_ERROR or TMPL_ENOMEM.
+ */
+
+int
+TMPL_render(TMPL_context *ctx, TMPL_template *tmpl,
+    const TMPL_varlist *varlist, FILE *out, FILE *errout)
+{
+    TMPL_context local;
+    unsigned long long start;
+
+    if (tmpl == 0 || out == 0) {
+        return TMPL_ERROR;
+    }
+    if (ctx == 0) {
+        memset(&local, 0, sizeof(local));
+        local.heap.alloc = global_heap.alloc;
+        ctx = &local;
+    }
+    start = beginrender(ctx, SINK_FILE, out, errout);
+    walk(ctx, tmpl, tmpl->roottag, varlist);
+    endrender(ctx, start);
+
+    /* free the buffers of a context of our own */
+
+    if (ctx == &local) {
+        myfree(local.scratch.data);
+        myfree(local.memos.data);
+        myfree(local.memovals.data);
+        myfree(local.slots.data);
+    }
+    return ctx->error;
+}
+
+/*
+ * TMPL_render_fd() is like TMPL_render() except that it writes to file
+ * descriptor "fd" with writev().  Instead of copying text from the
+ * template and variable values to a buffer, we point at them and
+ * write them when we have collected enough.  Parameter "ctx" may not
+ * be null.  We return 0 on success otherwise TMPL_ERROR (including
+ * write errors) or TMPL_ENOMEM.
+ */
+
+int
+TMPL_render_fd(TMPL_context *ctx, TMPL_template *tmpl,
+    const TMPL_varlist *varlist, int fd, FILE *errout)
+{
+    unsigned long long start;
+
+    if (tmpl == 0 || fd < 0) {
+        return TMPL_ERROR;
+    }
+    if (ctx->gather == 0) {
+        ctx->gather = (gather *) mymalloc(&ctx->heap, sizeof(*ctx->gather));
+        if (ctx->gather == 0) {
+            return TMPL_ENOMEM;
+        }
+    }
+    start = beginrender(ctx, SINK_GATHER, 0, errout);
+    if (ctx->fmtout == 0) {
+        return TMPL_ENOMEM;
+    }
+    ctx->gather->fd = fd;
+    walk(ctx, tmpl, tmpl->roottag, varlist);
+    flushgather(ctx);
+    endrender(ctx, start);
+    return ctx->error;
+}
+
+/*
+ * TMPL_render_gzip() is like TMPL_render() except that it writes the
+ * output in gzip format, deflating it as we go at compression "level"
+ * (0 to 9, or Z_DEFAULT_COMPRESSION which is -1).  Long text sequences
+ * are deflated once and copied (see putdeflated()).  Parameter "ctx"
+ * may not be null.  We return 0 on success otherwise TMPL_ERROR
+ * (including write errors, or if the library was compiled with
+ * TMPL_NO_ZLIB) or TMPL_ENOMEM.
+ */
+
+#ifdef TMPL_NO_ZLIB
+
+int
+TMPL_render_gzip(TMPL_context *ctx, TMPL_template *tmpl,
+    const TMPL_varlist *varlist, int level, FILE *out, FILE *errout)
+{
+    if (errout != 0) {
+        fputs("C Template library: compiled without gzip output\n",
+            errout);
+    }
+    return TMPL_ERROR;
+}
+
+#else
+
+int
+TMPL_render_gzip(TMPL_context *ctx, TMPL_template *tmpl,
+    const TMPL_varlist *varlist, int level, FILE *out, FILE *errout)
+{
+    static const unsigned char header[10] = {
+        0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3
+    };
+    unsigned char trailer[8];
+    unsigned long long start;
+    gzsink *gz;
+    int i;
+
+    if (tmpl == 0 || out == 0 || level < -1 || level > 9) {
+        return TMPL_ERROR;
+    }
+    if ((gz = ctx->gz) == 0) {
+        if ((gz = (gzsink *) mymalloc(&ctx->heap, sizeof(*gz))) == 0) {
+            return TMPL_ENOMEM;
+        }
+        memset(&gz->zs, 0, sizeof(gz->zs));
+        gz->zs.zalloc = zalloc;
+        gz->zs.zfree = zfree;
+        gz->zs.opaque = &ctx->heap;
+        gz->ready = 0;
+        ctx->gz = gz;
+    }
+    if (gz->ready != 0 && gz->level != level) {
+        deflateEnd(&gz->zs);
+        gz->ready = 0;
+    }
+    if (gz->ready != 0) {
+        deflateReset(&gz->zs);
+    }
+    else if (deflateInit2(&gz->zs, level, Z_DEFLATED, -MAX_WBITS, 8,
+        Z_DEFAULT_STRATEGY) == Z_OK)
+    {
+        gz->ready = 1;
+        gz->level = level;
+    }
+    else {
+        return TMPL_ENOMEM;
+    }
+    gz->crc = crc32(0, 0, 0);
+    gz->size = 0;
+    start = beginrender(ctx, SINK_GZIP, out, errout);
+    if (ctx->fmtout == 0) {
+        return TMPL_ENOMEM;
+    }
+    if (fwrite(header, 1, sizeof(header), out) != sizeof(header)) {
+        ctx->error = TMPL_ERROR;
+    }
+    walk(ctx, tmpl, tmpl->roottag, varlist);
+    gz->zs.avail_in = 0;
+    gzdeflate(ctx, Z_FINISH);
+    for (i = 0; i < 4; i++) {
+        trailer[i] = (unsigned char) (gz->crc >> (8 * i));
+        trailer[i + 4] = (unsigned char) (gz->size >> (8 * i));
+    }
+    if (fwrite(trailer, 1, sizeof(trailer), out) != sizeof(trailer)) {
+        ctx->error = TMPL_ERROR;
+    }
+    endrender(ctx, start);
+    return ctx->error;
+}
+
+#endif
+
+/*
+ * TMPL_render_hash() renders compiled template "tmpl" without writing
+ * the output anywhere and sets "*hash" to the hash of the output (see
+ * TMPL_enable_hash()), so that a caller can tell if the output has
+ * changed without keeping it.  Parameter "ctx" may not be null.  We
+ * return 0 on success otherwise TMPL_ERROR or TMPL_ENOMEM.
+ */
+
+int
+TMPL_render_hash(TMPL_context *ctx, TMPL_template *tmpl,
+    const TMPL_varlist *varlist, unsigned long long *hash, FILE *errout)
+{
+    unsigned long long start;
+    int hashing = ctx->hashing;
+
+    if (tmpl == 0 || hash == 0) {
+        return TMPL_ERROR;
+    }
+    ctx->hashing = 1;
+    start = beginrender(ctx, SINK_NONE, 0, errout);
+    if (ctx->fmtout != 0) {
+        walk(ctx, tmpl, tmpl->roottag, varlist);
+        endrender(ctx, start);
+    }
+    else {
+        ctx->error = TMPL_ENOMEM;
+    }
+    ctx->hashing = hashing;
+    *hash = ctx->hash;
+    return ctx->error;
+}
+
+/*
+ * TMPL_new_map() returns a new output map for TMPL_render_map(), or
+ * null if we run out of memory, and TMPL_free_map() frees it.
+ */
+
+TMPL_map *
+TMPL_new_map(void) {
+    TMPL_map *map;
+
+    if ((map = (TMPL_map *) mymalloc(&global_heap, sizeof(*map))) != 0) {
+        memset(map, 0, sizeof(*map));
+    }
+    return map;
+}
+
+void
+TMPL_free_map(TMPL_map *map) {
+    int i;
+
+    if (map != 0) {
+        for (i = 0; i < map->maxentries; i++) {
+            myfree(map->entries[i].deps.deps);
+        }
+        myfree(map->entries);
+        myfree(map);
+    }
+}
+
+/*
+ * TMPL_render_map() is like TMPL_render() except that it also records
+ * in "map" where the output of each tag at the top level of "tmpl"
+ * goes, so that TMPL_rerender() can output the template again with
+ * only some of the variables changed.  Parameter "ctx" may not be
+ * null.  The map refers to "tmpl", so it must not outlive it.  We
+ * return 0 on success otherwise TMPL_ERROR or TMPL_ENOMEM.
+ */
+
+int
+TMPL_render_map(TMPL_context *ctx, TMPL_template *tmpl,
+    const TMPL_varlist *varlist, TMPL_map *map, FILE *out, FILE *errout)
+{
+    unsigned long long start;
+
+    if (tmpl == 0 || map == 0 || out == 0) {
+        return TMPL_ERROR;
+    }
+    ctx->mapping = 1;
+    start = beginrender(ctx, SINK_FILE, out, errout);
+    map->tmpl = tmpl;
+    walkmap(ctx, map, varlist, 0, 0, 0);
+    endrender(ctx, start);
+    ctx->mapping = 0;
+    return ctx->error;
+}
+
+/*
+ * TMPL_rerender() outputs the template of "map" again using variable
+ * list "varlist", in which only the variables and loop variables
+ * named in the "nchanged" names in "changed" differ from the last
+ * render.  "prev" and "prevlen" are the output of the last render,
+ * which "map" describes.  We copy from "prev" the output of each tag
+ * at the top level of the template that depends on none of the
+ * changed names, output the other tags and update "map" to describe
+ * the new output.  If the last render stopped early (because of an
+ * error or a BREAK or CONTINUE tag outside of a loop), then we output
+ * the whole template.  We return 0 on success otherwise TMPL_ERROR or
+ * TMPL_ENOMEM.
+ */
+
+int
+TMPL_rerender(TMPL_context *ctx, TMPL_map *map, const TMPL_varlist *varlist,
+    const char *prev, size_t prevlen, const char *const *changed,
+    int nchanged, FILE *out, FILE *errout)
+{
+    unsigned long long start;
+
+    if (map == 0 || map->tmpl == 0 || out == 0 ||
+        (map->complete != 0 && (prev == 0 || prevlen != map->len)))
+    {
+        return TMPL_ERROR;
+    }
+    ctx->mapping = 1;
+    start = beginrender(ctx, SINK_FILE, out, errout);
+    walkmap(ctx, map, varlist, map->complete != 0 ? prev : 0, changed,
+        nchanged);
+    endrender(ctx, start);
+    ctx->mapping = 0;
+    return ctx->error;
+}
+
+/*
+ * TMPL_render_batch() outputs compiled template "tmpl" once for each
+ * of the "n" variable lists in "varlists".  Each output goes to a
+ * buffer in "ctx" that we reuse, and then we call
  *
- * \\ at the end of a line is output as a single \ followed
- * by the line terminator.
+ *   outfunc(arg, i, buf, len, status)
  *
- * Any other \ is output unchanged.
+ * where "i" is the index of the variable list, "buf" and "len" are
+ * the output and "status" is 0 on success otherwise TMPL_ERROR,
+ * TMPL_ENOMEM or TMPL_ELIMIT.  If "outfunc" returns non-zero, then we stop and
+ * return that value.  Otherwise we return 0 if every render succeeds,
+ * or else the status of the first one that failed.
  */
 
-static void
-write_text(const char *p, int len, FILE *out) {
-    int i, k;
+int
+TMPL_render_batch(TMPL_context *ctx, TMPL_template *tmpl,
+    const TMPL_varlist *const *varlists, int n, TMPL_outfunc outfunc,
+    void *arg, FILE *errout)
+{
+    unsigned long long start;
+    int i, ret, status = 0;
 
-    for (i = 0; i < len; i++) {
+    if (tmpl == 0 || outfunc == 0) {
+        return TMPL_ERROR;
+    }
+    for (i = 0; i < n; i++) {
+        start = beginrender(ctx, SINK_BUFFER, 0, errout);
+        if (ctx->fmtout == 0) {
+            return TMPL_ENOMEM;
+        }
+        walk(ctx, tmpl, tmpl->roottag, varlists[i]);
+        endrender(ctx, start);
+        if (status == 0) {
+            status = ctx->error;
+        }
+        ret = outfunc(arg, i, ctx->outbuf.len > 0 ? ctx->outbuf.data : "",
+            ctx->outbuf.len, ctx->error);
+        if (ret != 0) {
+            return ret;
+        }
+    }
+    return status;
+}
 
-        /* check for \ or \\ before \n or \r\n */
+/*
+ * TMPL_render_start() begins a resumable render of compiled template
+ * "tmpl" using variable list "varlist".  Instead of writing to a file
+ * pointer, the caller gets the output a chunk at a time by calling
+ * TMPL_render_next(), so it can send each chunk when the destination
+ * is ready for it.  Starting a render abandons any render in progress
+ * with "ctx".  We return 0 on success otherwise TMPL_ERROR or
+ * TMPL_ENOMEM.
+ */
 
-        if (p[i] == '\\') {
-            k = i + 1;
-            if (k < len && p[k] == '\\') {
-                k++;
-            }
-            if (k < len && p[k] == '\r') {
-                k++;
-            }
-            if (k < len && p[k] == '\n') {
-                if (p[i + 1] == '\\') {
-                    i++;      /* skip first \ */
-                }
-                else {
-                    i = k;    /* skip \ and line terminator */
-                    continue;
-                }
-            }
+int
+TMPL_render_start(TMPL_context *ctx, TMPL_template *tmpl,
+    const TMPL_varlist *varlist, FILE *errout)
+{
+    resumable *r;
+
+    if (tmpl == 0) {
+        return TMPL_ERROR;
+    }
+    if ((r = ctx->resume) == 0) {
+        if ((r = (resumable *) mymalloc(&ctx->heap, sizeof(*r))) == 0) {
+            return TMPL_ENOMEM;
+        }
+        if ((r->stack = (char *) mymalloc(&ctx->heap, RESUME_STACK)) == 0) {
+            myfree(r);
+            return TMPL_ENOMEM;
+        }
+        ctx->resume = r;
+    }
+    r->active = 0;
+    r->start = beginrender(ctx, SINK_CHUNK, 0, errout);
+    if (ctx->fmtout == 0) {
+        return TMPL_ENOMEM;
+    }
+    r->tmpl = tmpl;
+    r->varlist = varlist;
+    r->done = 0;
+
+    /* makecontext() passes only int arguments, so we split "ctx" */
+
+    getcontext(&r->walker);
+    r->walker.uc_stack.ss_sp = r->stack;
+    r->walker.uc_stack.ss_size = RESUME_STACK;
+    r->walker.uc_link = &r->caller;
+    makecontext(&r->walker, (void (*)(void)) coroutine, 2,
+        (unsigned int) (unsigned long) ctx,
+        (unsigned int) ((unsigned long) ctx >> 16 >> 16));
+    r->active = 1;
+    return 0;
+}
+
+/*
+ * TMPL_render_next() continues the resumable render started by
+ * TMPL_render_start() and copies the next "cap" bytes (or fewer) of
+ * output to "buf".  We return the number of bytes copied, or 0 when
+ * the render is complete, otherwise TMPL_ERROR or TMPL_ENOMEM.  Only
+ * the last chunk may be shorter than "cap" bytes.
+ */
+
+long
+TMPL_render_next(TMPL_context *ctx, char *buf, size_t cap) {
+    resumable *r = ctx->resume;
+
+    if (r == 0 || r->active == 0 || buf == 0 || cap == 0) {
+        return TMPL_ERROR;
+    }
+    r->buf = buf;
+    r->cap = cap;
+    r->len = 0;
+    if (r->done == 0) {
+        swapcontext(&r->caller, &r->walker);
+    }
+    if (r->len > 0) {
+        return (long) r->len;
+    }
+    r->active = 0;
+    return ctx->error;
+}
+
+/* TMPL_free_template() frees a template compiled by TMPL_compile() */
+
+void
+TMPL_free_template(TMPL_template *tmpl) {
+    if (tmpl != 0) {
+        freetemplate(tmpl);
+    }
+}
+
+/*
+ * TMPL_get_refs() returns the names of the variables, loop variables,
+ * format functions and included files that compiled template "tmpl"
+ * refers to, so that a caller can skip computing variables that the
+ * template never uses.  We parse any included files that are not
+ * parsed yet, so the same thread rules apply as for TMPL_render().
+ * The names point into "tmpl", so they are valid only until "tmpl"
+ * is freed.  We return null if an included file cannot be parsed or
+ * if we run out of memory.
+ */
+
+TMPL_refs *
+TMPL_get_refs(TMPL_template *tmpl) {
+    TMPL_refs *refs;
+
+    refs = (TMPL_refs *) mymalloc(&global_heap, sizeof(*refs));
+    if (refs == 0) {
+        return 0;
+    }
+    memset(refs, 0, sizeof(*refs));
+    if (addrefs(refs, tmpl, tmpl->roottag, tmpl->errout) != 0) {
+        TMPL_free_refs(refs);
+        return 0;
+    }
+    return refs;
+}
+
+/* TMPL_free_refs() frees names returned by TMPL_get_refs() */
+
+void
+TMPL_free_refs(TMPL_refs *refs) {
+    if (refs != 0) {
+        freerefs(refs->vars);
+        freerefs(refs->loops);
+        freerefs(refs->fmts);
+        freerefs(refs->includes);
+        myfree(refs);
+    }
+}
+
+/*
+ * TMPL_emit_c() writes C code for compiled template "tmpl" (and the
+ * files that it includes) to "out".  The code defines render function
+ * "funcname", which outputs the template like TMPL_render() does,
+ *
+ *     int funcname(TMPL_context *ctx, const TMPL_fmtlist *fmtlist,
+ *         const TMPL_varlist *varlist, FILE *out, FILE *errout);
+ *
+ * and static functions and arrays whose names begin with "funcname".
+ * The code needs <stdio.h> and <ctemplate.h>.  We read and parse the
+ * included files now, so an included file with errors is an error
+ * even if the template would not output it.  We return 0 on success
+ * otherwise TMPL_ERROR or TMPL_ENOMEM.
+ */
+
+int
+TMPL_emit_c(TMPL_template *tmpl, const char *funcname, FILE *out,
+    FILE *errout)
+{
+    codegen cg;
+    int n;
+
+    if (tmpl == 0 || funcname == 0 || out == 0) {
+        return TMPL_ERROR;
+    }
+    memset(&cg, 0, sizeof(cg));
+    cg.out = out;
+    cg.prefix = funcname;
+    cg.errout = errout;
+    if ((cg.ctx = TMPL_new_context()) == 0) {
+        return TMPL_ENOMEM;
+    }
+    cg.ctx->sink = SINK_BUFFER;
+    n = genfunc(&cg, tmpl, tmpl->roottag);
+    if (cg.error == 0) {
+        fprintf(out, "int\n%s(TMPL_context *ctx, const TMPL_fmtlist *fmtlist,\n"
+            "    const TMPL_varlist *varlist, FILE *out, FILE *errout)\n{\n"
+            "    if (TMPL_gen_begin(ctx, fmtlist, out, errout) == 0) {\n"
+            "        %s_%d(ctx, varlist);\n    }\n"
+            "    return TMPL_gen_end(ctx);\n}\n", funcname, funcname, n);
+    }
+    TMPL_free_context(cg.ctx);
+    if (cg.error == 0 && ferror(out) != 0) {
+        cg.error = TMPL_ERROR;
+    }
+    return cg.error;
+}
+
+/*
+ * The code that TMPL_emit_c() generates calls the TMPL_gen functions
+ * to do what the walker does for each kind of tag.
+ *
+ * TMPL_gen_begin() starts a render to "out" with render context "ctx",
+ * which may not be null, and format functions "fmtlist".  We return 0
+ * on success.  TMPL_gen_end() finishes the render and returns 0 on
+ * success otherwise TMPL_ERROR or TMPL_ENOMEM.
+ */
+
+int
+TMPL_gen_begin(TMPL_context *ctx, const TMPL_fmtlist *fmtlist, FILE *out,
+    FILE *errout)
+{
+    if (ctx == 0) {
+        return TMPL_ERROR;
+    }
+    ctx->genstart = beginrender(ctx, SINK_FILE, out, errout);
+    ctx->genfmts = fmtlist;
+    if (out == 0) {
+        ctx->error = TMPL_ERROR;
+    }
+    return ctx->error;
+}
+
+int
+TMPL_gen_end(TMPL_context *ctx) {
+    if (ctx == 0) {
+        return TMPL_ERROR;
+    }
+    endrender(ctx, ctx->genstart);
+    return ctx->error;
+}
+
+/* TMPL_gen_text() outputs text without \ escapes */
+
+void
+TMPL_gen_text(TMPL_context *ctx, const char *text, size_t len) {
+    emit(ctx, text, len, 1);
+}
+
+/*
+ * TMPL_gen_var() outputs a TMPL_Tag_Var tag, whose format function
+ * "fmtname" (if not null) must be in the format function list of the
+ * render.
+ */
+
+void
+TMPL_gen_var(TMPL_context *ctx, const TMPL_varlist *varlist,
+    const char *name, const char *dfltval, const char *fmtname)
+{
+    TMPL_fmtfunc fmtfunc = 0;
+
+    if (fmtname != 0 && (fmtfunc = findfmt(ctx->genfmts, fmtname)) == 0) {
+        if (ctx->errout != 0) {
+            fprintf(ctx->errout, "C Template library: no format "
+                "function \"%s\"\n", fmtname);
         }
-        fputc(p[i], out);
+        ctx->error = TMPL_ERROR;
+        return;
+    }
+    putvar(ctx, name, dfltval, fmtfunc, -1, varlist);
+}
+
+/*
+ * TMPL_gen_if() returns true if a TMPL_Tag_If (or TMPL_Tag_ElseIf) tag
+ * with these attributes is true.
+ */
+
+int
+TMPL_gen_if(TMPL_context *ctx, const TMPL_varlist *varlist,
+    const char *name, const char *operator, const char *testval)
+{
+    varvalue test;
+
+    parsenum(testval, &test);
+    return testvar(ctx, name, operator, testval, &test, -1, varlist);
+}
+
+/*
+ * TMPL_gen_if_int() and TMPL_gen_if_double() are like TMPL_gen_if()
+ * for a test value that is a number, which the generated code passes
+ * already parsed in "test".
+ */
+
+int
+TMPL_gen_if_int(TMPL_context *ctx, const TMPL_varlist *varlist,
+    const char *name, const char *operator, const char *testval,
+    long long test)
+{
+    varvalue v;
+
+    memset(&v, 0, sizeof(v));
+    v.type = VAL_INT;
+    v.prec = -1;
+    v.str = testval;
+    v.i = test;
+    return testvar(ctx, name, operator, testval, &v, -1, varlist);
+}
+
+int
+TMPL_gen_if_double(TMPL_context *ctx, const TMPL_varlist *varlist,
+    const char *name, const char *operator, const char *testval,
+    double test)
+{
+    varvalue v;
+
+    memset(&v, 0, sizeof(v));
+    v.type = VAL_DOUBLE;
+    v.prec = -1;
+    v.str = testval;
+    v.d = test;
+    return testvar(ctx, name, operator, testval, &v, -1, varlist);
+}
+
+/*
+ * TMPL_gen_loop() outputs a loop statement for loop variable "name",
+ * calling "body" for each row.  Parameters "offset", "limit" and
+ * "step" are the values of the loop tag's attributes (or null).  We
+ * return nonzero if the caller must stop.
+ */
+
+int
+TMPL_gen_loop(TMPL_context *ctx, const TMPL_varlist *varlist,
+    const char *name, const char *offset, const char *limit,
+    const char *step, TMPL_genfunc body)
+{
+    TMPL_loop *loop;
+    window w;
+
+    if ((loop = outerloop(name, varlist, ctx->loop)) != 0) {
+        initattr(&w.offset, offset, 0, 0);
+        initattr(&w.limit, limit, -1, 0);
+        initattr(&w.step, step, 1, LONG_MIN + 1);
+        runloop(ctx, loop, offset != 0 || limit != 0 || step != 0 ? &w : 0,
+            varlist, 0, 0, 0, body);
     }
+    return ctx->break_level != 0 || ctx->cont_level != 0 || ctx->error != 0;
 }
 
 /*
- * newfilename() returns a copy of an include file name with
- * possible modifications.  If the include file name begins
- * with ".../" then we replace "..." with the directory name
- * of the parent template file.  If there is no directory
- * name then we strip ".../".
+ * TMPL_gen_break() and TMPL_gen_continue() start a TMPL_Tag_Break or
+ * TMPL_Tag_Continue for "level" loop statements.  They return nonzero
+ * so that the caller stops.
  */
 
-static const char *
-newfilename(const char *inclfile, const char *parentfile) {
-    char *newfile, *cp;
+int
+TMPL_gen_break(TMPL_context *ctx, int level) {
+    ctx->break_level = level;
+    return 1;
+}
 
-    newfile = mymalloc(strlen(parentfile) + strlen(inclfile));
-    if (strncmp(inclfile, ".../", 4) != 0) {
-        return strcpy(newfile, inclfile);
-    }
-    strcpy(newfile, parentfile);
-    cp = strrchr(newfile, '/');
-    strcpy(cp == 0 ? newfile : cp + 1, inclfile + 4);
-    return newfile;
+int
+TMPL_gen_continue(TMPL_context *ctx, int level) {
+    ctx->cont_level = level;
+    return 1;
 }
 
 /*
- * walk() walks the template parse tree and outputs the result.  We
- * process the tree nodes according to the data in "varlist".
+ * TMPL_gen_raw() outputs file "filename" as is for a TMPL_Tag_Include
+ * tag with a mode="raw" attribute.  We return nonzero on failure.
  */
 
-static void
-walk(template *t, tagnode *tag, const TMPL_varlist *varlist) {
-    const char *value;
-    TMPL_loop *loop;
-    TMPL_varlist *vl;
-    template *t2;
-    const char *newfile;
-
-    /*
-     * if t->break_level is non zero then we are unwinding the
-     * recursion after encountering a TMPL_Tag_Break tag.  The same
-     * is true for t->cont_level and TMPL_Tag_Continue.
-     */
-
-    if (tag == 0 || t->break_level > 0 || t->cont_level > 0 ||
-        t->error != 0)
-    {
-        return;
-    }
-    switch(tag->kind) {
+int
+TMPL_gen_raw(TMPL_context *ctx, const char *filename) {
+    walkraw(ctx, filename);
+    return ctx->error;
+}
 
-    case TMPL_Tag_Text:
-        write_text(tag->tag.text.start, tag->tag.text.len, t->out);
-        break;
+/*
+ * TMPL_new_context() creates a render context, which a thread can
+ * pass to TMPL_compile() and TMPL_render() to collect statistics.
+ * The context starts out with the global allocator.  We return null
+ * if we run out of memory.
+ */
 
-    case TMPL_Tag_Var:
-        if ((value = valueof(tag->tag.var.varname, varlist)) == 0 &&
-            (value = tag->tag.var.dfltval) == 0)
-        {
-            break;
-        }
+TMPL_context *
+TMPL_new_context(void) {
+    TMPL_context *ctx;
 
-        /* Use the tag's format function or else just use fputs() */
+    ctx = (TMPL_context *) mymalloc(&global_heap, sizeof(*ctx));
+    if (ctx == 0) {
+        return 0;
+    }
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->heap.alloc = global_heap.alloc;
+    return ctx;
+}
 
-        if (tag->tag.var.fmtfunc != 0) {
-            tag->tag.var.fmtfunc(value, t->out);
-        }
-        else {
-            fputs(value, t->out);
-        }
-        break;
+/*
+ * TMPL_free_context() frees a render context.  Templates compiled
+ * with the context must be freed first.
+ */
 
-    case TMPL_Tag_If:
-    case TMPL_Tag_ElseIf:
-        if (is_true(tag, varlist)) {
-            walk(t, tag->tag.ifelse.tbranch, varlist);
+void
+TMPL_free_context(TMPL_context *ctx) {
+    if (ctx != 0) {
+        if (ctx->cookie != 0) {
+            fclose(ctx->cookie);
         }
-        else {
-            walk(t, tag->tag.ifelse.fbranch, varlist);
+        if (ctx->cache != 0) {
+            shrinkcache(ctx->cache, 0);
+            myfree(ctx->cache);
         }
-        break;
-
-    case TMPL_Tag_Loop:
-        if ((loop = findloop(tag->tag.loop.loopname, varlist)) == 0) {
-            break;
+        myfree(ctx->capture.data);
+        myfree(ctx->pending.data);
+        if (ctx->resume != 0) {
+            myfree(ctx->resume->stack);
+            myfree(ctx->resume);
         }
-
-        for (vl = loop->varlist; vl != 0; vl = vl->next) {
-            walk(t, tag->tag.loop.body, vl);
-
-            /*
-             * if t->break_level is nonzero then we encountered a
-             * TMPL_Tag_Break tag inside this TMPL_Tag_Loop so we need to
-             * break here.
-             */
-
-            if (t->break_level > 0) {
-                t->break_level--;
-                break;
-            }
-
-            /*
-             * if t->cont_level is nonzero then we encountered a
-             * TMPL_Tag_Continue inside this TMPL_Tag_Loop.  Depending
-             * on the level we either break here or continue
-             */
-
-            if (t->cont_level > 0 && --t->cont_level > 0) {
-                break;
-            }
+        myfree(ctx->gather);
+#ifndef TMPL_NO_ZLIB
+        if (ctx->gz != 0 && ctx->gz->ready != 0) {
+            deflateEnd(&ctx->gz->zs);
         }
-        break;
-
-    /*
-     * For a TMPL_Tag_Break or TMPL_Tag_Continue tag we terminate the walk
-     * of this TMPL_Tag_Loop body and set t->break_level or t->cont_level
-     * to unwind the recursion.
-     */
-
-    case TMPL_Tag_Break:
-        t->break_level = tag->tag.breakcont.level;
-        return;
-
-    case TMPL_Tag_Continue:
-        t->cont_level = tag->tag.breakcont.level;
-        return;
+#endif
+        myfree(ctx->gz);
+        myfree(ctx->outbuf.data);
+        myfree(ctx->scratch.data);
+        myfree(ctx->memos.data);
+        myfree(ctx->memovals.data);
+        myfree(ctx->slots.data);
+        myfree(ctx);
+    }
+}
 
-    case TMPL_Tag_Include:
+/*
+ * TMPL_set_cache_limits() turns on the fragment cache of render
+ * context "ctx", which saves the output of LOOP and INCLUDE tags that
+ * have a cache="seconds" attribute.  The cache holds at most
+ * "maxbytes" bytes of output.  Entries expire after "ttl" seconds
+ * unless the tag gives its own time.  A "ttl" of 0 means entries
+ * never expire.  A "maxbytes" of 0 turns the cache off.  We return 0
+ * on success or TMPL_ENOMEM.
+ */
 
-        /* if first visit, open and parse the included file */
+int
+TMPL_set_cache_limits(TMPL_context *ctx, size_t maxbytes, int ttl) {
+    cache *c = ctx->cache;
 
-        if ((t2 = tag->tag.include.tmpl) == 0) {
-            newfile = newfilename(tag->tag.include.filename, t->filename);
-            t2 = newtemplate(newfile, 0, t->fmtlist,
-                t->out, t->errout);
-            if (t2 == 0) {
-                free((void *) newfile);
-                t->error = 1;
-                break;
-            }
-            tag->tag.include.tmpl = t2;
-            t2->include_depth = t->include_depth + 1;
-            t2->roottag = parselist(t2, 0);
+    if (maxbytes == 0) {
+        TMPL_clear_cache(ctx);
+        myfree(c);
+        ctx->cache = 0;
+        return 0;
+    }
+    if (c == 0) {
+        if ((c = (cache *) mymalloc(&ctx->heap, sizeof(*c))) == 0) {
+            return TMPL_ENOMEM;
         }
-
-        /* walk the included file's parse tree */
-
-        walk(t2, t2->roottag, varlist);
-        t->error = t2->error;
-        break;
+        memset(c, 0, sizeof(*c));
+        ctx->cache = c;
     }
-    walk(t, tag->next, varlist);
+    c->maxbytes = maxbytes;
+    c->ttl = ttl > 0 ? ttl : 0;
+    shrinkcache(c, maxbytes);
+    return 0;
 }
 
 /*
- * EXPORTED FUNCTIONS
- *
- * TMPL_add_var() adds one or more simple variables to variable list
- * "varlist" and returns the result.  If "varlist" is null, then we
- * create it.  The parameter list has a variable number of "char *"
- * parameters terminated by a null parameter.  Each pair of parameters
- * is a variable name and value that we store in a TMPL_var struct and
- * link into "varlist".
+ * TMPL_set_render_limits() limits each render with context "ctx" to
+ * "maxbytes" bytes of output, "maxiters" loop iterations (counting
+ * the rows of every loop statement), "maxincludes" included files and
+ * "maxms" milliseconds.  A limit of 0 means no limit, and there are
+ * none by default.  A render that exceeds a limit stops and returns
+ * TMPL_ELIMIT.
  */
 
-TMPL_varlist *
-TMPL_add_var(TMPL_varlist *varlist, ...) {
-    va_list ap;
-    const char *name, *value;
-    TMPL_var *var;
-    int nlen, vlen;
+void
+TMPL_set_render_limits(TMPL_context *ctx, unsigned long long maxbytes,
+    unsigned long maxiters, unsigned long maxincludes, unsigned long maxms)
+{
+    ctx->maxbytes = maxbytes;
+    ctx->maxiters = maxiters;
+    ctx->maxincludes = maxincludes;
+    ctx->maxms = maxms;
+}
 
-    va_start(ap, varlist);
-    while ((name = va_arg(ap, char *)) != 0 &&
-        (value = va_arg(ap, char *)) != 0)
-    {
-        /*
-         * get enough memory to store the TMPL_var struct and
-         * the name string and the value string
-         */
+/* TMPL_clear_cache() discards everything in the fragment cache */
 
-        nlen = strlen(name) + 1;
-        vlen = strlen(value) + 1;
-        var = (TMPL_var *) mymalloc(sizeof(*var) + nlen + vlen);
-        strcpy(var->value, value);
-        var->name = strcpy(var->value + vlen, name);
-        if (varlist == 0) {
-            varlist = (TMPL_varlist *) mymalloc(sizeof(*varlist));
-            memset(varlist, 0, sizeof(*varlist));
-        }
-        var->next = varlist->var;
-        varlist->var = var;
+void
+TMPL_clear_cache(TMPL_context *ctx) {
+    if (ctx->cache != 0) {
+        shrinkcache(ctx->cache, 0);
     }
-    va_end(ap);
-    return varlist;
 }
 
 /*
- * TMPL_add_loop() adds loop variable "loop" to variable list "varlist"
- * and returns the result.  If "varlist" is null, then we create it.
- * We decline to add "loop" if 1) "loop" has already been added to a
- * variable list or 2) adding "loop" would create a cycle because
- * "loop" contains "varlist".
+ * TMPL_set_allocator() replaces the global allocator, which the
+ * library uses for variable lists, format function lists, render
+ * contexts and templates compiled without a context.  Memory that
+ * was allocated before is still resized and freed by the allocator
+ * that allocated it.  If "alloc" is null, then we go back to
+ * malloc(), realloc() and free().
  */
 
-TMPL_varlist *
-TMPL_add_loop(TMPL_varlist *varlist, const char *name, TMPL_loop *loop) {
-    TMPL_loop *lp;
-
-    /* if sanity check fails, just return */
+void
+TMPL_set_allocator(const TMPL_allocator *alloc) {
+    static const TMPL_allocator std = {
+        std_malloc, std_realloc, std_free, 0
+    };
 
-    if (name == 0 || loop == 0 || loop->parent != 0) {
-        return varlist;
-    }
-    if (varlist == 0) {
-        varlist = (TMPL_varlist *) mymalloc(sizeof(*varlist));
-        memset(varlist, 0, sizeof(*varlist));
-    }
+    global_heap.alloc = alloc != 0 ? *alloc : std;
+}
 
-    /* if sanity check for cycle fails, just return */
+/*
+ * TMPL_set_context_allocator() replaces the allocator for templates
+ * compiled with render context "ctx" and for variable lists created
+ * with TMPL_new_varlist(ctx).  Memory that was allocated before is
+ * still resized and freed by the allocator that allocated it.  If
+ * "alloc" is null, then we go back to the global allocator.
+ */
 
-    for (lp = varlist->parent; lp != 0;
-        lp = lp->parent == 0 ? 0 : lp->parent->parent)
-    {
-        if (lp == loop) {
-            return varlist;
-        }
-    }
-    loop->name = strdup(name);
-    loop->parent = varlist;
-    loop->next = varlist->loop;
-    varlist->loop = loop;
-    return varlist;
+void
+TMPL_set_context_allocator(TMPL_context *ctx, const TMPL_allocator *alloc) {
+    ctx->heap.alloc = alloc != 0 ? *alloc : global_heap.alloc;
 }
 
 /*
- * TMPL_add_varlist() adds variable list "varlist" to loop variable
- * "loop" and returns the result.  If "loop" is null, then we create it.
- * We decline to add "varlist" if 1) "varlist" has already been added
- * to a loop variable or 2) adding "varlist" would create a cycle
- * because "varlist" contains "loop".
+ * TMPL_get_alloc_stats() returns the allocation counters for the
+ * allocator of render context "ctx", or the counters for the global
+ * allocator if "ctx" is null.
  */
 
-TMPL_loop *
-TMPL_add_varlist(TMPL_loop *loop, TMPL_varlist *varlist) {
-    TMPL_varlist *vl;
+const TMPL_alloc_stats *
+TMPL_get_alloc_stats(const TMPL_context *ctx) {
+    return ctx != 0 ? &ctx->heap.stats : &global_heap.stats;
+}
 
-    /* if sanity check fails, just return */
+/*
+ * TMPL_reset_alloc_stats() sets the allocation counters of "ctx" (or
+ * the global counters if "ctx" is null) to zero, except the count of
+ * bytes currently allocated, and sets the peak to that count.
+ */
 
-    if (varlist == 0 || varlist->parent != 0) {
-        return loop;
-    }
-    if (loop == 0) {
-        loop = (TMPL_loop *) mymalloc(sizeof(*loop));
-        memset(loop, 0, sizeof(*loop));
-    }
+void
+TMPL_reset_alloc_stats(TMPL_context *ctx) {
+    TMPL_alloc_stats *stats;
 
-    /* if sanity check for cycle fails, just return */
+    stats = ctx != 0 ? &ctx->heap.stats : &global_heap.stats;
+    stats->allocs = stats->frees = stats->failures = 0;
+    stats->peak = stats->bytes;
+}
 
-    for (vl = loop->parent; vl != 0;
-        vl = vl->parent == 0 ? 0 : vl->parent->parent)
-    {
-        if (vl == varlist) {
-            return loop;
-        }
-    }
-    varlist->parent = loop;
-    varlist->next = 0;
-    if (loop->varlist == 0) {
-        loop->varlist = loop->tail = varlist;
-    }
-    else {
-        loop->tail->next = varlist;
-        loop->tail = varlist;
-    }
-    return loop;
+/*
+ * TMPL_enable_minify() turns minifying on or off for the templates
+ * compiled with "ctx" from now on (see minify()).  Minifying is off
+ * by default.  It costs nothing when a template is output.
+ */
+
+void
+TMPL_enable_minify(TMPL_context *ctx, int enable) {
+    ctx->minify = enable != 0;
 }
 
-/* TMPL_free_varlist() recursively frees memory used by a TMPL_varlist */
+/*
+ * TMPL_enable_hash() turns hashing of the output of renders with
+ * "ctx" on or off.  Hashing is off by default.  We hash the output as
+ * it goes with the 64 bit FNV-1a hash, which is fast but not secure,
+ * and TMPL_get_hash() returns the hash of the last render.
+ */
 
 void
-TMPL_free_varlist(TMPL_varlist *varlist) {
-    TMPL_loop *loop, *loopnext;
-    TMPL_var  *var,  *varnext;
+TMPL_enable_hash(TMPL_context *ctx, int enable) {
+    ctx->hashing = enable != 0;
+}
 
-    if (varlist == 0) {
-        return;
-    }
-    for (loop = varlist->loop; loop != 0; loop = loopnext) {
-        loopnext = loop->next;
-        TMPL_free_varlist(loop->varlist);
-        free((void *) loop->name);
-        free(loop);
-    }
-    for (var = varlist->var; var != 0; var = varnext) {
-        varnext = var->next;
-        free(var);
-    }
-    TMPL_free_varlist(varlist->next);
-    free(varlist);
+unsigned long long
+TMPL_get_hash(const TMPL_context *ctx) {
+    return ctx->hash;
 }
 
 /*
- * TMPL_add_fmt() adds a name and function pointer to format function
- * list "fmtlist" and returns the result.  If "fmtlist" is null, then
- * we create it, otherwise we return "fmtlist".  Parameter "name" is
- * the name used in the in the fmt="fmtname" attribute of a TMPL_Tag_Var
- * tag.  Parameter "fmtfunc" is a pointer to a user supplied function
- * with a prototype like this:
- *
- *   void funcname(const char *value, FILE *out);
- *
- * The function should output "value" to "out" with appropriate
- * formatting or encoding.
+ * TMPL_enable_stats() turns statistics collection on or off.
+ * Statistics are off by default.
  */
 
-TMPL_fmtlist *
-TMPL_add_fmt(TMPL_fmtlist *fmtlist, const char *name,
-    TMPL_fmtfunc fmtfunc)
-{
-    TMPL_fmtlist *newfmt;
-    if (name == 0 || fmtfunc == 0) {
-        return fmtlist;
-    }
-    newfmt = (TMPL_fmtlist *) mymalloc(sizeof(*newfmt) + strlen(name));
-    strcpy(newfmt->name, name);
-    newfmt->fmtfunc = fmtfunc;
-    if (fmtlist == 0) {
-        newfmt->next = 0;
-        return newfmt;
-    }
+void
+TMPL_enable_stats(TMPL_context *ctx, int enable) {
+    ctx->stats_enabled = enable != 0;
+}
 
-    /* if fmtlist is not null, then we return its original value */
+/* TMPL_get_stats() returns the statistics collected by a context */
 
-    newfmt->next = fmtlist->next;
-    fmtlist->next = newfmt;
-    return fmtlist;
+const TMPL_stats *
+TMPL_get_stats(const TMPL_context *ctx) {
+    return &ctx->stats;
 }
 
-/* TMPL_free_fmtlist frees memory used by a format function list */
+/* TMPL_reset_stats() sets the statistics of a context to zero */
 
 void
-TMPL_free_fmtlist(TMPL_fmtlist *fmtlist) {
-    if (fmtlist != 0) {
-        TMPL_free_fmtlist(fmtlist->next);
-        free(fmtlist);
-    }
+TMPL_reset_stats(TMPL_context *ctx) {
+    memset(&ctx->stats, 0, sizeof(ctx->stats));
 }
 
 /*
- * TMPL_write() outputs a template to open file pointer "out" using
- * variable list "varlist".  If "tmplstr" is null, then we read the
- * template from "filename", otherwise "tmplstr" is the template.
- * Parameter "fmtlist" is a format function list that contains
- * functions that TMPL_Tag_Var tags can specify to output variables.
- * We return 0 on success otherwise -1.  We write errors to open
- * file pointer "errout".
+ * TMPL_merge_stats() adds "stats" to "total".  Each thread can
+ * collect statistics in its own context without locking and
+ * periodically merge them into a total.
  */
 
-int
-TMPL_write(const char *filename, const char *tmplstr,
-    const TMPL_fmtlist *fmtlist, const TMPL_varlist *varlist,
-    FILE *out, FILE *errout)
-{
-    int ret;
-    template *t;
+void
+TMPL_merge_stats(TMPL_stats *total, const TMPL_stats *stats) {
+    int i;
 
-    if ((t = newtemplate(filename, tmplstr, fmtlist, out, errout)) == 0) {
-        return -1;
+    total->renders    += stats->renders;
+    total->errors     += stats->errors;
+    total->limited    += stats->limited;
+    total->parse_ns   += stats->parse_ns;
+    total->render_ns  += stats->render_ns;
+    total->bytes      += stats->bytes;
+    total->lookups    += stats->lookups;
+    total->misses     += stats->misses;
+    total->loops      += stats->loops;
+    total->iterations += stats->iterations;
+    total->cache_hits += stats->cache_hits;
+    total->cache_misses += stats->cache_misses;
+    for (i = 0; i < TMPL_NUM_TAGS; i++) {
+        total->visits[i] += stats->visits[i];
     }
-    t->roottag = parselist(t, 0);
-    walk(t, t->roottag, varlist);
-    ret = t->error == 0 ? 0 : -1;
-    if (tmplstr == 0 && t->tmplstr != 0) {
-        free((void *) t->tmplstr);
+    for (i = 0; i < TMPL_STATS_BUCKETS; i++) {
+        total->time_hist[i]  += stats->time_hist[i];
+        total->bytes_hist[i] += stats->bytes_hist[i];
+    }
+    for (i = 0; i < stats->nincludes; i++) {
+        include_stats(total, stats->includes[i].filename,
+            stats->includes[i].calls, stats->includes[i].ns);
     }
-    freetag(t->roottag);
-    free(t);
-    return ret;
 }
 
 /*
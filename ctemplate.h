@@ -38,10 +38,128 @@ typedef enum {
 } TMPL_Tags;
 
 
+/* number of TMPL_Tags values, for arrays indexed by tag kind */
+
+#define TMPL_NUM_TAGS 0x12
+
 typedef struct TMPL_varlist TMPL_varlist;
 typedef struct TMPL_loop  TMPL_loop;
 typedef struct TMPL_fmtlist TMPL_fmtlist;
+typedef struct TMPL_template TMPL_template;
+typedef struct TMPL_context TMPL_context;
+typedef struct TMPL_map TMPL_map;
 typedef void (*TMPL_fmtfunc) (const char *, FILE *);
+typedef const char *(*TMPL_valfunc) (const char *, void *);
+typedef void (*TMPL_streamfunc) (const char *, void *, FILE *);
+typedef int (*TMPL_outfunc) (void *, int, const char *, size_t, int);
+typedef int (*TMPL_genfunc) (TMPL_context *, const TMPL_varlist *);
+
+/* return values of TMPL_write() and TMPL_render() on failure */
+
+#define TMPL_ERROR  -1      /* bad template or template file */
+#define TMPL_ENOMEM -2      /* out of memory */
+#define TMPL_ELIMIT -3      /* render stopped by a limit */
+
+/*
+ * A memory allocator.  Each function is passed "arg" as its first
+ * parameter.  The malloc and realloc functions return null on failure.
+ */
+
+typedef struct {
+    void *(*mallocfunc)(void *arg, size_t size);
+    void *(*reallocfunc)(void *arg, void *ptr, size_t size);
+    void (*freefunc)(void *arg, void *ptr);
+    void *arg;
+} TMPL_allocator;
+
+/* allocation counters kept for each allocator */
+
+typedef struct {
+    unsigned long long allocs;   /* successful allocations */
+    unsigned long long frees;
+    unsigned long long failures; /* failed allocations */
+    size_t bytes;                /* bytes currently allocated */
+    size_t peak;                 /* most bytes allocated at once */
+} TMPL_alloc_stats;
+
+/*
+ * A column of a bound loop variable (see TMPL_bind_rows() and
+ * TMPL_bind_columns()), which the template sees as a variable.
+ */
+
+typedef enum {
+    TMPL_COL_STRING,            /* const char * (null if no value) */
+    TMPL_COL_CHARS,             /* char array of "size" bytes */
+    TMPL_COL_INT,               /* int */
+    TMPL_COL_INT64,             /* int64_t */
+    TMPL_COL_DOUBLE             /* double */
+} TMPL_coltype;
+
+typedef struct {
+    const char *name;           /* variable name */
+    TMPL_coltype type;
+    size_t offset;              /* offset of the field in a row */
+    size_t size;                /* size of a TMPL_COL_CHARS array */
+} TMPL_column;
+
+/*
+ * The names that a compiled template refers to, as returned by
+ * TMPL_get_refs().  Each list is in template order without duplicates.
+ * A loop variable has the names referred to inside its loop statement.
+ */
+
+typedef struct TMPL_refs TMPL_refs;
+typedef struct TMPL_ref TMPL_ref;
+
+struct TMPL_ref {
+    TMPL_ref *next;             /* next name on the list */
+    const char *name;
+    TMPL_refs *body;            /* names inside a loop, else null */
+};
+
+struct TMPL_refs {
+    TMPL_ref *vars;             /* simple variables */
+    TMPL_ref *loops;            /* loop variables */
+    TMPL_ref *fmts;             /* format function names */
+    TMPL_ref *includes;         /* included file names */
+};
+
+/*
+ * Render statistics.  A TMPL_context collects these when statistics
+ * are enabled with TMPL_enable_stats().  Times are in nanoseconds.
+ * The histograms count renders by the base 2 logarithm of the render
+ * time in microseconds and of the number of bytes output.
+ */
+
+#define TMPL_STATS_BUCKETS  32
+#define TMPL_STATS_INCLUDES 16
+#define TMPL_STATS_NAMELEN  64
+
+typedef struct {
+    char filename[TMPL_STATS_NAMELEN]; /* included file name (truncated) */
+    unsigned long calls;        /* number of times it was output */
+    unsigned long long ns;      /* cumulative time spent outputting it */
+} TMPL_include_stats;
+
+typedef struct {
+    unsigned long renders;      /* number of calls to TMPL_render() */
+    unsigned long errors;       /* number of failed renders */
+    unsigned long limited;      /* failed renders stopped by a limit */
+    unsigned long long parse_ns;
+    unsigned long long render_ns;
+    unsigned long long bytes;   /* bytes output */
+    unsigned long long visits[TMPL_NUM_TAGS]; /* tags visited by kind */
+    unsigned long long lookups; /* variable lookups */
+    unsigned long long misses;  /* variable lookups that failed */
+    unsigned long long loops;   /* loop statements with a loop variable */
+    unsigned long long iterations;
+    unsigned long long cache_hits;   /* cached sections output from cache */
+    unsigned long long cache_misses; /* cached sections output normally */
+    unsigned long time_hist[TMPL_STATS_BUCKETS];
+    unsigned long bytes_hist[TMPL_STATS_BUCKETS];
+    int nincludes;
+    TMPL_include_stats includes[TMPL_STATS_INCLUDES];
+} TMPL_stats;
 
 /*
 
@@ -49,13 +167,67 @@ TMPL_varlist *TMPL_add_var(TMPL_varlist *varlist,
     const char *varname1, const char *value1, ... , 0);
 */
 
+TMPL_varlist *TMPL_new_varlist(TMPL_context *ctx);
+
 TMPL_varlist *TMPL_add_var(TMPL_varlist *varlist, ...);
 
+TMPL_varlist *TMPL_add_int(TMPL_varlist *varlist,
+    const char *name, long long value);
+
+TMPL_varlist *TMPL_add_double(TMPL_varlist *varlist,
+    const char *name, double value, int decimals);
+
+TMPL_varlist *TMPL_add_bool(TMPL_varlist *varlist,
+    const char *name, int value);
+
+TMPL_varlist *TMPL_add_func(TMPL_varlist *varlist,
+    const char *name, TMPL_valfunc func, void *arg);
+
+TMPL_varlist *TMPL_add_stream(TMPL_varlist *varlist,
+    const char *name, TMPL_streamfunc func, void *arg);
+
+TMPL_varlist *TMPL_set_var(TMPL_varlist *varlist,
+    const char *name, const char *value);
+
+TMPL_varlist *TMPL_set_int(TMPL_varlist *varlist,
+    const char *name, long long value);
+
+TMPL_varlist *TMPL_set_double(TMPL_varlist *varlist,
+    const char *name, double value, int decimals);
+
+TMPL_varlist *TMPL_set_bool(TMPL_varlist *varlist,
+    const char *name, int value);
+
+int TMPL_remove_var(TMPL_varlist *varlist, const char *name);
+
 TMPL_varlist *TMPL_add_loop(TMPL_varlist *varlist,
     const char *name, TMPL_loop *loop);
 
 TMPL_loop *TMPL_add_varlist(TMPL_loop *loop, TMPL_varlist *varlist);
 
+TMPL_loop *TMPL_reserve_loop(TMPL_loop *loop, size_t nrows);
+
+size_t TMPL_loop_size(const TMPL_loop *loop);
+
+TMPL_varlist *TMPL_loop_row(const TMPL_loop *loop, size_t i);
+
+void TMPL_reset_loop(TMPL_loop *loop);
+
+TMPL_varlist *TMPL_next_row(TMPL_loop *loop);
+
+TMPL_loop *TMPL_bind_rows(const void *rows, size_t nrows, size_t stride,
+    const TMPL_column *cols, int ncols);
+
+TMPL_loop *TMPL_bind_columns(const void *const *arrays, size_t nrows,
+    const TMPL_column *cols, int ncols);
+
+TMPL_varlist *TMPL_json_varlist(const char *json, size_t len, FILE *errout);
+
+TMPL_varlist *TMPL_json_context_varlist(TMPL_context *ctx, const char *json,
+    size_t len, FILE *errout);
+
+TMPL_varlist *TMPL_set_base(TMPL_varlist *varlist, TMPL_varlist *base);
+
 void TMPL_free_varlist(TMPL_varlist *varlist);
 
 TMPL_fmtlist *TMPL_add_fmt(TMPL_fmtlist *fmtlist,
@@ -67,6 +239,117 @@ int TMPL_write(const char *filename, const char *tmplstr,
     const TMPL_fmtlist *fmtlist, const TMPL_varlist *varlist,
     FILE *out, FILE *errout);
 
+TMPL_context *TMPL_new_context(void);
+
+void TMPL_free_context(TMPL_context *ctx);
+
+TMPL_template *TMPL_compile(TMPL_context *ctx, const char *filename,
+    const char *tmplstr, const TMPL_fmtlist *fmtlist, FILE *errout);
+
+int TMPL_render(TMPL_context *ctx, TMPL_template *tmpl,
+    const TMPL_varlist *varlist, FILE *out, FILE *errout);
+
+int TMPL_render_fd(TMPL_context *ctx, TMPL_template *tmpl,
+    const TMPL_varlist *varlist, int fd, FILE *errout);
+
+int TMPL_render_gzip(TMPL_context *ctx, TMPL_template *tmpl,
+    const TMPL_varlist *varlist, int level, FILE *out, FILE *errout);
+
+int TMPL_render_hash(TMPL_context *ctx, TMPL_template *tmpl,
+    const TMPL_varlist *varlist, unsigned long long *hash, FILE *errout);
+
+TMPL_map *TMPL_new_map(void);
+
+void TMPL_free_map(TMPL_map *map);
+
+int TMPL_render_map(TMPL_context *ctx, TMPL_template *tmpl,
+    const TMPL_varlist *varlist, TMPL_map *map, FILE *out, FILE *errout);
+
+int TMPL_rerender(TMPL_context *ctx, TMPL_map *map, const TMPL_varlist *varlist,
+    const char *prev, size_t prevlen, const char *const *changed,
+    int nchanged, FILE *out, FILE *errout);
+
+int TMPL_render_batch(TMPL_context *ctx, TMPL_template *tmpl,
+    const TMPL_varlist *const *varlists, int n, TMPL_outfunc outfunc,
+    void *arg, FILE *errout);
+
+int TMPL_render_start(TMPL_context *ctx, TMPL_template *tmpl,
+    const TMPL_varlist *varlist, FILE *errout);
+
+long TMPL_render_next(TMPL_context *ctx, char *buf, size_t cap);
+
+void TMPL_free_template(TMPL_template *tmpl);
+
+TMPL_refs *TMPL_get_refs(TMPL_template *tmpl);
+
+void TMPL_free_refs(TMPL_refs *refs);
+
+int TMPL_emit_c(TMPL_template *tmpl, const char *funcname, FILE *out,
+    FILE *errout);
+
+/* functions called by the code that TMPL_emit_c() generates */
+
+int TMPL_gen_begin(TMPL_context *ctx, const TMPL_fmtlist *fmtlist,
+    FILE *out, FILE *errout);
+
+int TMPL_gen_end(TMPL_context *ctx);
+
+void TMPL_gen_text(TMPL_context *ctx, const char *text, size_t len);
+
+void TMPL_gen_var(TMPL_context *ctx, const TMPL_varlist *varlist,
+    const char *name, const char *dfltval, const char *fmtname);
+
+int TMPL_gen_if(TMPL_context *ctx, const TMPL_varlist *varlist,
+    const char *name, const char *operator, const char *testval);
+
+int TMPL_gen_if_int(TMPL_context *ctx, const TMPL_varlist *varlist,
+    const char *name, const char *operator, const char *testval,
+    long long test);
+
+int TMPL_gen_if_double(TMPL_context *ctx, const TMPL_varlist *varlist,
+    const char *name, const char *operator, const char *testval,
+    double test);
+
+int TMPL_gen_loop(TMPL_context *ctx, const TMPL_varlist *varlist,
+    const char *name, const char *offset, const char *limit,
+    const char *step, TMPL_genfunc body);
+
+int TMPL_gen_break(TMPL_context *ctx, int level);
+
+int TMPL_gen_continue(TMPL_context *ctx, int level);
+
+int TMPL_gen_raw(TMPL_context *ctx, const char *filename);
+
+void TMPL_enable_minify(TMPL_context *ctx, int enable);
+
+void TMPL_enable_hash(TMPL_context *ctx, int enable);
+
+unsigned long long TMPL_get_hash(const TMPL_context *ctx);
+
+void TMPL_enable_stats(TMPL_context *ctx, int enable);
+
+const TMPL_stats *TMPL_get_stats(const TMPL_context *ctx);
+
+void TMPL_reset_stats(TMPL_context *ctx);
+
+void TMPL_merge_stats(TMPL_stats *total, const TMPL_stats *stats);
+
+int TMPL_set_cache_limits(TMPL_context *ctx, size_t maxbytes, int ttl);
+
+void TMPL_set_render_limits(TMPL_context *ctx, unsigned long long maxbytes,
+    unsigned long maxiters, unsigned long maxincludes, unsigned long maxms);
+
+void TMPL_clear_cache(TMPL_context *ctx);
+
+void TMPL_set_allocator(const TMPL_allocator *alloc);
+
+void TMPL_set_context_allocator(TMPL_context *ctx,
+    const TMPL_allocator *alloc);
+
+const TMPL_alloc_stats *TMPL_get_alloc_stats(const TMPL_context *ctx);
+
+void TMPL_reset_alloc_stats(TMPL_context *ctx);
+
 void TMPL_encode_entity(const char *value, FILE *out);
 
 void TMPL_encode_url(const char *value, FILE *out);
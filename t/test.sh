@@ -3450,6 +3450,1438 @@ template tmplfile var1 'hello' > result 2>&1
 
 check
 
+TEST=44  ########################################
+
+# Testing the -r option
+
+cat << "EOF" > inclfile1
+{{=incvar fmt="url"}}
+EOF
+
+cat << "EOF" > tmplfile
+{{=var1}} {{IF var2}}{{=var1 fmt="entity"}}{{ENDIF}}
+{{LOOP loop1}}{{=var3}}{{LOOP loop2}}{{=var1}}{{ENDLOOP}}
+{{INCLUDE "inclfile1"}}{{ENDLOOP}}
+EOF
+
+cat << "EOF" > expected
+var var1
+var var2
+fmt entity
+loop loop1
+    var var3
+    var incvar
+    fmt url
+    include inclfile1
+    loop loop2
+        var var1
+EOF
+
+template -r tmplfile > result 2>&1
+
+check
+
+TEST=45  ########################################
+
+# Testing raw include files
+
+cat << "EOF" > inclfile1
+Not a {{=var1}} tag \
+EOF
+
+cat << "EOF" > tmplfile
+{{=var1}}
+{{INCLUDE "inclfile1" mode="raw"}}{{=var1}}
+{{INCLUDE "inclfile1" mode="bogus"}}
+EOF
+
+cat << "EOF" > expected
+Ignoring bad INCLUDE tag (bad "mode=" attribute) in file "tmplfile" line 3
+hello
+Not a {{=var1}} tag \
+hello
+{{INCLUDE "inclfile1" mode="bogus"}}
+EOF
+
+template tmplfile var1 hello > result 2>&1
+
+check
+
+TEST=46  ########################################
+
+# Testing the -j option
+
+cat << "EOF" > inclfile1
+{"var1": "hello", "var2": "xé\"y", "flag": false, "none": null,
+ "loop1": [{"var3": 1}, {"var3": 2.5, "loop2": [{"var4": true}]}, "z"]}
+EOF
+
+cat << "EOF" > tmplfile
+{{=var1}} {{=var2}} [{{=none}}] {{IF flag}}bad{{ENDIF}}
+{{LOOP loop1}}({{=var3}}{{=value}}{{LOOP loop2}} {{=var4}}{{ENDLOOP}}){{ENDLOOP}}
+EOF
+
+cat << "EOF" > expected
+bye xé"y [] 
+(1)(2.5 true)(z)
+C Template library: expected ',' or '}' in JSON input line 2
+-0.5e+3 0 [10E-2] 
+
+C Template library: invalid number in JSON input line 1
+C Template library: invalid number in JSON input line 1
+C Template library: invalid number in JSON input line 1
+C Template library: invalid number in JSON input line 1
+C Template library: invalid number in JSON input line 1
+C Template library: unexpected character in JSON input line 1
+C Template library: invalid number in JSON input line 1
+C Template library: invalid number in JSON input line 1
+EOF
+
+template -j inclfile1 tmplfile var1 bye > result 2>&1
+printf '{"var1":\n "x" 1}' | template -j - tmplfile >> result 2>&1
+printf '{"var1": -0.5e+3, "var2": 0, "none": 10E-2}' |
+    template -j - tmplfile >> result 2>&1
+for n in 1.2.3 - 1e 01 -01 .5 1. 1e+; do
+    printf '{"var1": %s}' $n | template -j - tmplfile >> result 2>&1
+done
+
+check
+
 # clean up
 
 /bin/rm -f expected inclfile1 inclfile2 result tmplfile
+
+TEST=47  ########################################
+
+# Testing the -s option with requests on standard input
+
+cat << "EOF" > tmplfile
+<h1>{{=title}}</h1>
+EOF
+
+cat << "EOF" > expected
+0 17
+<h1>Weather</h1>
+0 10
+<h1></h1>
+1 39
+Cannot find template file "nosuchfile"
+1 12
+Bad request
+1 12
+Bad request
+"tmplfile" exists and is not a socket
+<h1>{{=title}}</h1>
+1 55
+LOOP tag in file "inclfile1" line 1 has no ENDLOOP tag
+1 55
+LOOP tag in file "inclfile1" line 1 has no ENDLOOP tag
+EOF
+
+cat << "EOF" > inclfile1
+{{LOOP x}}
+EOF
+
+printf 'tmplfile 20\n{"title": "Weather"}tmplfile 0\nnosuchfile 0\n' |
+    template -s > result 2>&1
+printf 'tmplfile 18446744073709551615\n{}' | template -s >> result 2>&1
+printf 'tmplfile 16777217\n{}' | template -s >> result 2>&1
+template -s tmplfile >> result 2>&1
+cat tmplfile >> result
+printf 'inclfile1 0\ninclfile1 0\n' | template -s >> result 2>&1
+
+check
+
+# clean up
+
+/bin/rm -f expected inclfile1 result tmplfile
+
+TEST=48  ########################################
+
+# Testing loop metadata variables
+
+cat << "EOF" > tmplfile
+{{LOOP loop1}}{{=__counter__}}/{{=__size__}} {{=var1}}{{IF __first__}} first{{ENDIF}}{{IF __last__}} last{{ENDIF}}{{IF __odd__}} odd{{ENDIF}} [{{LOOP loop2}}{{=__index__}}{{ENDLOOP}}] {{=__index__}}
+{{ENDLOOP}}[{{=__counter__}}]
+EOF
+
+cat << "EOF" > expected
+1/3 a first odd [01] 0
+2/3 b [] 1
+3/3 c last odd [0] 2
+[]
+EOF
+
+template tmplfile loop1 { var1 a loop2 { var2 x } { var2 y } } \
+    { var1 b } { var1 c loop2 { var2 z } } > result 2>&1
+
+check
+
+# clean up
+
+/bin/rm -f expected result tmplfile
+
+TEST=49  ########################################
+
+# Testing the offset, limit and step attributes of LOOP
+
+cat << "EOF" > tmplfile
+{{LOOP loop1 offset="2" limit="3"}}{{=var1}}{{ENDLOOP}}
+{{LOOP loop1 step="-1"}}{{=var1}}{{ENDLOOP}}
+{{LOOP loop1 step="2"}}{{=var1}}{{=__counter__}}/{{=__size__}} {{ENDLOOP}}
+{{LOOP loop1 offset="start" limit="count" step="step"}}{{=var1}}{{ENDLOOP}}
+[{{LOOP loop1 offset="9"}}{{=var1}}{{ENDLOOP}}]
+EOF
+
+cat << "EOF" > inclfile1
+{{LOOP loop1 step="0"}}{{ENDLOOP}}
+EOF
+
+cat << "EOF" > expected
+cde
+fedcba
+a1/3 c2/3 e3/3 
+dcb
+[]
+abcdef
+Ignoring bad LOOP tag (bad "step=" attribute) in file "inclfile1" line 1
+Unexpected ENDLOOP tag in file "inclfile1" line 1
+EOF
+
+template tmplfile start 1 count 3 step -1 loop1 { var1 a } { var1 b } \
+    { var1 c } { var1 d } { var1 e } { var1 f } 2>&1 | sed -n 1,5p > result
+template tmplfile start x loop1 { var1 a } { var1 b } { var1 c } \
+    { var1 d } { var1 e } { var1 f } 2>&1 | sed -n 4p >> result
+template inclfile1 >> result 2>&1
+
+check
+
+# clean up
+
+/bin/rm -f expected inclfile1 result tmplfile
+
+TEST=50  ########################################
+
+# Testing comparisons of typed values (the loop metadata variables)
+
+cat << "EOF" > tmplfile
+{{LOOP loop1}}{{=__counter__}}{{IF __counter__ > "9"}}+{{ENDIF}}{{IF __index__ == "2.0"}}={{ENDIF}}{{IF __counter__ < "x"}}<{{ENDIF}} {{ENDLOOP}}
+EOF
+
+cat << "EOF" > expected
+1< 2< 3=< 4< 5< 6< 7< 8< 9< 10+< 11+< 
+EOF
+
+template tmplfile loop1 { v 1 } { v 2 } { v 3 } { v 4 } { v 5 } { v 6 } \
+    { v 7 } { v 8 } { v 9 } { v 10 } { v 11 } > result 2>&1
+
+check
+
+# clean up
+
+/bin/rm -f expected result tmplfile
+
+TEST=51  ########################################
+
+# Testing C code generated by the -c option
+
+cat << "EOF" > tmplfile
+{{=title fmt="entity"}} \
+{{IF n > "5"}}big{{ELSIF n}}small{{ELSE}}none{{ENDIF}}
+{{LOOP rows}}{{=__counter__}}.{{=name}}{{IF name == "c"}}{{BREAK}}{{ENDIF}} {{ENDLOOP}}
+{{LOOP rows step="-2"}}{{=name}}{{ENDLOOP}} {{INCLUDE name="inclfile1"}}
+{{IF k > "5"}}a{{ENDIF}}{{IF k < "42.5"}}b{{ENDIF}}{{IF k == "-inf"}}c{{ENDIF}}{{IF k >= "0x2A"}}d{{ENDIF}}
+EOF
+
+cat << "EOF" > inclfile1
+"{{=missing default="none"}}"
+EOF
+
+cat << "EOF" > main.c
+#include <stdio.h>
+#include <string.h>
+#include <ctemplate.h>
+
+int tmpl_tmplfile(TMPL_context *ctx, const TMPL_fmtlist *fmtlist,
+    const TMPL_varlist *varlist, FILE *out, FILE *errout);
+
+int
+main(void) {
+    const char *json = "{\"title\": \"<Hi>\", \"n\": \"42\", \"rows\": "
+        "[{\"name\": \"a\"}, {\"name\": \"b\"}, {\"name\": \"c\"}, "
+        "{\"name\": \"d\"}]}";
+    TMPL_varlist *varlist = TMPL_json_varlist(json, strlen(json), stderr);
+    TMPL_fmtlist *fmtlist = TMPL_add_fmt(0, "entity", TMPL_encode_entity);
+    TMPL_context *ctx = TMPL_new_context();
+
+    varlist = TMPL_add_int(varlist, "k", 42);
+    return tmpl_tmplfile(ctx, fmtlist, varlist, stdout, stderr);
+}
+EOF
+
+cat << "EOF" > expected
+&lt;Hi&gt; small
+1.a 2.b 3.c
+db "none"
+
+abd
+EOF
+
+template -c tmplfile > gen.c 2>&1 &&
+    cc -I.. -o gen main.c gen.c -L.. -lctemplate -lz && ./gen > result 2>&1
+
+check
+
+# clean up
+
+/bin/rm -f expected gen gen.c inclfile1 main.c result tmplfile
+
+TEST=52  ########################################
+
+# Testing trim markers and the -m option
+
+cat << "EOF" > tmplfile
+<ul>
+    {{LOOP rows -}}
+    <li> {{- =v -}} </li>
+    {{ENDLOOP}}
+</ul>
+<!-- a comment -->
+<pre>
+  keep   this
+</pre>
+<p>one     two</p>
+EOF
+
+cat << "EOF" > expected
+<ul>
+    <li>1</li>
+    <li>2</li>
+    
+</ul>
+<!-- a comment -->
+<pre>
+  keep   this
+</pre>
+<p>one     two</p>
+<ul>
+<li>1</li>
+<li>2</li>
+
+</ul>
+<pre>
+  keep   this
+</pre>
+<p>one two</p>
+EOF
+
+template tmplfile rows { v 1 } { v 2 } > result 2>&1
+template -m tmplfile rows { v 1 } { v 2 } >> result 2>&1
+
+check
+
+# clean up
+
+/bin/rm -f expected result tmplfile
+
+TEST=53  ########################################
+
+# Testing gzip output with the -z option
+
+awk 'BEGIN { for (i = 1; i <= 200; i++) print "static line", i }' > tmplfile
+cat << "EOF" >> tmplfile
+{{LOOP rows}}{{=v fmt="entity"}} \
+{{ENDLOOP}}
+EOF
+awk 'BEGIN { for (i = 1; i <= 200; i++) print "more text", i }' >> tmplfile
+
+template tmplfile rows { v "<1>" } { v 2 } > expected 2>&1
+template -z tmplfile rows { v "<1>" } { v 2 } | gunzip > result 2>&1
+
+check
+
+# clean up
+
+/bin/rm -f expected result tmplfile
+
+TEST=54  ########################################
+
+# Testing render limits with the -l option
+
+cat << "EOF" > tmplfile
+{{LOOP rows}}{{=v}} {{ENDLOOP}}
+{{INCLUDE name="inclfile1"}}
+EOF
+
+cat << "EOF" > inclfile1
+[{{=x}}]{{IF x}}{{INCLUDE name="inclfile1"}}{{ENDIF}}
+EOF
+
+cat << "EOF" > expected
+1 2 3 
+1 2 3 4 
+[xx][xx]
+1 2 
+C Template library: render stopped after 3 loop iterations
+C Template library: render stopped after 2 included files
+C Template library: render stopped after 4 bytes of output
+EOF
+
+template -l 0,3 tmplfile rows { v 1 } { v 2 } { v 3 } { v 4 } x xx \
+    > result 2> errors
+echo >> result
+template -l 0,0,2 tmplfile rows { v 1 } { v 2 } { v 3 } { v 4 } x xx \
+    >> result 2>> errors
+echo >> result
+template -l 4 tmplfile rows { v 1 } { v 2 } { v 3 } { v 4 } x xx \
+    >> result 2>> errors
+echo >> result
+cat errors >> result
+
+check
+
+# clean up
+
+/bin/rm -f errors expected inclfile1 result tmplfile
+
+TEST=55  ########################################
+
+# Testing the hash of the output with the -e option
+
+cat << "EOF" > tmplfile
+{{LOOP r}}<{{=v fmt="entity"}}>{{ENDLOOP}}
+EOF
+
+cat << "EOF" > expected
+<a&amp;b><2>
+22da00ffe9544e79
+22da00ffe9544e79
+EOF
+
+template tmplfile r { v "a&b" } { v 2 } > result 2>&1
+template -e tmplfile r { v "a&b" } { v 2 } >> result 2>&1
+template -e tmplfile r { v "a&b" } { v 2 } x y >> result 2>&1
+
+check
+
+# clean up
+
+/bin/rm -f expected result tmplfile
+
+TEST=56  ########################################
+
+# Testing TMPL_rerender() with an output map
+
+cat << "EOF" > tmplfile
+<h1>{{=title}}</h1>
+{{LOOP rows}}{{=v}} {{ENDLOOP}}
+{{IF title}}{{INCLUDE name="inclfile1"}}{{ENDIF}}
+EOF
+
+cat << "EOF" > inclfile1
+[{{=v default="none"}}]
+EOF
+
+cat << "EOF" > main.c
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctemplate.h>
+
+static TMPL_varlist *
+vars(const char *title, const char *v) {
+    TMPL_loop *rows = TMPL_add_varlist(0, TMPL_add_var(0, "v", v, 0));
+
+    return TMPL_add_loop(TMPL_add_var(0, "title", title, 0), "rows", rows);
+}
+
+int
+main(void) {
+    const char *title[] = { "title" }, *both[] = { "title", "rows" };
+    TMPL_context *ctx = TMPL_new_context();
+    TMPL_template *tmpl = TMPL_compile(ctx, "tmplfile", 0, 0, stderr);
+    TMPL_map *map = TMPL_new_map();
+    TMPL_varlist *varlist = vars("One", "a");
+    char *buf = 0, *prev;
+    size_t len = 0, prevlen;
+    FILE *fp = open_memstream(&buf, &len);
+
+    TMPL_render_map(ctx, tmpl, varlist, map, fp, stderr);
+    fclose(fp);
+    fputs(buf, stdout);
+
+    /* rows changes but we say only title did, so rows is copied */
+
+    TMPL_free_varlist(varlist);
+    varlist = vars("Two", "b");
+    prev = buf, prevlen = len, buf = 0;
+    fp = open_memstream(&buf, &len);
+    TMPL_rerender(ctx, map, varlist, prev, prevlen, title, 1, fp, stderr);
+    fclose(fp);
+    fputs(buf, stdout);
+    free(prev);
+
+    prev = buf, prevlen = len, buf = 0;
+    fp = open_memstream(&buf, &len);
+    TMPL_rerender(ctx, map, varlist, prev, prevlen, both, 2, fp, stderr);
+    fclose(fp);
+    fputs(buf, stdout);
+    free(prev);
+    free(buf);
+    TMPL_free_map(map);
+    TMPL_free_varlist(varlist);
+    TMPL_free_template(tmpl);
+    TMPL_free_context(ctx);
+    return 0;
+}
+EOF
+
+cat << "EOF" > expected
+<h1>One</h1>
+a 
+[none]
+
+<h1>Two</h1>
+a 
+[none]
+
+<h1>Two</h1>
+b 
+[none]
+
+EOF
+
+cc -I.. -o gen main.c -L.. -lctemplate -lz && ./gen > result 2>&1
+
+check
+
+# clean up
+
+/bin/rm -f expected gen inclfile1 main.c result tmplfile
+
+TEST=57  ########################################
+
+# Testing TMPL_add_func() and TMPL_add_stream()
+
+cat << "EOF" > tmplfile
+{{IF date}}{{=date}} {{=date}}{{ENDIF}}
+{{IF false}}{{=unused}}{{ENDIF}}
+{{=none default="no value"}}
+{{IF body}}<{{=body fmt="entity"}}>{{ENDIF}}
+{{IF body == "x"}}yes{{ELSE}}no{{ENDIF}}
+EOF
+
+cat << "EOF" > main.c
+#include <stdio.h>
+#include <ctemplate.h>
+
+static int calls;
+
+static const char *
+value(const char *name, void *arg) {
+    calls++;
+    printf("[%s]", name);
+    return (const char *) arg;
+}
+
+static void
+body(const char *name, void *arg, FILE *out) {
+    fprintf(out, "%s & %s", name, (const char *) arg);
+}
+
+int
+main(void) {
+    TMPL_fmtlist *fmtlist = TMPL_add_fmt(0, "entity", TMPL_encode_entity);
+    TMPL_context *ctx = TMPL_new_context();
+    TMPL_template *tmpl = TMPL_compile(ctx, "tmplfile", 0, fmtlist, stderr);
+    TMPL_varlist *varlist = TMPL_add_func(0, "date", value, "1 May 2009");
+
+    varlist = TMPL_add_func(varlist, "unused", value, "never");
+    varlist = TMPL_add_func(varlist, "none", value, 0);
+    varlist = TMPL_add_stream(varlist, "body", body, "streamed");
+    fflush(stdout);
+    TMPL_render(ctx, tmpl, varlist, stdout, stderr);
+    TMPL_render(ctx, tmpl, varlist, stdout, stderr);
+    printf("%d calls\n", calls);
+    TMPL_free_varlist(varlist);
+    TMPL_free_template(tmpl);
+    TMPL_free_context(ctx);
+    TMPL_free_fmtlist(fmtlist);
+    return 0;
+}
+EOF
+
+cat << "EOF" > expected
+[date]1 May 2009 1 May 2009
+
+[none]no value
+<body & streamed>
+no
+[date]1 May 2009 1 May 2009
+
+[none]no value
+<body & streamed>
+no
+4 calls
+EOF
+
+cc -I.. -o gen main.c -L.. -lctemplate -lz && ./gen > result 2>&1
+
+check
+
+# clean up
+
+/bin/rm -f expected gen main.c result tmplfile
+
+TEST=58  ########################################
+
+# Testing the -j option of the server, whose variables are a base
+
+cat << "EOF" > tmplfile
+<h1>{{=title}}</h1> {{=site}}: {{LOOP menu}}{{=item}} {{ENDLOOP}}
+EOF
+
+cat << "EOF" > inclfile1
+{"site": "Example", "title": "Home", "menu": [{"item": "a"}, {"item": "b"}]}
+EOF
+
+cat << "EOF" > expected
+0 28
+<h1>Home</h1> Example: a b 
+0 31
+<h1>Weather</h1> Example: a b 
+0 26
+<h1>Home</h1> Example: c 
+EOF
+
+printf 'tmplfile 0\ntmplfile 20\n{"title": "Weather"}tmplfile 23\n{"menu": {"item": "c"}}' |
+    template -j inclfile1 -s > result 2>&1
+
+check
+
+# clean up
+
+/bin/rm -f expected inclfile1 result tmplfile
+
+TEST=59  ########################################
+
+# Testing TMPL_set_var(), TMPL_remove_var() and TMPL_reset_loop()
+
+cat << "EOF" > tmplfile
+{{=title}}: {{LOOP items}}{{=name}}={{=qty}}{{IF sale}}*{{ENDIF}} {{ENDLOOP}}
+EOF
+
+cat << "EOF" > main.c
+#include <stdio.h>
+#include <ctemplate.h>
+
+static const char *names[] = { "apple", "banana", "cherry" };
+
+static void
+fill(TMPL_loop *items, int n, int k) {
+    TMPL_varlist *row;
+    int i;
+
+    TMPL_reset_loop(items);
+    for (i = 0; i < n; i++) {
+        row = TMPL_next_row(items);
+        TMPL_set_var(row, "name", names[(i + k) % 3]);
+        TMPL_set_int(row, "qty", i + k);
+        if ((i + k) % 2 == 0) {
+            TMPL_set_bool(row, "sale", 1);
+        }
+        else {
+            TMPL_remove_var(row, "sale");
+        }
+    }
+}
+
+int
+main(void) {
+    TMPL_context *ctx = TMPL_new_context();
+    TMPL_template *tmpl = TMPL_compile(ctx, "tmplfile", 0, 0, stderr);
+    TMPL_loop *items = TMPL_reserve_loop(0, 3);
+    TMPL_varlist *varlist = TMPL_add_loop(0, "items", items);
+    unsigned long long allocs = 0;
+    int k;
+
+    for (k = 0; k < 4; k++) {
+        TMPL_set_var(varlist, "title", k % 2 == 0 ? "Fruit" : "Fresh fruit");
+        fill(items, 3 - k % 2, k);
+        TMPL_render(ctx, tmpl, varlist, stdout, stderr);
+        allocs = TMPL_get_alloc_stats(0)->allocs;
+    }
+    TMPL_set_var(varlist, "title", "Fruit");
+    fill(items, 2, 1);
+    printf("%llu allocations\n", TMPL_get_alloc_stats(0)->allocs - allocs);
+    printf("%d removed\n", TMPL_remove_var(varlist, "title"));
+    TMPL_render(ctx, tmpl, varlist, stdout, stderr);
+    TMPL_free_varlist(varlist);
+    TMPL_free_template(tmpl);
+    TMPL_free_context(ctx);
+    return 0;
+}
+EOF
+
+cat << "EOF" > expected
+Fruit: apple=0* banana=1 cherry=2* 
+Fresh fruit: banana=1 cherry=2* 
+Fruit: cherry=2* apple=3 banana=4* 
+Fresh fruit: apple=3 banana=4* 
+0 allocations
+1 removed
+: banana=1 cherry=2* 
+EOF
+
+cc -I.. -o gen main.c -L.. -lctemplate -lz && ./gen > result 2>&1
+
+check
+
+# clean up
+
+/bin/rm -f expected gen main.c result tmplfile
+
+TEST=60  ########################################
+
+# Testing outer variables referred to inside loops, some rows hiding
+# them, in nested loops and in ELSIF tags
+
+cat << "EOF" > tmplfile
+{{LOOP rows}}{{IF show}}{{=cur}}{{=v}}{{ELSIF cur == "$"}}-{{ELSE}}?{{ENDIF}}{{LOOP cells}}[{{=cur}}{{=v}}{{=w}}{{=none}}]{{ENDLOOP}} {{ENDLOOP}}
+EOF
+
+cat << "EOF" > expected
+EUR1[EUR1a][xx1b] $2 -[$3c] EUR4 
+EOF
+
+template tmplfile show yes cur EUR rows { v 1 cells { w a } { cur xx w b } } \
+    { v 2 cur '$' } { v 3 show "" cur '$' cells { w c } } { v 4 } > result 2>&1
+
+check
+
+# clean up
+
+/bin/rm -f expected result tmplfile
+
+TEST=61  ########################################
+
+# Testing a cached loop statement whose rows have computed variables
+
+cat << "EOF" > tmplfile
+{{LOOP name="rows" cache="0"}}{{=x}} {{ENDLOOP}}
+EOF
+
+cat << "EOF" > main.c
+#include <stdio.h>
+#include <ctemplate.h>
+
+static int version;
+
+static const char *
+value(const char *name, void *arg) {
+    static char buf[16];
+
+    snprintf(buf, sizeof(buf), "v%d", version);
+    return buf;
+}
+
+int
+main(void) {
+    TMPL_context *ctx = TMPL_new_context();
+    TMPL_template *tmpl = TMPL_compile(ctx, "tmplfile", 0, 0, stderr);
+    TMPL_varlist *row = TMPL_add_func(0, "x", value, 0);
+    TMPL_varlist *varlist = TMPL_add_loop(0, "rows", TMPL_add_varlist(0, row));
+    int i;
+
+    TMPL_set_cache_limits(ctx, 1 << 20, 60);
+    TMPL_enable_stats(ctx, 1);
+    for (i = 0; i < 3; i++) {
+        version = i / 2;
+        TMPL_render(ctx, tmpl, varlist, stdout, stderr);
+    }
+    printf("%llu cache hits\n", TMPL_get_stats(ctx)->cache_hits);
+    TMPL_free_varlist(varlist);
+    TMPL_free_template(tmpl);
+    TMPL_free_context(ctx);
+    return 0;
+}
+EOF
+
+cat << "EOF" > expected
+v0 
+v0 
+v1 
+1 cache hits
+EOF
+
+cc -I.. -o gen main.c -L.. -lctemplate -lz && ./gen > result 2>&1
+
+check
+
+# clean up
+
+/bin/rm -f expected gen main.c result tmplfile
+
+TEST=62  ########################################
+
+# Testing a loop variable in a base that refers to the variables of
+# the lists based on it
+
+cat << "EOF" > tmplfile
+[{{LOOP name="items"}}{{=item}}/{{=user}}/{{=site}} {{ENDLOOP}}]
+{{LOOP name="items" cache="0"}}{{IF user == "ann"}}*{{ENDIF}}{{=item}} {{ENDLOOP}}
+{{LOOP rows}}{{LOOP items}}{{=item}}{{=r}}{{ENDLOOP}} {{ENDLOOP}}
+EOF
+
+cat << "EOF" > main.c
+#include <stdio.h>
+#include <ctemplate.h>
+
+static TMPL_varlist *
+request(TMPL_varlist *globals, const char *user) {
+    TMPL_varlist *varlist = TMPL_set_base(0, globals);
+    TMPL_loop *rows = TMPL_add_varlist(0, TMPL_add_var(0, "r", "1", 0));
+
+    rows = TMPL_add_varlist(rows, TMPL_add_var(0, "r", "2", 0));
+    varlist = TMPL_add_var(varlist, "user", user, 0);
+    return TMPL_add_loop(varlist, "rows", rows);
+}
+
+int
+main(void) {
+    TMPL_context *ctx = TMPL_new_context();
+    TMPL_template *tmpl = TMPL_compile(ctx, "tmplfile", 0, 0, stderr);
+    TMPL_loop *items = TMPL_add_varlist(0, TMPL_add_var(0, "item", "a", 0));
+    TMPL_varlist *globals = TMPL_add_var(0, "site", "S", 0);
+    TMPL_varlist *ann, *bob;
+
+    items = TMPL_add_varlist(items, TMPL_add_var(0, "item", "b", 0));
+    globals = TMPL_add_loop(globals, "items", items);
+    ann = request(globals, "ann");
+    bob = request(globals, "bob");
+    TMPL_set_cache_limits(ctx, 1 << 20, 60);
+    TMPL_enable_stats(ctx, 1);
+    TMPL_render(ctx, tmpl, ann, stdout, stderr);
+    TMPL_render(ctx, tmpl, bob, stdout, stderr);
+    TMPL_render(ctx, tmpl, ann, stdout, stderr);
+    printf("%llu cache hits\n", TMPL_get_stats(ctx)->cache_hits);
+    TMPL_free_varlist(ann);
+    TMPL_free_varlist(globals);
+    TMPL_free_varlist(bob);
+    TMPL_free_template(tmpl);
+    TMPL_free_context(ctx);
+    return 0;
+}
+EOF
+
+cat << "EOF" > expected
+[a/ann/S b/ann/S ]
+*a *b 
+a1b1 a2b2 
+[a/bob/S b/bob/S ]
+a b 
+a1b1 a2b2 
+[a/ann/S b/ann/S ]
+*a *b 
+a1b1 a2b2 
+1 cache hits
+EOF
+
+cc -I.. -o gen main.c -L.. -lctemplate -lz && ./gen > result 2>&1
+
+check
+
+# clean up
+
+/bin/rm -f expected gen main.c result tmplfile
+
+TEST=63  ########################################
+
+# Testing that running out of memory while compiling a template is
+# reported as TMPL_ENOMEM whichever allocation fails
+
+cat << "EOF" > tmplfile
+a {{VAR x fmt="entity"}} {{IF x == "<"}}t{{ELSIF y}}e{{ELSE}}f{{ENDIF}}
+{{INCLUDE "inclfile1"}}
+EOF
+
+cat << "EOF" > inclfile1
+inc {{VAR x}}
+EOF
+
+cat << "EOF" > main.c
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctemplate.h>
+
+static long count, fail;
+
+static void *
+failmalloc(void *arg, size_t size) {
+    return ++count == fail ? 0 : malloc(size);
+}
+
+static void *
+failrealloc(void *arg, void *ptr, size_t size) {
+    return ++count == fail ? 0 : realloc(ptr, size);
+}
+
+static void
+stdfree(void *arg, void *ptr) {
+    free(ptr);
+}
+
+int
+main(void) {
+    TMPL_allocator alloc = { failmalloc, failrealloc, stdfree, 0 };
+    TMPL_varlist *varlist = TMPL_add_var(0, "x", "<", 0);
+    TMPL_fmtlist *fmtlist = TMPL_add_fmt(0, "entity", TMPL_encode_entity);
+    FILE *out = fopen("/dev/null", "w");
+    int ret, bad = 0;
+
+    TMPL_set_allocator(&alloc);
+    for (fail = 1; ; fail++) {
+        count = 0;
+        ret = TMPL_write("tmplfile", 0, fmtlist, varlist, out, 0);
+        if (count < fail) {
+            break;
+        }
+        if (ret != TMPL_ENOMEM) {
+            printf("failure %ld returned %d\n", fail, ret);
+            bad++;
+        }
+    }
+    printf("%d bad, last returned %d\n", bad, ret);
+    TMPL_set_allocator(0);
+    TMPL_write("tmplfile", 0, fmtlist, varlist, stdout, stderr);
+    return 0;
+}
+EOF
+
+cat << "EOF" > expected
+0 bad, last returned 0
+a &lt; t
+inc <
+
+EOF
+
+cc -I.. -o gen main.c -L.. -lctemplate -lz && ./gen > result 2>&1
+
+check
+
+# clean up
+
+/bin/rm -f expected gen inclfile1 main.c result tmplfile
+
+TEST=64  ########################################
+
+# Testing that memory is freed by the allocator that allocated it and
+# that variable lists can come from the allocator of a render context
+
+cat << "EOF" > main.c
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctemplate.h>
+
+struct counts {
+    long mallocs, frees;
+};
+
+static void *
+countmalloc(void *arg, size_t size) {
+    ((struct counts *) arg)->mallocs++;
+    return malloc(size);
+}
+
+static void *
+countrealloc(void *arg, void *ptr, size_t size) {
+    if (ptr == 0) {
+        ((struct counts *) arg)->mallocs++;
+    }
+    return realloc(ptr, size);
+}
+
+static void
+countfree(void *arg, void *ptr) {
+    if (ptr != 0) {
+        ((struct counts *) arg)->frees++;
+    }
+    free(ptr);
+}
+
+static void
+report(const char *name, const struct counts *c) {
+    printf("%s: %s, %s\n", name, c->mallocs != 0 ? "used" : "unused",
+        c->mallocs == c->frees ? "all freed" : "not all freed");
+}
+
+int
+main(void) {
+    static const char json[] = "{\"a\": [{\"n\": 3}, {\"n\": 4}], \"b\": \"x\"}";
+    struct counts a = { 0, 0 }, b = { 0, 0 }, c = { 0, 0 };
+    TMPL_allocator alloca = { countmalloc, countrealloc, countfree, &a };
+    TMPL_allocator allocb = { countmalloc, countrealloc, countfree, &b };
+    TMPL_allocator allocc = { countmalloc, countrealloc, countfree, &c };
+    TMPL_varlist *varlist, *row, *fromjson;
+    TMPL_loop *loop;
+    TMPL_template *tmpl;
+    TMPL_context *ctx;
+    long before;
+
+    TMPL_set_allocator(&alloca);
+    varlist = TMPL_add_var(0, "x", "1", 0);
+    TMPL_set_allocator(&allocb);
+    varlist = TMPL_set_var(varlist, "x", "a much longer value than before");
+    TMPL_free_varlist(varlist);
+    report("a", &a);
+    report("b", &b);
+
+    ctx = TMPL_new_context();
+    TMPL_set_context_allocator(ctx, &allocc);
+    before = b.mallocs;
+    varlist = TMPL_add_var(TMPL_new_varlist(ctx), "title", "T", 0);
+    loop = TMPL_add_varlist(0, TMPL_add_var(TMPL_new_varlist(ctx),
+        "n", "1", 0));
+    row = TMPL_next_row(loop);
+    TMPL_add_int(row, "n", 2);
+    varlist = TMPL_add_loop(varlist, "rows", loop);
+    fromjson = TMPL_json_context_varlist(ctx, json, strlen(json), stderr);
+    tmpl = TMPL_compile(ctx, 0, "{{=title}}{{LOOP rows}} {{=n}}{{ENDLOOP}}"
+        "{{LOOP a}} {{=n}}{{ENDLOOP}} {{=b}}\n", 0, stderr);
+    TMPL_render(ctx, tmpl, varlist, stdout, stderr);
+    TMPL_render(ctx, tmpl, fromjson, stdout, stderr);
+    printf("b: %s by the context's lists\n",
+        b.mallocs == before ? "unused" : "used");
+    TMPL_free_varlist(varlist);
+    TMPL_free_varlist(fromjson);
+    TMPL_free_template(tmpl);
+    TMPL_free_context(ctx);
+    report("b", &b);
+    report("c", &c);
+    return 0;
+}
+EOF
+
+cat << "EOF" > expected
+a: used, all freed
+b: unused, all freed
+T 1 2 
+ 3 4 x
+b: unused by the context's lists
+b: used, all freed
+c: used, all freed
+EOF
+
+cc -I.. -o gen main.c -L.. -lctemplate -lz && ./gen > result 2>&1
+
+check
+
+# clean up
+
+/bin/rm -f expected gen main.c result
+
+TEST=65  ########################################
+
+# Testing the lookup statistics of IF tags
+
+cat << "EOF" > tmplfile
+{{IF a}}a{{ENDIF}}{{IF b == "1"}}b{{ENDIF}}{{IF l}}l{{ENDIF}}
+{{LOOP l}}{{IF a}}a{{ENDIF}}{{IF z}}z{{ELSIF a == "yes"}}-{{ENDIF}}{{ENDLOOP}}
+EOF
+
+cat << "EOF" > main.c
+#include <stdio.h>
+#include <ctemplate.h>
+
+int
+main(void) {
+    TMPL_context *ctx = TMPL_new_context();
+    TMPL_template *tmpl = TMPL_compile(ctx, "tmplfile", 0, 0, stderr);
+    TMPL_loop *loop = TMPL_add_varlist(0, TMPL_add_var(0, "z", "yes", 0));
+    TMPL_varlist *varlist = TMPL_add_var(0, "a", "yes", 0);
+    const TMPL_stats *stats;
+
+    loop = TMPL_add_varlist(loop, TMPL_add_var(0, "y", "yes", 0));
+    varlist = TMPL_add_loop(varlist, "l", loop);
+    TMPL_enable_stats(ctx, 1);
+    TMPL_render(ctx, tmpl, varlist, stdout, stderr);
+    TMPL_render(ctx, tmpl, varlist, stdout, stderr);
+    stats = TMPL_get_stats(ctx);
+    printf("%llu lookups, %llu misses\n", stats->lookups, stats->misses);
+    TMPL_free_varlist(varlist);
+    TMPL_free_template(tmpl);
+    TMPL_free_context(ctx);
+    return 0;
+}
+EOF
+
+cat << "EOF" > expected
+al
+aza-
+al
+aza-
+16 lookups, 6 misses
+EOF
+
+cc -I.. -o gen main.c -L.. -lctemplate -lz && ./gen > result 2>&1
+
+check
+
+# clean up
+
+/bin/rm -f expected gen main.c result tmplfile
+
+TEST=66  ########################################
+
+# Testing resumable rendering a chunk at a time
+
+cat << "EOF" > tmplfile
+<h1>{{VAR title fmt="entity"}}</h1>
+{{LOOP rows}}<li>{{VAR name fmt="entity"}} {{INCLUDE "inclfile1"}}</li>
+{{ENDLOOP}}end
+EOF
+
+cat << "EOF" > inclfile1
+[{{VAR __counter__}}]
+EOF
+
+cat << "EOF" > main.c
+#include <stdio.h>
+#include <string.h>
+#include <ctemplate.h>
+
+static char whole[4096];
+static size_t wholelen;
+
+/* chunks() renders in chunks of "cap" bytes and compares the result */
+
+static void
+chunks(TMPL_context *ctx, TMPL_template *tmpl, TMPL_varlist *varlist,
+    size_t cap, const char *what)
+{
+    char out[4096], buf[16];
+    size_t len = 0;
+    long n;
+    int short_chunks = 0;
+
+    if (TMPL_render_start(ctx, tmpl, varlist, stderr) != 0) {
+        printf("%s: start failed\n", what);
+        return;
+    }
+    while ((n = TMPL_render_next(ctx, buf, cap)) > 0) {
+        short_chunks += (size_t) n < cap;
+        memcpy(out + len, buf, n);
+        len += n;
+    }
+    printf("%s: %s, %d short chunks, returned %ld\n", what,
+        len == wholelen && memcmp(out, whole, len) == 0 ?
+        "same" : "different", short_chunks, n);
+}
+
+int
+main(void) {
+    TMPL_context *ctx = TMPL_new_context();
+    TMPL_fmtlist *fmtlist = TMPL_add_fmt(0, "entity", TMPL_encode_entity);
+    TMPL_template *tmpl = TMPL_compile(ctx, "tmplfile", 0, fmtlist, stderr);
+    TMPL_varlist *varlist = TMPL_add_var(0, "title", "Q&A!", 0);
+    TMPL_loop *rows = 0;
+    FILE *fp = tmpfile();
+    char buf[16];
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        rows = TMPL_add_varlist(rows, TMPL_add_var(0, "name",
+            i == 1 ? "<b>" : "x", 0));
+    }
+    varlist = TMPL_add_loop(varlist, "rows", rows);
+    TMPL_render(ctx, tmpl, varlist, fp, stderr);
+    rewind(fp);
+    wholelen = fread(whole, 1, sizeof(whole), fp);
+    fclose(fp);
+    fwrite(whole, 1, wholelen, stdout);
+
+    chunks(ctx, tmpl, varlist, 1, "cap 1");
+    chunks(ctx, tmpl, varlist, 7, "cap 7");
+
+    /* abandon a render part way and start again */
+
+    TMPL_render_start(ctx, tmpl, varlist, stderr);
+    TMPL_render_next(ctx, buf, 7);
+    TMPL_render_next(ctx, buf, 7);
+    chunks(ctx, tmpl, varlist, 7, "restart");
+
+    TMPL_free_varlist(varlist);
+    TMPL_free_template(tmpl);
+    TMPL_free_fmtlist(fmtlist);
+    TMPL_free_context(ctx);
+    return 0;
+}
+EOF
+
+cat << "EOF" > expected
+<h1>Q&amp;A!</h1>
+<li>x [1]
+</li>
+<li>&lt;b&gt; [2]
+</li>
+<li>x [3]
+</li>
+end
+cap 1: same, 0 short chunks, returned 0
+cap 7: same, 1 short chunks, returned 0
+restart: same, 1 short chunks, returned 0
+EOF
+
+cc -I.. -o gen main.c -L.. -lctemplate -lz && ./gen > result 2>&1
+
+check
+
+# clean up
+
+/bin/rm -f expected gen inclfile1 main.c result tmplfile
+
+TEST=67  ########################################
+
+# Testing output to a file descriptor with writev()
+
+cat << "EOF" > tmplfile
+{{LOOP rows}}<{{VAR n}}:{{VAR s fmt="entity"}}/{{VAR t}}>
+{{ENDLOOP}}{{VAR big fmt="entity"}}
+EOF
+
+cat << "EOF" > main.c
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <ctemplate.h>
+
+/* readall() reads the file on "fd" from the start into "buf" */
+
+static size_t
+readall(int fd, char *buf, size_t size) {
+    size_t len = 0;
+    ssize_t n;
+
+    lseek(fd, 0, SEEK_SET);
+    while ((n = read(fd, buf + len, size - len)) > 0) {
+        len += n;
+    }
+    return len;
+}
+
+int
+main(void) {
+    static char big[20001], want[1 << 20], got[1 << 20];
+    TMPL_context *ctx = TMPL_new_context();
+    TMPL_fmtlist *fmtlist = TMPL_add_fmt(0, "entity", TMPL_encode_entity);
+    TMPL_template *tmpl = TMPL_compile(ctx, "tmplfile", 0, fmtlist, stderr);
+    TMPL_varlist *varlist, *row;
+    TMPL_loop *rows = 0;
+    char file1[] = "/tmp/ctemplateXXXXXX", file2[] = "/tmp/ctemplateXXXXXX";
+    int fd1 = mkstemp(file1), fd2 = mkstemp(file2), i, ret;
+    size_t wantlen, gotlen;
+    FILE *fp = fdopen(fd1, "w+");
+
+    memset(big, '&', sizeof(big) - 1);
+    varlist = TMPL_add_var(0, "big", big, 0);
+    for (i = 0; i < 3000; i++) {
+        row = TMPL_add_var(0, "s", i % 2 ? "a<b" : "plain", "t", "T", 0);
+        rows = TMPL_add_varlist(rows, TMPL_add_int(row, "n", i));
+    }
+    varlist = TMPL_add_loop(varlist, "rows", rows);
+
+    TMPL_render(ctx, tmpl, varlist, fp, stderr);
+    fflush(fp);
+    wantlen = readall(fd1, want, sizeof(want));
+    ret = TMPL_render_fd(ctx, tmpl, varlist, fd2, stderr);
+    gotlen = readall(fd2, got, sizeof(got));
+    printf("returned %d, %lu bytes, %s\n", ret, (unsigned long) gotlen,
+        gotlen == wantlen && memcmp(got, want, gotlen) == 0 ?
+        "same" : "different");
+
+    fclose(fp);
+    close(fd2);
+    unlink(file1);
+    unlink(file2);
+    TMPL_free_varlist(varlist);
+    TMPL_free_template(tmpl);
+    TMPL_free_fmtlist(fmtlist);
+    TMPL_free_context(ctx);
+    return 0;
+}
+EOF
+
+cat << "EOF" > expected
+returned 0, 145391 bytes, same
+EOF
+
+cc -I.. -o gen main.c -L.. -lctemplate -lz && ./gen > result 2>&1
+
+check
+
+# clean up
+
+/bin/rm -f expected gen main.c result tmplfile
+
+TEST=68  ########################################
+
+# Testing loop variables bound to rows and columns of C data
+
+cat << "EOF" > tmplfile
+{{LOOP items}}[{{=name}}|{{=code}}|{{=qty}}|{{=big}}|{{=price}}] {{IF name}}n{{ELSE}}-{{ENDIF}}{{IF code == "ABCD"}}c{{ENDIF}}{{IF qty > 5}}q{{ENDIF}}{{IF big < 0}}b{{ENDIF}}{{IF price >= 2.5}}p{{ENDIF}}
+{{ENDLOOP}}{{LOOP items}}{{=code}}:{{LOOP items}}{{=code}},{{ENDLOOP}} {{ENDLOOP}}
+EOF
+
+cat << "EOF" > main.c
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <ctemplate.h>
+
+struct item {
+    const char *name;
+    char code[4];
+    int qty;
+    int64_t big;
+    double price;
+};
+
+static struct item items[] = {
+    { "apple", { 'A', 'B', 'C', 'D' }, 10, -9000000000LL, 2.5 },
+    { 0, "XY", 3, 42, 1.25 },
+    { "pear", "Z", 7, -1, 0.1 },
+};
+
+static const char *names[] = { "apple", 0, "pear" };
+static char codes[][4] = { { 'A', 'B', 'C', 'D' }, "XY", "Z" };
+static int qtys[] = { 10, 3, 7 };
+static int64_t bigs[] = { -9000000000LL, 42, -1 };
+static double prices[] = { 2.5, 1.25, 0.1 };
+
+static TMPL_column cols[] = {
+    { "name",  TMPL_COL_STRING, offsetof(struct item, name) },
+    { "code",  TMPL_COL_CHARS,  offsetof(struct item, code), 4 },
+    { "qty",   TMPL_COL_INT,    offsetof(struct item, qty) },
+    { "big",   TMPL_COL_INT64,  offsetof(struct item, big) },
+    { "price", TMPL_COL_DOUBLE, offsetof(struct item, price) },
+};
+
+int
+main(void) {
+    const void *arrays[] = { names, codes, qtys, bigs, prices };
+    TMPL_context *ctx = TMPL_new_context();
+    TMPL_template *tmpl = TMPL_compile(ctx, "tmplfile", 0, 0, stderr);
+    TMPL_varlist *byrows, *bycols;
+
+    byrows = TMPL_add_loop(0, "items",
+        TMPL_bind_rows(items, 3, sizeof(items[0]), cols, 5));
+    bycols = TMPL_add_loop(0, "items",
+        TMPL_bind_columns(arrays, 3, cols, 5));
+    TMPL_render(ctx, tmpl, byrows, stdout, stderr);
+    TMPL_render(ctx, tmpl, bycols, stdout, stderr);
+    TMPL_free_varlist(byrows);
+    TMPL_free_varlist(bycols);
+    TMPL_free_template(tmpl);
+    TMPL_free_context(ctx);
+    return 0;
+}
+EOF
+
+cat << "EOF" > expected
+[apple|ABCD|10|-9000000000|2.5] ncqbp
+[|XY|3|42|1.25] -
+[pear|Z|7|-1|0.1] nqb
+ABCD:ABCD,XY,Z, XY:ABCD,XY,Z, Z:ABCD,XY,Z, 
+[apple|ABCD|10|-9000000000|2.5] ncqbp
+[|XY|3|42|1.25] -
+[pear|Z|7|-1|0.1] nqb
+ABCD:ABCD,XY,Z, XY:ABCD,XY,Z, Z:ABCD,XY,Z, 
+EOF
+
+cc -I.. -o gen main.c -L.. -lctemplate -lz && ./gen > result 2>&1
+
+check
+
+# clean up
+
+/bin/rm -f expected gen main.c result tmplfile
+
+TEST=69  ########################################
+
+# Testing rendering a batch of variable lists
+
+cat << "EOF" > main.c
+#include <stdio.h>
+#include <ctemplate.h>
+
+static const char *first;
+static int samebuf = 1;
+
+static int
+output(void *arg, int i, const char *buf, size_t len, int status) {
+    if (i == 0) {
+        first = buf;
+    }
+    else if (buf != first) {
+        samebuf = 0;
+    }
+    printf("%d: status %d, %lu bytes |%.*s|\n", i, status,
+        (unsigned long) len, (int) len, buf);
+    return arg != 0 && i == *(int *) arg ? 7 : 0;
+}
+
+int
+main(void) {
+    TMPL_context *ctx = TMPL_new_context();
+    TMPL_template *tmpl = TMPL_compile(ctx, 0,
+        "Hello, {{=name}}!{{LOOP rows}} {{=n}}{{ENDLOOP}}", 0, stderr);
+    TMPL_varlist *varlists[4];
+    TMPL_loop *rows = 0;
+    int i, stop = 1;
+
+    for (i = 1; i <= 3; i++) {
+        rows = TMPL_add_varlist(rows, TMPL_add_int(0, "n", i));
+    }
+    varlists[0] = TMPL_add_loop(TMPL_add_var(0, "name", "Ann", 0),
+        "rows", rows);
+    varlists[1] = TMPL_add_var(0, "name", "Bob", 0);
+    varlists[2] = TMPL_add_var(0, "name",
+        "Cecilia Constance Carmichael-Cartwright the Third", 0);
+    varlists[3] = TMPL_add_var(0, "name", "Dee", 0);
+    TMPL_set_render_limits(ctx, 40, 0, 0, 0);
+
+    printf("returned %d\n", TMPL_render_batch(ctx, tmpl,
+        (const TMPL_varlist *const *) varlists, 4, output, 0, 0));
+    printf("%s buffer\n", samebuf ? "same" : "new");
+    printf("returned %d\n", TMPL_render_batch(ctx, tmpl,
+        (const TMPL_varlist *const *) varlists, 4, output, &stop, 0));
+
+    for (i = 0; i < 4; i++) {
+        TMPL_free_varlist(varlists[i]);
+    }
+    TMPL_free_template(tmpl);
+    TMPL_free_context(ctx);
+    return 0;
+}
+EOF
+
+cat << "EOF" > expected
+0: status 0, 17 bytes |Hello, Ann! 1 2 3|
+1: status 0, 11 bytes |Hello, Bob!|
+2: status -3, 7 bytes |Hello, |
+3: status 0, 11 bytes |Hello, Dee!|
+returned -3
+same buffer
+0: status 0, 17 bytes |Hello, Ann! 1 2 3|
+1: status 0, 11 bytes |Hello, Bob!|
+returned 7
+EOF
+
+cc -I.. -o gen main.c -L.. -lctemplate -lz && ./gen > result 2>&1
+
+check
+
+# clean up
+
+/bin/rm -f expected gen main.c result
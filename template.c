@@ -36,27 +36,110 @@
  *         { ivar1 ival4 ivar2 ival5 } \
  *         { ivar1 ival6 ivar2 ival7 } \
  *     }
+ *
+ * With the -r option the template command does not output the
+ * template.  Instead it lists the names of the variables, loop
+ * variables, format functions and included files that the template
+ * refers to, indenting the names inside each loop statement.
+ *
+ * template -r tmplfile
+ *
+ * With the -j option the template command reads variables from a file
+ * of JSON text (or from standard input if the file is "-") before
+ * reading any variables on the command line.  The JSON text must be an
+ * object.  Its members become variables and its arrays of objects
+ * become loop variables.
+ *
+ * template -j jsonfile tmplfile [ varname1 value1 ... ]
+ *
+ * With the -s option the template command is a server that outputs
+ * templates on request.  It reads requests from standard input and
+ * writes responses to standard output, or if a socket file name is
+ * given, it accepts connections on a Unix domain socket and serves
+ * them with a pool of threads (4 by default).
+ *
+ * template -s [ socketfile [ nthreads ] ]
+ *
+ * Each request is a line with a template file name and a byte count,
+ * followed by that many bytes of JSON text with the variables (see -j).
+ * The count may be at most 16 MB.
+ * Each response is a line with a status (0 for success) and a byte
+ * count, followed by that many bytes of output, or of error messages
+ * if the status is not 0.  For example:
+ *
+ *   weather.tmpl 20            0 17
+ *   {"title": "Weather"}       <h1>Weather</h1>
+ *
+ * Each thread keeps the templates that it has compiled and compiles a
+ * template again only if its file changes.
+ *
+ * With the -c option the template command does not output the
+ * templates.  Instead it writes C code that outputs them to standard
+ * output (see TMPL_emit_c()).  The render function for each template
+ * is named "tmpl_" followed by the file name without its directory
+ * and suffix, with characters other than letters and digits changed
+ * to '_', so tmpl_weather outputs weather.tmpl.
+ *
+ * template -c tmplfile ...
+ *
+ * The -m option may precede any of the other options or the template
+ * file name.  It compiles templates with whitespace in their text
+ * collapsed (see TMPL_enable_minify()).
+ *
+ * template -m [ -j jsonfile ] tmplfile [ varname1 value1 ... ]
+ *
+ * With the -z option the template command outputs the template in
+ * gzip format (see TMPL_render_gzip()).
+ *
+ * template -z [ -m ] [ -j jsonfile ] tmplfile [ varname1 value1 ... ]
+ *
+ * The -l option limits each output of a template (or each response of
+ * the server) to a number of bytes, loop iterations, included files
+ * and milliseconds, separated by commas.  A limit of 0 or one that is
+ * left out means no limit (see TMPL_set_render_limits()).
+ *
+ * template -l maxbytes[,maxiters[,maxincludes[,maxms]]] tmplfile ...
+ *
+ * With the -e option the template command does not output the
+ * template.  Instead it outputs the hash of the output in hexadecimal
+ * (see TMPL_render_hash()), which is suitable for an HTTP ETag.
+ *
+ * template -e [ -j jsonfile ] tmplfile [ varname1 value1 ... ]
  */
 
 #include <ctype.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <ctemplate.h>
 
 static int idx;  /* index of current command line arg */
+static int minify;  /* compile with whitespace collapsed (-m) */
+static int gzip;    /* output in gzip format (-z) */
+static int limited; /* true if there are render limits (-l) */
+static int etag;    /* output the hash of the output instead (-e) */
+static unsigned long long maxbytes;   /* render limits (-l) */
+static unsigned long maxiters, maxincludes, maxms;
 
 static TMPL_loop *getloop(const char **argv);
 
 /*
  * getvarlist() builds a TMPL_varlist from a list of variable name and
  * value pairs on the command line.  If the TMPL_varlist is part of a
- * loop variable, then it is terminated by a '}'.
+ * loop variable, then it is terminated by a '}'.  We add the variables
+ * to "varlist", which may be null.
  */
 
 static TMPL_varlist *
-getvarlist(const char **argv, int stop) {
+getvarlist(const char **argv, int stop, TMPL_varlist *varlist) {
     const char *name, *value;
-    TMPL_varlist *varlist = 0;
     TMPL_loop  *loop;
 
     while((name = argv[idx++]) != 0) {
@@ -86,7 +169,10 @@ getvarlist(const char **argv, int stop) {
         }
         else {
             idx++;
-            varlist = TMPL_add_var(varlist, name, value, 0);
+            if ((varlist = TMPL_add_var(varlist, name, value, 0)) == 0) {
+                fputs("Out of memory\n", stderr);
+                exit(1);
+            }
         }
     }
 
@@ -111,23 +197,554 @@ getloop(const char **argv) {
 
     while (argv[idx] != 0 && argv[idx][0] == '{' && argv[idx][1] == 0) {
         idx++;
-        varlist = getvarlist(argv, '}');
+        varlist = getvarlist(argv, '}', 0);
         loop = TMPL_add_varlist(loop, varlist);
     }
     return loop;
 }
 
+/*
+ * putrefs() lists the names in "refs", indented by "depth" levels,
+ * followed by the names inside each loop statement.
+ */
+
+static void
+putrefs(const TMPL_refs *refs, int depth) {
+    const TMPL_ref *ref;
+
+    for (ref = refs->vars; ref != 0; ref = ref->next) {
+        printf("%*svar %s\n", depth * 4, "", ref->name);
+    }
+    for (ref = refs->fmts; ref != 0; ref = ref->next) {
+        printf("%*sfmt %s\n", depth * 4, "", ref->name);
+    }
+    for (ref = refs->includes; ref != 0; ref = ref->next) {
+        printf("%*sinclude %s\n", depth * 4, "", ref->name);
+    }
+    for (ref = refs->loops; ref != 0; ref = ref->next) {
+        printf("%*sloop %s\n", depth * 4, "", ref->name);
+        putrefs(ref->body, depth + 1);
+    }
+}
+
+/* listrefs() lists the names that template file "filename" refers to */
+
+static int
+listrefs(const char *filename, const TMPL_fmtlist *fmtlist) {
+    TMPL_template *tmpl;
+    TMPL_refs *refs = 0;
+
+    if ((tmpl = TMPL_compile(0, filename, 0, fmtlist, stderr)) != 0 &&
+        (refs = TMPL_get_refs(tmpl)) != 0)
+    {
+        putrefs(refs, 0);
+    }
+    TMPL_free_refs(refs);
+    TMPL_free_template(tmpl);
+    return refs == 0;
+}
+
+/*
+ * emitc() writes C code for template files "filenames" to standard
+ * output.  We return 0 on success or 1 on failure.
+ */
+
+static int
+emitc(const char **filenames, const TMPL_fmtlist *fmtlist) {
+    TMPL_context *ctx;
+    TMPL_template *tmpl;
+    const char *base, *end;
+    char funcname[256];
+    size_t len;
+    int i, ret = 0;
+
+    if ((ctx = TMPL_new_context()) == 0) {
+        return 1;
+    }
+    TMPL_enable_minify(ctx, minify);
+    printf("/* C code generated by the template command */\n\n"
+        "#include <stdio.h>\n#include <ctemplate.h>\n");
+    for (i = 0; filenames[i] != 0 && ret == 0; i++) {
+        base = (base = strrchr(filenames[i], '/')) != 0 ? base + 1 :
+            filenames[i];
+        if ((end = strchr(base, '.')) == 0 || end == base) {
+            end = base + strlen(base);
+        }
+        len = end - base;
+        if (len > sizeof(funcname) - 6) {
+            len = sizeof(funcname) - 6;
+        }
+        sprintf(funcname, "tmpl_%.*s", (int) len, base);
+        for (len = 5; funcname[len] != 0; len++) {
+            if (isalnum((unsigned char) funcname[len]) == 0) {
+                funcname[len] = '_';
+            }
+        }
+        printf("\n/* %s */\n\n", filenames[i]);
+        tmpl = TMPL_compile(ctx, filenames[i], 0, fmtlist, stderr);
+        ret = tmpl == 0 || TMPL_emit_c(tmpl, funcname, stdout, stderr) != 0;
+        TMPL_free_template(tmpl);
+    }
+    TMPL_free_context(ctx);
+    return ret;
+}
+
+/*
+ * writetmpl() outputs template file "filename" compiled with
+ * whitespace collapsed (-m), in gzip format (-z) or with render
+ * limits (-l), or only the hash of its output (-e).  We return 0 on
+ * success or 1 on failure.
+ */
+
+static int
+writetmpl(const char *filename, const TMPL_fmtlist *fmtlist,
+    const TMPL_varlist *varlist)
+{
+    TMPL_context *ctx;
+    TMPL_template *tmpl = 0;
+    unsigned long long hash;
+    int ret = 1;
+
+    if ((ctx = TMPL_new_context()) != 0) {
+        TMPL_enable_minify(ctx, minify);
+        TMPL_set_render_limits(ctx, maxbytes, maxiters, maxincludes, maxms);
+        tmpl = TMPL_compile(ctx, filename, 0, fmtlist, stderr);
+    }
+    if (tmpl != 0 && etag) {
+        ret = TMPL_render_hash(ctx, tmpl, varlist, &hash, stderr) != 0;
+        if (ret == 0) {
+            printf("%016llx\n", hash);
+        }
+    }
+    else if (tmpl != 0) {
+        ret = (gzip ?
+            TMPL_render_gzip(ctx, tmpl, varlist, -1, stdout, stderr) :
+            TMPL_render(ctx, tmpl, varlist, stdout, stderr)) != 0;
+    }
+    TMPL_free_template(tmpl);
+    TMPL_free_context(ctx);
+    return ret;
+}
+
+/*
+ * readjson() reads JSON text from file "filename" (or from standard
+ * input if "filename" is "-") and returns the variable list built
+ * from it.  On failure we exit.
+ */
+
+static TMPL_varlist *
+readjson(const char *filename) {
+    FILE *fp = stdin;
+    TMPL_varlist *varlist;
+    char *buf = 0, *newbuf;
+    size_t len = 0, size = 0, n;
+
+    if (strcmp(filename, "-") != 0 && (fp = fopen(filename, "r")) == 0) {
+        fprintf(stderr, "Cannot open JSON file \"%s\"\n", filename);
+        exit(1);
+    }
+    do {
+        if (len == size) {
+            size = size == 0 ? 65536 : size * 2;
+            if ((newbuf = realloc(buf, size)) == 0) {
+                fputs("Out of memory\n", stderr);
+                exit(1);
+            }
+            buf = newbuf;
+        }
+        len += n = fread(buf + len, 1, size - len, fp);
+    } while (n > 0);
+    if (ferror(fp)) {
+        fprintf(stderr, "Cannot read JSON file \"%s\"\n", filename);
+        exit(1);
+    }
+    if (fp != stdin) {
+        fclose(fp);
+    }
+    if ((varlist = TMPL_json_varlist(buf, len, stderr)) == 0) {
+        exit(1);
+    }
+    free(buf);
+    return varlist;
+}
+
+/*
+ * SERVER FUNCTIONS
+ *
+ * A server thread keeps a list of the templates it has compiled.
+ */
+
+typedef struct compiled compiled;
+
+struct compiled {
+    compiled *next;
+    char *filename;
+    time_t mtime;             /* modification time of the file */
+    off_t size;               /* size of the file */
+    TMPL_template *tmpl;
+};
+
+typedef struct {
+    TMPL_context *ctx;        /* render context of the thread */
+    compiled *templates;      /* templates compiled by the thread */
+} server;
+
+static const TMPL_fmtlist *serverfmts;  /* format functions */
+static TMPL_varlist *serverglobals;     /* base of each request's variables */
+
+/* the most bytes of JSON text that a request may send */
+
+#define MAX_REQUEST (16UL * 1024 * 1024)
+
+/*
+ * Connections accepted on the socket wait in a queue for a thread.
+ */
+
+#define QUEUE_SIZE 64
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;     /* signaled when a connection arrives */
+    pthread_cond_t room;      /* signaled when a connection leaves */
+    int fd[QUEUE_SIZE];
+    int head, count;
+} queue = {
+    PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_COND_INITIALIZER,
+    PTHREAD_COND_INITIALIZER
+};
+
+/*
+ * gettemplate() returns the compiled template for file "filename",
+ * compiling it if the server has not yet compiled it or if the file
+ * has changed.  We return null if the template cannot be compiled.  A
+ * template that failed is compiled again on the next request, so the
+ * error is reported each time.
+ */
+
+static TMPL_template *
+gettemplate(server *sv, const char *filename, FILE *errout) {
+    compiled *c;
+    struct stat stb;
+
+    if (stat(filename, &stb) != 0) {
+        fprintf(errout, "Cannot find template file \"%s\"\n", filename);
+        return 0;
+    }
+    for (c = sv->templates; c != 0; c = c->next) {
+        if (strcmp(c->filename, filename) == 0) {
+            break;
+        }
+    }
+    if (c != 0 && c->tmpl != 0 && c->mtime == stb.st_mtime &&
+        c->size == stb.st_size)
+    {
+        return c->tmpl;
+    }
+    if (c == 0) {
+        if ((c = (compiled *) calloc(1, sizeof(*c))) == 0 ||
+            (c->filename = strdup(filename)) == 0)
+        {
+            free(c);
+            fputs("Out of memory\n", errout);
+            return 0;
+        }
+        c->next = sv->templates;
+        sv->templates = c;
+    }
+    TMPL_free_template(c->tmpl);
+    if ((c->tmpl = TMPL_compile(sv->ctx, filename, 0, serverfmts,
+        errout)) != 0)
+    {
+        c->mtime = stb.st_mtime;
+        c->size = stb.st_size;
+    }
+    return c->tmpl;
+}
+
+/* putframe() writes a response */
+
+static int
+putframe(FILE *out, int status, const char *buf, size_t len) {
+    fprintf(out, "%d %lu\n", status, (unsigned long) len);
+    fwrite(buf, 1, len, out);
+    return fflush(out);
+}
+
+/*
+ * putoutput() is the TMPL_render_batch() output function, which
+ * writes a successful response to "arg".  A failed render is reported
+ * after its error messages are collected.
+ */
+
+static int
+putoutput(void *arg, int i, const char *buf, size_t len, int status) {
+    if (status == 0) {
+        putframe((FILE *) arg, 0, buf, len);
+    }
+    return 0;
+}
+
+/*
+ * respond() outputs template file "filename" using the "len" bytes of
+ * JSON text at "json" for variables and writes the response to "out".
+ * The variables are based on the server's global variables (if any).
+ */
+
+static void
+respond(server *sv, const char *filename, const char *json, size_t len,
+    FILE *out)
+{
+    TMPL_template *tmpl;
+    TMPL_varlist *varlist = 0;
+    const TMPL_varlist *vl;
+    FILE *errout;
+    char *errbuf = 0;
+    size_t errlen = 0;
+    int status = 1;
+
+    if ((errout = open_memstream(&errbuf, &errlen)) == 0) {
+        putframe(out, 1, "Out of memory\n", 14);
+        return;
+    }
+    if ((len == 0 || (varlist = TMPL_json_varlist(json, len, errout)) != 0)
+        && (serverglobals == 0 ||
+        (varlist = TMPL_set_base(varlist, serverglobals)) != 0)
+        && (tmpl = gettemplate(sv, filename, errout)) != 0)
+    {
+        vl = varlist;
+        status = TMPL_render_batch(sv->ctx, tmpl, &vl, 1, putoutput, out,
+            errout) != 0;
+    }
+    fclose(errout);
+    if (status != 0) {
+        putframe(out, 1, errbuf, errlen);
+    }
+    free(errbuf);
+    TMPL_free_varlist(varlist);
+}
+
+/*
+ * serve() reads requests from "in" and writes responses to "out"
+ * until end of file or a bad request.  A byte count that overflows or
+ * is over MAX_REQUEST is a bad request, so a client cannot make us
+ * allocate as much memory as it likes.
+ */
+
+static void
+serve(server *sv, FILE *in, FILE *out) {
+    char line[4096], *cp, *end, *json;
+    unsigned long len;
+
+    while (fgets(line, sizeof(line), in) != 0) {
+        if ((cp = strchr(line, '\n')) == 0 ||
+            (*cp = 0, cp = strrchr(line, ' ')) == 0 || cp == line ||
+            (errno = 0, len = strtoul(cp + 1, &end, 10), *end != 0) ||
+            end == cp + 1 || errno == ERANGE || len > MAX_REQUEST)
+        {
+            putframe(out, 1, "Bad request\n", 12);
+            return;
+        }
+        *cp = 0;
+        if ((json = malloc(len + 1)) == 0) {
+            putframe(out, 1, "Out of memory\n", 14);
+            return;
+        }
+        if (fread(json, 1, len, in) != len) {
+            free(json);
+            return;
+        }
+        respond(sv, line, json, len, out);
+        free(json);
+    }
+}
+
+/* newserver() sets up the state of a server thread */
+
+static server *
+newserver(void) {
+    server *sv;
+
+    if ((sv = (server *) calloc(1, sizeof(*sv))) == 0 ||
+        (sv->ctx = TMPL_new_context()) == 0)
+    {
+        fputs("Out of memory\n", stderr);
+        exit(1);
+    }
+    TMPL_enable_minify(sv->ctx, minify);
+    TMPL_set_render_limits(sv->ctx, maxbytes, maxiters, maxincludes, maxms);
+    return sv;
+}
+
+/*
+ * worker() is a server thread, which serves connections from the
+ * queue one at a time.
+ */
+
+static void *
+worker(void *arg) {
+    server *sv = newserver();
+    FILE *in, *out;
+    int fd;
+
+    for (;;) {
+        pthread_mutex_lock(&queue.lock);
+        while (queue.count == 0) {
+            pthread_cond_wait(&queue.ready, &queue.lock);
+        }
+        fd = queue.fd[queue.head];
+        queue.head = (queue.head + 1) % QUEUE_SIZE;
+        queue.count--;
+        pthread_cond_signal(&queue.room);
+        pthread_mutex_unlock(&queue.lock);
+
+        if ((in = fdopen(fd, "r")) == 0) {
+            close(fd);
+            continue;
+        }
+        if ((out = fdopen(dup(fd), "w")) != 0) {
+            serve(sv, in, out);
+            fclose(out);
+        }
+        fclose(in);
+    }
+    return 0;
+}
+
+/*
+ * runserver() accepts connections on Unix domain socket "sockname"
+ * and passes them to "nthreads" server threads.  We never return
+ * unless something goes wrong.  We remove an old socket of that name,
+ * but we refuse to start if the name is some other kind of file, which
+ * may well be a template given by mistake.
+ */
+
+static int
+runserver(const char *sockname, int nthreads) {
+    struct sockaddr_un addr;
+    struct stat stb;
+    pthread_t tid;
+    int sock, fd, i;
+
+    if (strlen(sockname) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket name \"%s\" is too long\n", sockname);
+        return 1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, sockname);
+    if (lstat(sockname, &stb) == 0) {
+        if (!S_ISSOCK(stb.st_mode)) {
+            fprintf(stderr, "\"%s\" exists and is not a socket\n", sockname);
+            return 1;
+        }
+        unlink(sockname);
+    }
+    if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+        bind(sock, (struct sockaddr *) &addr, sizeof(addr)) != 0 ||
+        listen(sock, QUEUE_SIZE) != 0)
+    {
+        perror(sockname);
+        return 1;
+    }
+    for (i = 0; i < nthreads; i++) {
+        if (pthread_create(&tid, 0, worker, 0) != 0) {
+            fputs("Cannot create thread\n", stderr);
+            return 1;
+        }
+    }
+    for (;;) {
+        if ((fd = accept(sock, 0, 0)) < 0) {
+            continue;
+        }
+        pthread_mutex_lock(&queue.lock);
+        while (queue.count == QUEUE_SIZE) {
+            pthread_cond_wait(&queue.room, &queue.lock);
+        }
+        queue.fd[(queue.head + queue.count++) % QUEUE_SIZE] = fd;
+        pthread_cond_signal(&queue.ready);
+        pthread_mutex_unlock(&queue.lock);
+    }
+}
+
 int
 main(int argc, const char **argv) {
-    TMPL_varlist *varlist;
+    TMPL_varlist *varlist = 0;
     TMPL_fmtlist *fmtlist;
+    const char *filename, *jsonfile = 0;
     int ret;
 
-    idx = 2;
-    varlist = getvarlist(argv, 0);
     fmtlist = TMPL_add_fmt(0, "entity", TMPL_encode_entity);
     TMPL_add_fmt(fmtlist, "url", TMPL_encode_url);
-    ret = TMPL_write(argv[1], 0, fmtlist, varlist, stdout, stderr) != 0;
+    for (;;) {
+        if (argc >= 2 && strcmp(argv[1], "-m") == 0) {
+            minify = 1;
+        }
+        else if (argc >= 2 && strcmp(argv[1], "-z") == 0) {
+            gzip = 1;
+        }
+        else if (argc >= 2 && strcmp(argv[1], "-e") == 0) {
+            etag = 1;
+        }
+        else if (argc >= 3 && strcmp(argv[1], "-l") == 0) {
+            if (sscanf(argv[2], "%llu,%lu,%lu,%lu", &maxbytes, &maxiters,
+                &maxincludes, &maxms) < 1)
+            {
+                fprintf(stderr, "Bad limits \"%s\"\n", argv[2]);
+                return 1;
+            }
+            limited = 1;
+            argv++;
+            argc--;
+        }
+        else if (argc >= 3 && strcmp(argv[1], "-j") == 0) {
+            jsonfile = argv[2];
+            argv++;
+            argc--;
+        }
+        else {
+            break;
+        }
+        argv++;
+        argc--;
+    }
+    if (argc >= 2 && argc <= 4 && strcmp(argv[1], "-s") == 0) {
+        signal(SIGPIPE, SIG_IGN);
+        serverfmts = fmtlist;
+        if (jsonfile != 0) {
+            serverglobals = readjson(jsonfile);
+        }
+        if (argc == 2) {
+            serve(newserver(), stdin, stdout);
+            return 0;
+        }
+        return runserver(argv[2], argc == 4 ? atoi(argv[3]) : 4);
+    }
+    if (argc >= 3 && strcmp(argv[1], "-c") == 0) {
+        ret = emitc(argv + 2, fmtlist);
+        TMPL_free_fmtlist(fmtlist);
+        return ret;
+    }
+    if (argc == 3 && strcmp(argv[1], "-r") == 0) {
+        ret = listrefs(argv[2], fmtlist);
+        TMPL_free_fmtlist(fmtlist);
+        return ret;
+    }
+    idx = 1;
+    if (jsonfile != 0) {
+        varlist = readjson(jsonfile);
+    }
+    filename = argv[idx];
+    if (filename != 0) {
+        idx++;
+    }
+    varlist = getvarlist(argv, 0, varlist);
+    if ((minify || gzip || limited || etag) && filename != 0) {
+        ret = writetmpl(filename, fmtlist, varlist);
+    }
+    else {
+        ret = TMPL_write(filename, 0, fmtlist, varlist, stdout, stderr) != 0;
+    }
     TMPL_free_fmtlist(fmtlist);
     TMPL_free_varlist(varlist);
     return ret;